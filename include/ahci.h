@@ -0,0 +1,110 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include <stdint.h>
+#include "pci.h"
+#include "blkdev.h"
+
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+#define AHCI_MAX_SECTORS 128 // per command, larger transfers are split across queued commands
+#define AHCI_PRD_MAX 8
+#define AHCI_TIMEOUT 5000
+
+#define AHCI_CAP 	0x00
+#define AHCI_GHC 	0x04
+#define AHCI_IS 	0x08
+#define AHCI_PI 	0x0C
+
+#define AHCI_CAP_SNCQ 		(1 << 30)
+#define AHCI_CAP_NCS(cap) 	((((cap) >> 8) & 0x1F) + 1)
+#define AHCI_GHC_AE 		(1u << 31)
+
+#define AHCI_PORT(n) (0x100 + (n) * 0x80)
+#define AHCI_PxCLB 	0x00
+#define AHCI_PxCLBU 0x04
+#define AHCI_PxFB 	0x08
+#define AHCI_PxFBU 	0x0C
+#define AHCI_PxIS 	0x10
+#define AHCI_PxIE 	0x14
+#define AHCI_PxCMD 	0x18
+#define AHCI_PxTFD 	0x20
+#define AHCI_PxSIG 	0x24
+#define AHCI_PxSSTS 0x28
+#define AHCI_PxSERR 0x30
+#define AHCI_PxSACT 0x34
+#define AHCI_PxCI 	0x38
+
+#define AHCI_PxCMD_ST 	(1 << 0)
+#define AHCI_PxCMD_FRE 	(1 << 4)
+#define AHCI_PxCMD_FR 	(1 << 14)
+#define AHCI_PxCMD_CR 	(1 << 15)
+
+#define AHCI_PxIS_TFES (1 << 30) // task file error
+
+#define AHCI_SSTS_DET(ssts) ((ssts) & 0xF)
+#define AHCI_DET_PRESENT 3
+#define AHCI_SIG_ATA 0x00000101
+
+#define AHCI_FIS_H2D 0x27
+
+#define AHCI_CMD_CFL(dwords) 	(dwords)
+#define AHCI_CMD_WRITE 			(1 << 6)
+#define AHCI_CMD_PRDTL(n) 		((n) << 16)
+
+#define ATA_READ_DMA_EXT 	0x25
+#define ATA_WRITE_DMA_EXT 	0x35
+#define ATA_READ_FPDMA 		0x60 // native command queuing
+#define ATA_WRITE_FPDMA 	0x61
+#define ATA_FLUSH_EXT 		0xEA
+
+typedef struct {
+    uint32_t flags;
+    uint32_t prdbc;
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} ahci_header_t;
+
+typedef struct {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc; // byte count - 1
+} ahci_prd_t;
+
+typedef struct {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    ahci_prd_t prdt[AHCI_PRD_MAX];
+} ahci_table_t;
+
+typedef struct {
+    int present;
+    int ncq;
+    uint32_t depth; // commands allowed in flight
+    uint32_t busy;
+    ahci_header_t *list;
+    uint8_t *fis;
+    ahci_table_t *tables;
+} ahci_port_t;
+
+extern pci_device_t *ahci_device;
+extern uint32_t ahci_abar;
+extern ahci_port_t ahci_ports[AHCI_MAX_PORTS];
+
+extern int ahci_init();
+extern int ahci_first_port();
+extern int ahci_port_ready(int port);
+extern int ahci_identify(int port, void *buffer);
+extern int ahci_enable_ncq(int port, void *identify);
+extern int ahci_submit(int port, uint32_t lba, uint32_t count, void *buffer, int write);
+extern int ahci_wait(int port, int slot);
+extern int ahci_drain(int port);
+extern int ahci_read(int port, uint32_t lba, uint32_t count, void *buffer);
+extern int ahci_write(int port, uint32_t lba, uint32_t count, void *buffer);
+extern int ahci_flush(int port);
+extern int ahci_blkdev(blkdev_t *dev, int port);
+
+#endif
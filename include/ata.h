@@ -3,8 +3,10 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "blkdev.h"
 
 #define ATA_MAX_DEV 4
+#define ATA_RETRIES 2 // extra attempts on a failed transfer before giving up
 
 #define ATA_PRIMARY 	0x1F0
 #define ATA_SECONDARY 	0x170
@@ -25,6 +27,13 @@
 #define ATA_CTRL_STATUS 0x3F6
 #define ATA_CTRL_DEVICE 0x3F6
 #define ATA_CTRL_DRIVE 	0x3F7
+#define ATA_CTRL_OFFSET 0x206 // control block relative to the command block
+
+#define ATA_CTRL_NIEN (1 << 1) // interrupt disable
+
+#define ATA_IRQ_PRIMARY 	14
+#define ATA_IRQ_SECONDARY 	15
+#define ATA_IRQ_TIMEOUT 	5000
 
 #define ATA_ERROR_AMNF 	(1 << 0) // address not found
 #define ATA_ERROR_TKZNF (1 << 1) // track zero not found
@@ -51,24 +60,41 @@
 
 #define ATA_READ 		0x20
 #define ATA_WRITE 		0x30
+#define ATA_READ_MULTIPLE 	0xC4
+#define ATA_WRITE_MULTIPLE 	0xC5
+#define ATA_SET_MULTIPLE 	0xC6
+#define ATA_READ_DMA 		0xC8
+#define ATA_WRITE_DMA 		0xCA
 #define ATA_FLUSH 		0xE7
 #define ATA_IDENTIFY	0xEC
 
+#define ATA_MAX_SECTORS 256 // per command, sector count register 0 means 256
+
+extern int ata_irq_enabled;
+
 extern uint16_t ata_port(uint16_t base, uint8_t port);
 extern uint8_t ata_status(uint16_t base);
 extern void ata_command(uint16_t base, uint8_t command);
 extern uint16_t ata_read(uint16_t base);
 extern void ata_write(uint16_t base, uint16_t data);
 extern void ata_clear_lba(uint16_t base);
-extern void ata_set_lba(uint16_t base, uint32_t lba);
+extern void ata_set_lba(uint16_t base, uint32_t lba, uint32_t count);
 extern void ata_wait_io(uint16_t base);
 extern int ata_wait_ready(uint16_t base);
 extern int ata_wait_data(uint16_t base);
 extern void ata_select(uint16_t base, uint8_t drive);
-extern int ata_prepare(uint16_t base, uint32_t lba, uint8_t command);
+extern void ata_irq_init();
+extern void ata_handle(uint8_t irq);
+extern int ata_wait_irq(uint16_t base, uint8_t *status);
+extern int ata_prepare(uint16_t base, uint32_t lba, uint32_t count, uint8_t command);
 extern int ata_identify(uint16_t base, void *buffer);
+extern int ata_set_multiple(uint16_t base, void *identify);
+extern int ata_read_sectors(uint16_t base, uint32_t lba, uint32_t count, void *buffer);
+extern int ata_write_sectors(uint16_t base, uint32_t lba, uint32_t count, void *buffer);
 extern int ata_read_sector(uint16_t base, uint32_t lba, void *buffer);
 extern int ata_write_sector(uint16_t base, uint32_t lba, void *buffer);
+extern int ata_flush(uint16_t base);
 extern int ata_get_string(uint16_t *w, int start, int end, char *dest, size_t size);
+extern int ata_blkdev(blkdev_t *dev, uint16_t base, uint8_t drive);
 
 #endif
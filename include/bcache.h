@@ -0,0 +1,48 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include "blkq.h"
+
+#define BCACHE_DEFAULT_BLOCKS 512 // 256K
+#define BCACHE_MIN_BLOCKS 16
+#define BCACHE_HASH 256
+#define BCACHE_BYPASS 32 // missed reads and unpinned writes at least this long skip the cache, big file transfers would only flush it
+
+typedef struct bcache_buf bcache_buf_t;
+
+struct bcache_buf {
+    blkdev_t *dev;
+    uint32_t lba;
+    int dirty;
+    int pinned; // dirty but held back from the disk, the journal decides when it may go
+
+    bcache_buf_t *hash_next;
+    bcache_buf_t *lru_prev; // towards the most recently used
+    bcache_buf_t *lru_next;
+
+    uint8_t data[512];
+};
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t writebacks;
+} bcache_stats_t;
+
+extern uint32_t bcache_budget;
+extern uint32_t bcache_blocks;
+extern uint32_t bcache_dirty;
+extern uint32_t bcache_pinned;
+extern bcache_stats_t bcache_stats;
+extern int (*bcache_pressure)(blkdev_t *dev); // with only pinned blocks left, nonzero once some were unpinned
+
+extern void bcache_set_budget(uint32_t blocks);
+extern int bcache_read(blkq_t *queue, uint32_t lba, uint32_t count, void *buffer);
+extern int bcache_write(blkq_t *queue, uint32_t lba, uint32_t count, const void *buffer, int pin);
+extern int bcache_sync(blkq_t *queue);
+extern void bcache_invalidate(blkdev_t *dev);
+extern void bcache_unpin_all(blkdev_t *dev);
+
+#endif
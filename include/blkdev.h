@@ -0,0 +1,76 @@
+#ifndef BLKDEV_H
+#define BLKDEV_H
+
+#include <stdint.h>
+
+#define BLKDEV_OK 0
+#define BLKDEV_ABSENT 1
+#define BLKDEV_INCOMPATIBLE 2
+
+#define BLKDEV_ATA 0
+#define BLKDEV_AHCI 1
+#define BLKDEV_VIRTIO 2
+#define BLKDEV_RAM 3
+
+#define BLKDEV_MAX_TAGS 32
+#define BLKDEV_HIST_BUCKETS 24 // log2 of the latency in microseconds, the last one catches the rest
+
+typedef struct {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t flushes;
+    uint32_t read_sectors;
+    uint32_t write_sectors;
+    uint32_t errors;
+    uint32_t retries;
+    uint32_t timeouts;
+
+    uint32_t read_hist[BLKDEV_HIST_BUCKETS];
+    uint32_t write_hist[BLKDEV_HIST_BUCKETS];
+    uint32_t flush_hist[BLKDEV_HIST_BUCKETS];
+} blkdev_stats_t;
+
+typedef struct {
+    uint64_t start;
+    uint32_t count;
+    int write;
+} blkdev_tag_t;
+
+typedef struct blkdev blkdev_t;
+
+struct blkdev {
+    uint8_t type;
+    uint32_t dev; // driver handle, ata base or ahci port
+    void *data;
+
+    uint32_t block_size;
+    uint32_t blocks;
+    uint32_t max_blocks; // per transfer
+
+    char serial[21];
+    char rev[9];
+    char model[41];
+
+    blkdev_stats_t stats;
+    blkdev_tag_t tags[BLKDEV_MAX_TAGS]; // issued but not yet waited on
+
+    int (*read)(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer);
+    int (*write)(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer);
+    int (*flush)(blkdev_t *dev);
+
+    // optional, lets several transfers be outstanding at once
+    int (*issue)(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer, int write); // returns a tag, -1 when full
+    int (*wait)(blkdev_t *dev, int tag);
+};
+
+extern uint32_t blkdev_timeouts; // bumped by drivers, charged to the device doing the transfer
+
+extern void blkdev_from_identify(blkdev_t *dev, uint16_t *identify);
+extern int blkdev_read(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer);
+extern int blkdev_write(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer);
+extern int blkdev_flush(blkdev_t *dev);
+extern int blkdev_issue(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer, int write);
+extern int blkdev_wait(blkdev_t *dev, int tag);
+extern void blkdev_stats_reset(blkdev_t *dev);
+
+#endif
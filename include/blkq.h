@@ -0,0 +1,40 @@
+#ifndef BLKQ_H
+#define BLKQ_H
+
+#include <stdint.h>
+#include "blkdev.h"
+
+#define BLKQ_MAX_SECTORS 1024 // queued sectors before the queue dispatches on its own
+#define BLKQ_MAX_INFLIGHT 32 // runs handed to a queueing device before reaping any
+
+typedef struct blkq_request blkq_request_t;
+typedef void (*blkq_callback_t)(blkq_request_t *request, int status);
+
+struct blkq_request {
+    uint32_t lba;
+    uint32_t count;
+    uint8_t *buffer; // must stay valid until completion, later writes may be combined into it
+    int write;
+
+    blkq_callback_t callback;
+    void *data;
+
+    blkq_request_t *next;
+};
+
+typedef struct {
+    blkdev_t *dev;
+
+    uint32_t head; // where the last dispatch left the disk head
+    uint32_t sectors;
+    blkq_request_t *pending; // sorted by lba
+} blkq_t;
+
+extern void blkq_init(blkq_t *queue, blkdev_t *dev);
+extern int blkq_submit(blkq_t *queue, uint32_t lba, uint32_t count, void *buffer, int write, blkq_callback_t callback, void *data);
+extern int blkq_run(blkq_t *queue);
+extern int blkq_pending(blkq_t *queue);
+extern int blkq_read(blkq_t *queue, uint32_t lba, uint32_t count, void *buffer);
+extern int blkq_write(blkq_t *queue, uint32_t lba, uint32_t count, void *buffer);
+
+#endif
@@ -7,7 +7,15 @@ extern char cpu_name[64];
 extern char cpu_vendor[16];
 extern uint32_t cpu_family;
 extern uint32_t cpu_model;
+extern uint32_t cpu_tsc_khz; // 0 when there is no usable time stamp counter
+
+static inline uint64_t cpu_rdtsc() {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t) hi << 32) | lo;
+}
 
 extern void cpu_init();
+extern uint64_t cpu_micros();
 
 #endif
\ No newline at end of file
@@ -3,32 +3,96 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "blkdev.h"
 
 #define FILE_MAGIC 0x4F474E4D
-#define FILE_VERSION 1
+#define FILE_VERSION 12
 #define FILE_SECTOR_SUPERBLOCK 2048
 #define FILE_SECTOR_ROOT 2049
+#define FILE_SECTOR_BITMAP 2050 // one bit per sector, set when in use, the journal follows it
 
 #define FILE_DATA (1 << 0)
 #define FILE_FOLDER (1 << 1)
+#define FILE_INLINE (1 << 2) // data kept in the node sector, where the extents would go
+#define FILE_COMPRESSED (1 << 3) // data deflated a chunk at a time, behind an index of the chunks
 
 #define FILE_MAX_NAME 32
 #define FILE_MAX_PATH 1024
 
+#define FILE_BLOCK_SIZE 512
+#define FILE_NODE_SIZE 128 // nodes are packed into sectors and addressed by number
+#define FILE_NODES_PER_SECTOR (FILE_BLOCK_SIZE / FILE_NODE_SIZE)
+#define FILE_NODE_SECTOR(number) ((number) / FILE_NODES_PER_SECTOR)
+#define FILE_NODE_ROOT (FILE_SECTOR_ROOT * FILE_NODES_PER_SECTOR)
+#define FILE_NODE_EXTENTS 5 // extents kept in the node, after the header
+#define FILE_NODE_EXTENT_OFFSET 88
+#define FILE_INDIRECT_EXTENTS 63
+#define FILE_DELTA_RUN 16 // blocks read back at once when file_write compares contents
+#define FILE_INLINE_SLOT (FILE_NODE_SIZE - FILE_NODE_EXTENT_OFFSET) // inline bytes that fit in the node's own slot
+#define FILE_INLINE_MAX (FILE_BLOCK_SIZE - FILE_NODE_EXTENT_OFFSET) // largest file kept inline, past its slot it runs on over the free slots after it
+#define FILE_INLINE_SPANS(size) ((size) > FILE_INLINE_SLOT ? ((size) - FILE_INLINE_SLOT + FILE_NODE_SIZE - 1) / FILE_NODE_SIZE : 0)
+#define FILE_INDEX_ENTRIES 64 // name index slots per folder data block
+#define FILE_DENTRY_ENTRIES 128 // remembered name lookups
+#define FILE_CHUNK_SIZE 4096 // bytes deflated together, reading anywhere in a file inflates one chunk
+#define FILE_CHUNK_BLOCKS (FILE_CHUNK_SIZE / FILE_BLOCK_SIZE)
+#define FILE_CHUNK_RAW 0x80000000 // length flag of a chunk that didn't shrink and is kept as is
+#define FILE_DEFLATE_WINDOW 12 // a chunk never reaches back further than itself
+#define FILE_DEFLATE_MEMORY 5 // zlib memlevel, keeps the deflate state around 24 KB
+
+#define FILE_JOURNAL_MAGIC 0x4C4E524A
+#define FILE_JOURNAL_SECTORS 256 // log space on top of two sectors per bitmap and refcount sector
+#define FILE_JOURNAL_ENTRIES 122 // block numbers a descriptor holds
+#define FILE_JOURNAL_TXN 64 // most metadata blocks one operation writes, the superblock and table sectors aside
+#define FILE_JOURNAL_GROUP 16 // finished operations share a commit until this many blocks gather
+#define FILE_COMMIT_SECONDS 5 // longest a finished operation waits for its commit
+#define FILE_REF_MAX 255 // owners past the first a refcount byte can hold
+#define FILE_DELETE_PROGRESS 1024 // items a folder delete frees between progress reports
+#define FILE_DEFRAG_PROGRESS 256 // items a defrag goes over between progress reports
+#define FILE_DEFRAG_RUN 16 // blocks a defrag copies at once
+#define FILE_DEFRAG_CHILDREN 48 // folders with more children keep their node, relinking them must fit FILE_JOURNAL_TXN
+
+#define FILE_SLOT_AHCI 5 // slots from here on map to ahci ports
+#define FILE_SLOT_VIRTIO 37 // past the last ahci port
+#define FILE_SLOT_RAM 38
+
 #define FILE_DRIVE_UNSET -1
-#define FILE_DRIVE_OK 0
-#define FILE_DRIVE_ABSENT 1
-#define FILE_DRIVE_INCOMPATIBLE 2
+#define FILE_DRIVE_OK BLKDEV_OK
+#define FILE_DRIVE_ABSENT BLKDEV_ABSENT
+#define FILE_DRIVE_INCOMPATIBLE BLKDEV_INCOMPATIBLE
 
 typedef struct file_superblock {
     uint32_t magic;
     uint32_t version;
     uint32_t sectors;
     uint32_t used;
-    uint32_t free;
-    uint32_t free_list;
+    uint32_t hint; // where the next allocation starts looking
+    uint32_t bitmap;
+    uint32_t bitmap_sectors;
+    uint32_t journal; // header sector, the log follows it
+    uint32_t journal_sectors;
+    uint32_t refcount; // one byte per sector, owners past the first, after the journal
+    uint32_t refcount_sectors;
+    uint32_t shared; // blocks with more than one owner, while none the table isn't looked at
+    uint32_t orphan; // a deleted folder still being freed, mounting finishes it
 } file_superblock_t;
 
+// commits are logged one after another from the start of the log, a checkpoint starts it over
+typedef struct file_journal_header {
+    uint32_t magic;
+    uint32_t sequence; // what the first commit in the log has to carry
+} file_journal_header_t;
+
+// comes before the images of its blocks, a commit is whole once a descriptor marked last is read
+typedef struct file_journal_desc {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t count; // blocks whose images follow
+    uint32_t revokes; // freed blocks listed after those, their older images aren't replayed
+    uint32_t last;
+    uint32_t checksum; // over the fields above it, the entries and the images
+    uint32_t entries[FILE_JOURNAL_ENTRIES];
+} file_journal_desc_t;
+
 typedef struct file_node {
     uint64_t time_created;
     uint64_t time_changed;
@@ -36,46 +100,119 @@ typedef struct file_node {
     uint32_t parent;
     uint32_t child_head;
     uint32_t child_next;
-    
+    uint32_t child_prev;
+    uint32_t child_tail; // folders append new children here
+    uint32_t children; // folders: entries in the name index kept in their data blocks
+
     uint32_t size;
-    uint32_t first_block;
+    uint32_t extent_count; // across the node and its indirect blocks
+    uint32_t indirect; // first indirect extent block, 0 while the node holds them all
     char name[FILE_MAX_NAME];
     uint8_t flags;
 } file_node_t;
 
-typedef struct file_data {
+typedef struct file_extent {
+    uint32_t start;
+    uint32_t count;
+} file_extent_t;
+
+// a compressed file's blocks open with one of these per chunk, the chunks follow block aligned
+typedef struct file_chunk {
+    uint32_t block; // file block the chunk starts at
+    uint32_t length; // deflated bytes, or FILE_CHUNK_RAW with the plain length
+} file_chunk_t;
+
+// runs added up over a tree, inline files have no blocks and aren't counted
+typedef struct file_frag {
+    uint32_t items; // files and folders with blocks of their own
+    uint32_t fragmented; // those in more than one run
+    uint32_t blocks;
+    uint32_t extents;
+} file_frag_t;
+
+typedef struct file_indirect {
     uint32_t next;
-    uint8_t data[508];
+    uint32_t count;
+    file_extent_t extents[FILE_INDIRECT_EXTENTS];
+} file_indirect_t;
+
+// folders hash child names into an open-addressed table, a zero sector marks a free slot
+typedef struct file_index_entry {
+    uint32_t hash;
+    uint32_t sector;
+} file_index_entry_t;
+
+// a remembered lookup of one name in one folder, 0 sectors record that the type isn't there
+typedef struct file_dentry {
+    uint32_t parent; // 0 while the slot is unused
+    uint32_t file;
+    uint32_t folder;
+    char name[FILE_MAX_NAME];
+} file_dentry_t;
+
+typedef struct file_data {
+    uint8_t data[FILE_BLOCK_SIZE];
 } file_data_t;
 
+// a file's extents in memory, with the file block each one begins at for lookups
+typedef struct file_map {
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t blocks;
+    file_extent_t *extents;
+    uint32_t *first;
+} file_map_t;
+
 typedef struct {
     char serial[21];
     char rev[9];
     char model[41];
 } drive_t;
 
-uint16_t file_port;
-uint8_t file_drive;
 uint32_t file_current;
+extern blkdev_t file_device;
 extern int file_drive_status;
+extern uint32_t file_handles; // fio handles open, each holds node numbers and block maps
 
-extern int file_init(uint16_t base, uint8_t drive);
+extern int file_init(blkdev_t *dev, int status);
+extern int file_ramdisk(uint32_t blocks);
 extern int file_init_by_slot(uint8_t slot);
 extern int file_drive_slot();
 extern int file_drive_spec(drive_t *drive);
 
 extern void file_format();
+extern int file_sync();
+extern void file_commit();
+extern void file_idle();
+extern void file_batch_begin();
+extern void file_batch_end();
 extern int file_is_formatted();
 extern int file_is_ready();
 
 extern void file_read_sb(file_superblock_t *sb);
 extern void file_write_sb(file_superblock_t *sb);
 
-extern void file_node(uint32_t sector, file_node_t *node);
-extern void file_node_write(uint32_t sector, file_node_t *node);
+extern void file_node(uint32_t number, file_node_t *node);
+extern void file_node_write(uint32_t number, file_node_t *node);
+extern uint32_t file_node_alloc(uint32_t near, file_node_t *node);
+extern void file_node_free(uint32_t number);
 
 extern void file_data(uint32_t sector, file_data_t *node);
 extern void file_data_write(uint32_t sector, file_data_t *node);
+extern int file_data_run(uint32_t sector, uint32_t count, file_data_t *data);
+extern int file_data_run_write(uint32_t sector, uint32_t count, file_data_t *data);
+extern void file_inline_read(uint32_t number, file_data_t *data);
+extern int file_inline_write(uint32_t number, file_node_t *node, const void *data, size_t size);
+extern uint32_t file_inline_room(uint32_t number);
+
+extern void file_map_load(uint32_t number, file_node_t *node, file_map_t *map);
+extern int file_map_store(uint32_t number, file_node_t *node, file_map_t *map);
+extern void file_map_free(file_map_t *map);
+extern void file_map_release(file_map_t *map);
+extern void file_map_truncate(file_map_t *map, uint32_t blocks);
+extern int file_map_append(file_map_t *map, uint32_t start, uint32_t count);
+extern uint32_t file_map_lookup(file_map_t *map, uint32_t block, uint32_t *run);
+extern int file_map_unshare(file_map_t *map, uint32_t block, uint32_t count, uint32_t *moved);
 
 extern uint32_t file_get_node(const char *path);
 extern uint32_t file_get_node2(const char *parent, const char *basename);
@@ -84,19 +221,31 @@ extern uint32_t file_get(uint32_t parent, const char *name);
 extern int file_exists(uint32_t parent, const char *name);
 extern int file_create(uint32_t parent, const char *name);
 extern int file_delete(uint32_t parent, const char *name);
+extern int file_move(uint32_t sector, uint32_t parent, const char *name, int replace);
 
 extern uint32_t folder_get(uint32_t parent, const char *name);
 extern int folder_exists(uint32_t parent, const char *name);
 extern int folder_create(uint32_t parent, const char *name);
 extern int folder_delete(uint32_t parent, const char *name);
+extern int folder_delete_progress(uint32_t parent, const char *name, void (*progress)(uint32_t removed));
+
+extern int file_defrag(uint32_t top, void (*progress)(uint32_t done));
+extern void file_fragstat(uint32_t top, file_frag_t *frag, void (*each)(uint32_t sector, uint32_t blocks, uint32_t extents));
 
 extern int file_split_path(const char *path, char *out_parent, char *out_name);
 extern void file_get_abspath(uint32_t parent, char *path, size_t size);
 
 extern void file_sector_free(uint32_t sector);
 extern uint32_t file_sector_alloc();
+extern void file_run_free(uint32_t sector, uint32_t count);
+extern uint32_t file_run_alloc(uint32_t near, uint32_t count, uint32_t *got);
 
 extern int file_write(uint32_t sector, const char *data, size_t size);
+extern int file_append(uint32_t sector, const char *data, size_t size);
+extern int file_clone(uint32_t source, uint32_t dest);
+extern int file_compress(uint32_t sector);
+extern int file_expand(uint32_t sector);
+extern uint32_t file_chunk_read(file_map_t *map, uint32_t size, uint32_t chunk, char *out);
 extern char *file_read(uint32_t sector);
 
 extern int file_path_isfile(const char *path);
@@ -3,8 +3,10 @@
 
 #include "file.h"
 
-#define FIO_FS_BLOCKSIZE 508
+#define FIO_FS_BLOCKSIZE FILE_BLOCK_SIZE
 #define FIO_EOF -1
+#define FIO_READAHEAD 32 // most blocks prefetched at once on sequential reads
+#define FIO_COPY_BLOCKS 8 // blocks a copy holds in flight between source and destination
 
 #define FIO_READ 114 // 'r' - read
 #define FIO_WRITE 119 // 'w' - write
@@ -14,14 +16,29 @@ typedef struct {
     uint32_t file;
     uint32_t seek;
     uint8_t mode;
-    uint32_t last_sector;
-    uint32_t last_block;
-    uint32_t block_cache;
+    uint32_t last_sector; // file block held in block
+    uint32_t last_block; // and where it lives on disk, 0 when nothing is held
     file_node_t *node;
     file_data_t *block;
+    file_map_t map;
+    int map_dirty;
+    uint32_t inline_room; // bytes an inline file can reach without leaving its node sector
+
+    // blocks [ahead_start, ahead_start + ahead_count) of the file, stored at ahead_sector onward
+    file_data_t *ahead;
+    uint32_t ahead_start;
+    uint32_t ahead_sector;
+    uint32_t ahead_count;
+    uint32_t ahead_window;
+
+    // the inflated chunk of a compressed file, chunk_sector is 0 while none is held
+    char *chunk;
+    uint32_t chunk_index;
+    uint32_t chunk_sector;
 } fio_t;
 
 extern fio_t *fio_open(const char *path, uint8_t mode);
+extern fio_t *fio_open_node(uint32_t node, uint8_t mode);
 extern int fio_getc(fio_t *fio);
 extern int fio_peek(fio_t *fio);
 extern int fio_eof(fio_t *fio);
@@ -29,5 +46,6 @@ extern int fio_putc(fio_t *fio, char c);
 extern int fio_read(fio_t *fio, char *dest, size_t length);
 extern int fio_write(fio_t *fio, const char *str, size_t length);
 extern int fio_close(fio_t *fio);
+extern int fio_copy(uint32_t source, uint32_t dest);
 
 #endif
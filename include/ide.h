@@ -0,0 +1,37 @@
+#ifndef IDE_H
+#define IDE_H
+
+#include <stdint.h>
+#include "pci.h"
+
+#define IDE_BM_COMMAND 	0
+#define IDE_BM_STATUS 	2
+#define IDE_BM_PRDT 	4
+
+#define IDE_BM_CMD_START 	(1 << 0)
+#define IDE_BM_CMD_READ 	(1 << 3) // bus master writes into memory
+
+#define IDE_BM_STATUS_ACTIVE 	(1 << 0)
+#define IDE_BM_STATUS_ERR 		(1 << 1)
+#define IDE_BM_STATUS_IRQ 		(1 << 2)
+
+#define IDE_PRD_EOT 0x8000
+#define IDE_PRD_MAX 8 // 256 sectors split on 64K boundaries needs at most 3
+
+typedef struct {
+    uint32_t addr;
+    uint16_t size; // 0 means 64K
+    uint16_t flags;
+} __attribute__((packed)) ide_prd_t;
+
+extern pci_device_t *ide_device;
+extern uint16_t ide_bm;
+
+extern int ide_init();
+extern uint16_t ide_bm_port(uint16_t base, uint8_t reg);
+extern int ide_dma_enable(uint16_t base, void *identify);
+extern void ide_dma_disable(uint16_t base);
+extern int ide_dma_enabled(uint16_t base);
+extern int ide_dma_transfer(uint16_t base, uint32_t lba, uint32_t count, void *buffer, int write);
+
+#endif
@@ -33,4 +33,12 @@ static inline uint32_t inl(uint16_t port) {
     return ret;
 }
 
+static inline void insw(uint16_t port, void *buffer, uint32_t count) {
+    __asm__ volatile("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void *buffer, uint32_t count) {
+    __asm__ volatile("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
 #endif
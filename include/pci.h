@@ -5,6 +5,7 @@
 
 #define PCI_MAX_BUS 256
 #define PCI_MAX_DEV 32
+#define PCI_MAX_FUNC 8
 
 #define PCI_ENABLE (uint32_t)0x80000000
 #define PCI_CMD 0xCF8
@@ -17,12 +18,19 @@
 #define PCI_REG_INT 0x3C
 #define PCI_REG_BAR(n) (0x10 + (n << 2))
 
+#define PCI_CMD_IO (1 << 0)
+#define PCI_CMD_MEMORY (1 << 1)
+#define PCI_CMD_MASTER (1 << 2)
+
+#define PCI_HEADER_MULTIFUNC (1 << 7)
+
 #define PCI_VENDOR(config) ((config) & 0xFFFF)
 #define PCI_DEVICE(config) ((config) >> 16)
 
 typedef struct {
 	uint8_t bus;
 	uint8_t dev;
+	uint8_t func;
 
 	uint16_t device_id;
 	uint16_t vendor_id;
@@ -39,6 +47,9 @@ extern uint32_t pci_read_config(uint8_t bus, uint8_t dev, uint8_t func, uint8_t
 extern void pci_write_config(uint32_t value, uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset);
 
 extern int pci_get_device(pci_device_t *device, uint8_t bus, uint8_t dev);
+extern int pci_get_function(pci_device_t *device, uint8_t bus, uint8_t dev, uint8_t func);
+extern int pci_find_class(pci_device_t *device, uint8_t class_code, uint8_t subclass);
+extern int pci_find_id(pci_device_t *device, uint16_t vendor_id, uint16_t device_id);
 extern uint32_t pci_device_read(pci_device_t *device, uint8_t func, uint8_t offset);
 extern void pci_device_write(pci_device_t *device, uint32_t value, uint8_t func, uint8_t offset);
 #endif
\ No newline at end of file
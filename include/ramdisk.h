@@ -0,0 +1,13 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <stdint.h>
+#include "blkdev.h"
+
+#define RAMDISK_DEFAULT_KB 2048
+#define RAMDISK_MIN_BLOCKS 4096 // the filesystem starts at sector 2048
+
+extern int ramdisk_create(blkdev_t *dev, uint32_t blocks);
+extern void ramdisk_destroy(blkdev_t *dev);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdint.h>
+#include "pci.h"
+#include "blkdev.h"
+
+#define VIRTIO_VENDOR 0x1AF4
+#define VIRTIO_DEV_BLK 0x1001 // legacy/transitional block device
+
+#define VIRTIO_REG_DEVICE_FEATURES 	0x00
+#define VIRTIO_REG_GUEST_FEATURES 	0x04
+#define VIRTIO_REG_QUEUE_PFN 		0x08
+#define VIRTIO_REG_QUEUE_SIZE 		0x0C
+#define VIRTIO_REG_QUEUE_SELECT 	0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY 	0x10
+#define VIRTIO_REG_STATUS 			0x12
+#define VIRTIO_REG_ISR 				0x13
+#define VIRTIO_REG_CONFIG 			0x14 // device specific, no msi-x
+
+#define VIRTIO_STATUS_ACK 		(1 << 0)
+#define VIRTIO_STATUS_DRIVER 	(1 << 1)
+#define VIRTIO_STATUS_DRIVER_OK (1 << 2)
+#define VIRTIO_STATUS_FAILED 	(1 << 7)
+
+#define VIRTQ_DESC_F_NEXT 	(1 << 0)
+#define VIRTQ_DESC_F_WRITE 	(1 << 1) // device writes into the buffer
+#define VIRTQ_AVAIL_F_NO_INTERRUPT (1 << 0)
+#define VIRTQ_ALIGN 4096
+
+#define VIRTIO_BLK_F_RO 	(1 << 5)
+#define VIRTIO_BLK_F_FLUSH 	(1 << 9)
+
+#define VIRTIO_BLK_T_IN 	0
+#define VIRTIO_BLK_T_OUT 	1
+#define VIRTIO_BLK_T_FLUSH 	4
+#define VIRTIO_BLK_T_GET_ID 8
+
+#define VIRTIO_BLK_S_OK 0
+
+#define VIRTIO_BLK_MAX_SECTORS 256 // per request, larger transfers are split across requests
+#define VIRTIO_BLK_MAX_INFLIGHT 32 // each request takes a chain of three descriptors
+#define VIRTIO_BLK_TIMEOUT 5000
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) virtq_desc_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} __attribute__((packed)) virtq_avail_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} __attribute__((packed)) virtq_used_elem_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    virtq_used_elem_t ring[];
+} __attribute__((packed)) virtq_used_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed)) virtio_blk_header_t;
+
+extern pci_device_t *virtio_device;
+extern uint16_t virtio_io;
+extern uint64_t virtio_blk_sectors;
+
+extern int virtio_blk_init();
+extern int virtio_blk_ready();
+extern int virtio_blk_submit(uint32_t lba, uint32_t count, void *buffer, int write);
+extern int virtio_blk_wait(int tag);
+extern int virtio_blk_drain();
+extern int virtio_blk_read(uint32_t lba, uint32_t count, void *buffer);
+extern int virtio_blk_write(uint32_t lba, uint32_t count, void *buffer);
+extern int virtio_blk_flush();
+extern int virtio_blkdev(blkdev_t *dev);
+
+#endif
@@ -2,11 +2,37 @@ import os
 import io
 import sys
 import struct
+import zlib
 from datetime import datetime
 from pathlib import Path
 
 FILE = (1 << 0)
 FOLDER = (1 << 1)
+INLINE = (1 << 2)
+COMPRESSED = (1 << 3)
+
+VERSION = 12
+BLOCK_SIZE = 512
+NODE_SIZE = 128
+NODES_PER_SECTOR = BLOCK_SIZE // NODE_SIZE
+NODE_EXTENTS = 5
+NODE_FLAGS_OFFSET = 84
+NODE_EXTENT_OFFSET = 88
+INDIRECT_EXTENTS = 63
+INLINE_SLOT = NODE_SIZE - NODE_EXTENT_OFFSET
+INLINE_MAX = BLOCK_SIZE - NODE_EXTENT_OFFSET
+INDEX_ENTRIES = 64
+SECTOR_SUPERBLOCK = 2048
+SECTOR_ROOT = 2049
+NODE_ROOT = SECTOR_ROOT * NODES_PER_SECTOR
+SECTOR_BITMAP = 2050
+JOURNAL_MAGIC = 0x4C4E524A
+JOURNAL_SECTORS = 256
+JOURNAL_ENTRIES = 122
+CHUNK_SIZE = 4096
+CHUNK_RAW = 0x80000000
+DEFLATE_WINDOW = 12
+DEFLATE_MEMORY = 5
 
 class Buffer(io.BytesIO):
 	def __init__(self, size):
@@ -18,6 +44,56 @@ class Buffer(io.BytesIO):
 			raise BufferError("overflow")
 		return super().write(data)
 
+def name_hash(name):
+	hash = 2166136261
+	for byte in name.encode("utf-8"):
+		hash ^= byte
+		hash = (hash * 16777619) & 0xFFFFFFFF
+	return hash
+
+def blocks_of(size):
+	return (size + BLOCK_SIZE - 1) // BLOCK_SIZE
+
+# chunks are deflated on their own, block aligned behind an index of where each starts
+def chunks_pack(data):
+	chunks = (len(data) + CHUNK_SIZE - 1) // CHUNK_SIZE
+	index = Buffer(blocks_of(chunks * 8) * BLOCK_SIZE)
+	body = io.BytesIO()
+	block = blocks_of(chunks * 8)
+
+	for i in range(chunks):
+		raw = data[i * CHUNK_SIZE:(i + 1) * CHUNK_SIZE]
+		z = zlib.compressobj(zlib.Z_DEFAULT_COMPRESSION, zlib.DEFLATED, -DEFLATE_WINDOW, DEFLATE_MEMORY)
+		packed = z.compress(raw) + z.flush()
+
+		# a chunk that doesn't save a block is kept as is
+		if blocks_of(len(packed)) < blocks_of(len(raw)):
+			stored, length = packed, len(packed)
+		else:
+			stored, length = raw, len(raw) | CHUNK_RAW
+
+		index.write(struct.pack("<II", block, length))
+		body.write(stored + b"\x00" * (blocks_of(len(stored)) * BLOCK_SIZE - len(stored)))
+		block += blocks_of(len(stored))
+
+	return index.getvalue() + body.getvalue()
+
+def chunks_unpack(stored, size):
+	data = io.BytesIO()
+	for i in range((size + CHUNK_SIZE - 1) // CHUNK_SIZE):
+		block, length = struct.unpack_from("<II", stored, i * 8)
+		at = block * BLOCK_SIZE
+		if length & CHUNK_RAW:
+			data.write(stored[at:at + (length & ~CHUNK_RAW)])
+		else:
+			data.write(zlib.decompressobj(-DEFLATE_WINDOW).decompress(stored[at:at + length]))
+
+	return data.getvalue()[:size]
+
+# slots after an inline node that its bytes run on into
+def inline_spans(size):
+	return (size - INLINE_SLOT + NODE_SIZE - 1) // NODE_SIZE if size > INLINE_SLOT else 0
+
 def is_utf8(data):
 	try:
 		data.decode("utf-8")
@@ -63,8 +139,13 @@ class Node:
 		self.parent = None
 		self.child_head = None
 		self.child_next = None
+		self.child_prev = 0
+		self.child_tail = 0
+		self.children = 0
 		self.size = None
-		self.first_block = None
+		self.extent_count = 0
+		self.indirect = 0
+		self.extents = []
 		self.name = None
 		self.flags = None
 
@@ -85,22 +166,23 @@ class Node:
 		print("PARENT:", self.parent)
 		print("CHILD_HEAD:", self.child_head)
 		print("CHILD_NEXT:", self.child_next)
+		print("CHILDREN:", self.children)
 		print("SIZE:", self.size)
-		print("FIRST_BLOCK:", self.first_block)
+		print("EXTENTS:", "INLINE" if self.flags & INLINE else len(self.extents))
+		if self.flags & COMPRESSED:
+			print("COMPRESSED:", sum(count for start, count in self.extents), "sectors")
 		print("TYPE:", self.get_type())
 
-class Block:
-	def __init__(self):
-		self.sector = 0
-		self.next = 0
-		self.data = b""
-
 class Disk:
 	def __init__(self, file):
 		self.disk = open(file, 'r+b')
 		self.formatted = False
 		self.read_sb()
 
+		# writes here go straight home, so whatever the kernel left in the log goes there first
+		if self.formatted and self.journal_replay():
+			self.read_sb()
+
 	def push(self, localfile, parent):
 		filename = os.path.basename(localfile)
 
@@ -117,43 +199,64 @@ class Disk:
 		elif isinstance(file, str):
 			file = self.get_node(file)
 
-		file.size = 0
-		written = 0
-		length = len(data)
-
-		block = self.read_block(file.first_block)
-		while written < length:
-			to_write = min(length - written, 508)
-			block.data = data[:to_write]
-			data = data[to_write:]
-			written += to_write
-
-			self.write_block(block)
-			file.size += to_write
+		# hand the old blocks back first so the new layout can reuse the same stretch
+		near = file.extents[0][0] if file.extents else file.sector // NODES_PER_SECTOR + 1
+		for start, count in file.extents:
+			for n in range(count):
+				self.sector_free(start + n)
+		self.indirect_free(file.indirect)
+		file.extents = []
+		file.indirect = 0
+
+		# small files stay in the node sector, where the extents would go, running on over free slots after it
+		if len(data) <= self.inline_room(file.sector):
+			self.spans_clear(file.sector)
+			file.flags |= INLINE
+			file.flags &= ~COMPRESSED
+			file.size = len(data)
+			file.time_changed = date_packed()
 			self.write_node(file)
+			self.disk.seek(self.node_offset(file.sector) + NODE_EXTENT_OFFSET)
+			self.disk.write(data + b"\x00" * (INLINE_SLOT + inline_spans(len(data)) * NODE_SIZE - len(data)))
+			return True
+		self.spans_clear(file.sector)
+		file.flags &= ~INLINE
+
+		# a compressed file stays compressed, unless the new contents don't shrink
+		payload = data
+		if file.flags & COMPRESSED:
+			payload = chunks_pack(data)
+			if blocks_of(len(payload)) >= blocks_of(len(data)):
+				file.flags &= ~COMPRESSED
+				payload = data
 
-			if to_write == 508:
-				if block.next == 0:
-					node_sector = self.sector_alloc()
-					if node_sector == 0:
-						return False
+		written = 0
+		for n in range(blocks_of(len(payload))):
+			sector = self.sector_alloc(near)
+			if sector == 0:
+				break
 
-					block.next = node_sector
-					self.write_block(block)
+			chunk = payload[n * BLOCK_SIZE:(n + 1) * BLOCK_SIZE]
+			self.sector(sector)
+			self.disk.write(chunk + b"\x00" * (BLOCK_SIZE - len(chunk)))
 
-					node = Block()
-					node.sector = node_sector
-					node.next = 0
-					self.write_block(node)
+			if file.extents and file.extents[-1][0] + file.extents[-1][1] == sector:
+				file.extents[-1][1] += 1
+			else:
+				file.extents.append([sector, 1])
 
-					block = node
-				else:
-					block = self.read_block(block.next)
+			written += len(chunk)
+			near = sector + 1
+
+		file.size = written
+		if file.flags & COMPRESSED:
+			file.size = len(data) if written == len(payload) else 0
 
 		file.time_changed = date_packed()
+		self.write_extents(file)
 		self.write_node(file)
 
-		return True
+		return written == len(payload)
 
 	def node_create(self, parent, name, type):
 		if isinstance(parent, int):
@@ -161,47 +264,121 @@ class Disk:
 		elif isinstance(parent, str):
 			parent = self.get_node(parent)
 
-		node_sector = self.sector_alloc()
-		if type == FILE:
-			data_sector = self.sector_alloc()
-
-		if node_sector == 0 or (type == FILE and data_sector == 0):
-			if node_sector:
-				self.sector_free(node_sector)
-			if type == FILE and data_sector:
-				self.sector_free(data_sector)
-
-			return False
-
 		node = Node()
-		node.sector = node_sector
 		node.time_created = date_packed()
 		node.time_changed = date_packed()
 		node.parent = parent.sector
-		node.flags = type
+		node.flags = (type | INLINE) if type == FILE else type
 		node.child_head = 0
 		node.child_next = 0
-		node.first_block = data_sector if type == FILE else 0
 		node.size = 0
 		node.name = name
 
-		if parent.child_head:
-			current = self.read_node(parent.child_head)
-			while current.child_next:
-				current = self.read_node(current.child_next)
-			current.child_next = node_sector
-			self.write_node(current)
+		# next to the last sibling when its sector has a free slot
+		node_sector = self.node_alloc(parent.child_tail or parent.sector)
+		if node_sector == 0:
+			return False
+		node.sector = node_sector
+
+		node.child_prev = parent.child_tail
+		self.write_node(node)
+
+		if not self.index_insert(parent, name, node_sector):
+			self.node_free(node_sector)
+			return False
+
+		if parent.child_tail:
+			tail = self.read_node(parent.child_tail)
+			tail.child_next = node_sector
+			self.write_node(tail)
 		else:
 			parent.child_head = node_sector
-			self.write_node(parent)
-		self.write_node(node)
+		parent.child_tail = node_sector
+		self.write_node(parent)
 
-		if type == FILE:
-			data = Block()
-			data.sector = data_sector
-			data.next = 0
-			self.write_block(data)
+		return True
 
+	def index_read(self, folder):
+		entries = []
+		for start, count in folder.extents:
+			self.sector(start)
+			for n in range(count * INDEX_ENTRIES):
+				entries.append(list(struct.unpack("<II", self.disk.read(8))))
+		return entries
+
+	def index_find(self, folder, name):
+		if folder.children == 0:
+			return None
+
+		entries = self.index_read(folder)
+		hash = name_hash(name)
+		for i in range(len(entries)):
+			entry_hash, sector = entries[(hash + i) % len(entries)]
+			if sector == 0:
+				break
+
+			if entry_hash == hash:
+				node = self.read_node(sector)
+				if node.name == name:
+					return node
+
+		return None
+
+	def index_insert(self, folder, name, sector):
+		entries = self.index_read(folder)
+
+		# same load limit as the kernel, the table doubles before it gets three quarters full
+		if (folder.children + 1) * 4 > len(entries) * 3:
+			blocks = max(1, len(entries) // INDEX_ENTRIES * 2)
+			table = [[0, 0] for n in range(blocks * INDEX_ENTRIES)]
+			for entry_hash, entry_sector in entries:
+				if entry_sector:
+					slot = entry_hash % len(table)
+					while table[slot][1]:
+						slot = (slot + 1) % len(table)
+					table[slot] = [entry_hash, entry_sector]
+
+			extents = []
+			near = folder.extents[0][0] if folder.extents else folder.sector // NODES_PER_SECTOR + 1
+			for n in range(blocks):
+				block = self.sector_alloc(near)
+				if block == 0:
+					for start, count in extents:
+						for n in range(count):
+							self.sector_free(start + n)
+					return False
+
+				if extents and extents[-1][0] + extents[-1][1] == block:
+					extents[-1][1] += 1
+				else:
+					extents.append([block, 1])
+				near = block + 1
+
+			for start, count in folder.extents:
+				for n in range(count):
+					self.sector_free(start + n)
+			folder.extents = extents
+
+			self.write_extents(folder)
+			entries = table
+
+		hash = name_hash(name)
+		slot = hash % len(entries)
+		while entries[slot][1]:
+			slot = (slot + 1) % len(entries)
+		entries[slot] = [hash, sector]
+
+		buffer = io.BytesIO()
+		for entry_hash, entry_sector in entries:
+			buffer.write(struct.pack("<II", entry_hash, entry_sector))
+		buffer = buffer.getvalue()
+		offset = 0
+		for start, count in folder.extents:
+			self.sector(start)
+			self.disk.write(buffer[offset:offset + count * BLOCK_SIZE])
+			offset += count * BLOCK_SIZE
+
+		folder.children += 1
 		return True
 
 	def get_usable_sector_count(self):
@@ -216,52 +393,106 @@ class Disk:
 	def read_sb(self):
 		sector = self.disk.tell()
 
-		self.sector(2048)
-		self.sb_magic = self.disk.read(4).decode("utf-8")
+		self.sector(SECTOR_SUPERBLOCK)
+		self.sb_magic = self.disk.read(4).decode("utf-8", "replace")
+		self.sb_version = struct.unpack("<I", self.disk.read(4))[0]
 
 		if self.sb_magic != "MNGO":
 			self.formatted = False
 			sys.stderr.write("warning: disk has invalid magic number, marked as unformatted.\n")
+		elif self.sb_version != VERSION:
+			self.formatted = False
+			sys.stderr.write(f"warning: disk format version {self.sb_version} is not supported, marked as unformatted.\n")
 		else:
 			self.formatted = True
 
-		self.sb_version = struct.unpack("<I", self.disk.read(4))[0]
 		self.sb_sectors = struct.unpack("<I", self.disk.read(4))[0]
 		self.sb_used = struct.unpack("<I", self.disk.read(4))[0]
-		self.sb_free = struct.unpack("<I", self.disk.read(4))[0]
-		self.sb_free_list = struct.unpack("<I", self.disk.read(4))[0]
-		self.root = self.read_node(2049)
+		self.sb_hint = struct.unpack("<I", self.disk.read(4))[0]
+		self.sb_bitmap = struct.unpack("<I", self.disk.read(4))[0]
+		self.sb_bitmap_sectors = struct.unpack("<I", self.disk.read(4))[0]
+		self.sb_journal = struct.unpack("<I", self.disk.read(4))[0]
+		self.sb_journal_sectors = struct.unpack("<I", self.disk.read(4))[0]
+		self.sb_refcount = struct.unpack("<I", self.disk.read(4))[0]
+		self.sb_refcount_sectors = struct.unpack("<I", self.disk.read(4))[0]
+		self.sb_shared = struct.unpack("<I", self.disk.read(4))[0]
+		self.sb_orphan = struct.unpack("<I", self.disk.read(4))[0] # the kernel finishes it at mount
+
+		self.bitmap = bytearray()
+		if self.formatted:
+			self.sector(self.sb_bitmap)
+			self.bitmap = bytearray(self.disk.read(self.sb_bitmap_sectors * 512))
+			self.root = self.read_node(NODE_ROOT)
 
 		self.disk.seek(sector)
 
 	def write_sb(self):
 		sector = self.disk.tell()
 
-		self.sector(2048)
+		self.sector(SECTOR_SUPERBLOCK)
 		self.disk.write("MNGO".encode("utf-8"))
 		self.disk.write(struct.pack("<I", self.sb_version))
 		self.disk.write(struct.pack("<I", self.sb_sectors))
 		self.disk.write(struct.pack("<I", self.sb_used))
-		self.disk.write(struct.pack("<I", self.sb_free))
-		self.disk.write(struct.pack("<I", self.sb_free_list))
+		self.disk.write(struct.pack("<I", self.sb_hint))
+		self.disk.write(struct.pack("<I", self.sb_bitmap))
+		self.disk.write(struct.pack("<I", self.sb_bitmap_sectors))
+		self.disk.write(struct.pack("<I", self.sb_journal))
+		self.disk.write(struct.pack("<I", self.sb_journal_sectors))
+		self.disk.write(struct.pack("<I", self.sb_refcount))
+		self.disk.write(struct.pack("<I", self.sb_refcount_sectors))
+		self.disk.write(struct.pack("<I", self.sb_shared))
+		self.disk.write(struct.pack("<I", self.sb_orphan))
+
+		self.sector(self.sb_bitmap)
+		self.disk.write(bytes(self.bitmap))
 
 		self.disk.seek(sector)
 
+	def bitmap_test(self, n):
+		return (self.bitmap[n // 8] >> (n % 8)) & 1
+
+	def bitmap_mark(self, n, used):
+		if used:
+			self.bitmap[n // 8] |= 1 << (n % 8)
+		else:
+			self.bitmap[n // 8] &= ~(1 << (n % 8)) & 0xFF
+
 	def format(self):
-		sector = self.disk.tell()
+		sectors = self.get_usable_sector_count()
+
+		self.sb_magic = "MNGO"
+		self.sb_version = VERSION
+		self.sb_sectors = sectors
+		self.sb_bitmap = SECTOR_BITMAP
+		self.sb_bitmap_sectors = (sectors + 4095) // 4096
+		self.sb_journal = SECTOR_BITMAP + self.sb_bitmap_sectors
+		self.sb_refcount_sectors = (sectors + BLOCK_SIZE - 1) // BLOCK_SIZE
+		self.sb_journal_sectors = JOURNAL_SECTORS + 2 * (self.sb_bitmap_sectors + self.sb_refcount_sectors)
+		self.sb_refcount = self.sb_journal + self.sb_journal_sectors
+		self.sb_shared = 0
+		self.sb_orphan = 0
+		self.sb_hint = self.sb_refcount + self.sb_refcount_sectors
+		self.sb_used = 2 + self.sb_bitmap_sectors + self.sb_journal_sectors + self.sb_refcount_sectors # superblock + root + bitmap + journal + refcounts
+
+		# everything before the first data sector is reserved
+		self.bitmap = bytearray(self.sb_bitmap_sectors * 512)
+		for n in range(self.sb_hint):
+			self.bitmap_mark(n, True)
 
-		self.sector(2048)
-		self.disk.write("MNGO".encode("utf-8")) # magic
-		self.disk.write(struct.pack("<I", 1)) # version
-		self.disk.write(struct.pack("<I", self.get_usable_sector_count())) # sectors
-		self.disk.write(struct.pack("<I", 2)) # used
-		self.disk.write(struct.pack("<I", 2050)) # free
-		self.disk.write(struct.pack("<I", 0)) # free_list
+		self.write_sb()
+		self.journal_header_write(1)
+		self.disk.write(Buffer(512).getvalue()) # no commit at the start of the log
 
-		self.disk.seek(sector)
+		# every block starts with a single owner
+		self.sector(self.sb_refcount)
+		self.disk.write(Buffer(self.sb_refcount_sectors * 512).getvalue())
+
+		self.sector(SECTOR_ROOT)
+		self.disk.write(Buffer(512).getvalue())
 
 		root = Node()
-		root.sector = 2049
+		root.sector = NODE_ROOT
 		root.time_created = date_packed()
 		root.time_changed = date_packed()
 		root.parent = 0
@@ -269,10 +500,10 @@ class Disk:
 		root.child_head = 0
 		root.child_next = 0
 		root.size = 0
-		root.first_block = 0
 		root.name = "root"
 		self.write_node(root)
 
+		self.root = root
 		self.formatted = True
 
 	def print(self):
@@ -281,16 +512,96 @@ class Disk:
 			print("VERSION:", self.sb_version)
 			print("SECTORS:", self.sb_sectors)
 			print("USED:", self.sb_used)
-			print("FREE:", self.sb_free)
-			print("FREE_LIST:", self.sb_free_list)
+			print("HINT:", self.sb_hint)
+			print("BITMAP:", self.sb_bitmap)
+			print("BITMAP_SECTORS:", self.sb_bitmap_sectors)
+			print("JOURNAL:", self.sb_journal)
+			print("JOURNAL_SECTORS:", self.sb_journal_sectors)
+			print("REFCOUNT:", self.sb_refcount)
+			print("REFCOUNT_SECTORS:", self.sb_refcount_sectors)
+			print("SHARED:", self.sb_shared)
+			print("ORPHAN:", self.sb_orphan)
 		else:
 			print("[ Unformatted ]")
 
 	def sector(self, n):
 		self.disk.seek(512 * n)
 
+	def journal_header_write(self, sequence):
+		self.sector(self.sb_journal)
+		self.disk.write(struct.pack("<II", JOURNAL_MAGIC, sequence).ljust(512, b"\x00"))
+
+	# the descriptor at a log offset with its images, None unless whole and of the sequence
+	def journal_read(self, at, sequence):
+		log = self.sb_journal_sectors - 1
+		if at >= log:
+			return None
+
+		self.sector(self.sb_journal + 1 + at)
+		desc = self.disk.read(512)
+		magic, desc_sequence, count, revokes, last, checksum = struct.unpack("<6I", desc[:24])
+		if magic != JOURNAL_MAGIC or desc_sequence != sequence:
+			return None
+		if count + revokes > JOURNAL_ENTRIES or at + 1 + count > log:
+			return None
+
+		entries = struct.unpack(f"<{count + revokes}I", desc[24:24 + 4 * (count + revokes)])
+		images = self.disk.read(count * 512)
+
+		hash = 2166136261
+		for byte in desc[:20] + desc[24:24 + 4 * (count + revokes)] + images:
+			hash ^= byte
+			hash = (hash * 16777619) & 0xFFFFFFFF
+		if hash != checksum:
+			return None
+
+		return (1 + count, entries[:count], entries[count:], last, images)
+
+	# writes home every whole commit in the log, as the kernel does at mount
+	def journal_replay(self):
+		self.sector(self.sb_journal)
+		magic, sequence = struct.unpack("<II", self.disk.read(8))
+		if magic != JOURNAL_MAGIC:
+			sys.stderr.write("warning: journal header is damaged, not replaying.\n")
+			return False
+
+		commits = []
+		revokes = {}
+		pending = []
+		chunks = []
+		at = 0
+		while True:
+			chunk = self.journal_read(at, sequence + len(commits))
+			if not chunk:
+				break
+
+			chunks.append(chunk)
+			pending += [(block, sequence + len(commits)) for block in chunk[2]]
+			at += chunk[0]
+			if chunk[3]:
+				commits.append(chunks)
+				for block, revoked in pending:
+					revokes[block] = max(revokes.get(block, 0), revoked)
+				chunks = []
+				pending = []
+
+		for n, commit in enumerate(commits):
+			for taken, blocks, _, _, images in commit:
+				for i, block in enumerate(blocks):
+					if block >= self.sb_sectors or revokes.get(block, -1) >= sequence + n:
+						continue
+					self.sector(block)
+					self.disk.write(images[i * 512:(i + 1) * 512])
+
+		if commits:
+			self.journal_header_write(sequence + len(commits))
+		return len(commits) > 0
+
+	def node_offset(self, n):
+		return 512 * (n // NODES_PER_SECTOR) + (n % NODES_PER_SECTOR) * NODE_SIZE
+
 	def read_node(self, n):
-		self.sector(n)
+		self.disk.seek(self.node_offset(n))
 
 		node = Node()
 		node.sector = n
@@ -299,24 +610,44 @@ class Disk:
 		node.parent = struct.unpack("<I", self.disk.read(4))[0]
 		node.child_head = struct.unpack("<I", self.disk.read(4))[0]
 		node.child_next = struct.unpack("<I", self.disk.read(4))[0]
+		node.child_prev = struct.unpack("<I", self.disk.read(4))[0]
+		node.child_tail = struct.unpack("<I", self.disk.read(4))[0]
+		node.children = struct.unpack("<I", self.disk.read(4))[0]
 		node.size = struct.unpack("<I", self.disk.read(4))[0]
-		node.first_block = struct.unpack("<I", self.disk.read(4))[0]
+		node.extent_count = struct.unpack("<I", self.disk.read(4))[0]
+		node.indirect = struct.unpack("<I", self.disk.read(4))[0]
 		node.name = self.disk.read(32).decode("utf-8").rstrip("\x00")
 		node.flags = struct.unpack("<B", self.disk.read(1))[0]
 
+		# the first extents live in the node sector, the rest in a chain of indirect blocks
+		self.disk.seek(self.node_offset(n) + NODE_EXTENT_OFFSET)
+		for i in range(min(node.extent_count, NODE_EXTENTS)):
+			node.extents.append(list(struct.unpack("<II", self.disk.read(8))))
+
+		indirect = node.indirect
+		while indirect and len(node.extents) < node.extent_count:
+			self.sector(indirect)
+			indirect, count = struct.unpack("<II", self.disk.read(8))
+			for i in range(min(count, INDIRECT_EXTENTS)):
+				node.extents.append(list(struct.unpack("<II", self.disk.read(8))))
+
 		return node
 
 	def write_node(self, node):
 		sector = self.disk.tell()
 
-		self.sector(node.sector)
+		self.disk.seek(self.node_offset(node.sector))
 		self.disk.write(struct.pack("<Q", date_packed(node.time_created)))
 		self.disk.write(struct.pack("<Q", date_packed(node.time_changed)))
 		self.disk.write(struct.pack("<I", node.parent))
 		self.disk.write(struct.pack("<I", node.child_head))
 		self.disk.write(struct.pack("<I", node.child_next))
+		self.disk.write(struct.pack("<I", node.child_prev))
+		self.disk.write(struct.pack("<I", node.child_tail))
+		self.disk.write(struct.pack("<I", node.children))
 		self.disk.write(struct.pack("<I", node.size))
-		self.disk.write(struct.pack("<I", node.first_block))
+		self.disk.write(struct.pack("<I", len(node.extents)))
+		self.disk.write(struct.pack("<I", node.indirect))
 
 		buffer = Buffer(32)
 		buffer.write(node.name.encode("utf-8"))
@@ -326,42 +657,70 @@ class Disk:
 
 		self.disk.seek(sector)
 
-	def read_block(self, n, r = 508):
-		self.sector(n)
-
-		block = Block()
-		block.sector = n
-		block.next = struct.unpack("<I", self.disk.read(4))[0]
-		block.data = self.disk.read(r)
-		
-		return block
-
-	def write_block(self, block):
-		sector = self.disk.tell()
+	def write_extents(self, node):
+		self.indirect_free(node.indirect)
+		node.indirect = 0
+
+		spill = node.extents[NODE_EXTENTS:]
+		chunks = [spill[i:i + INDIRECT_EXTENTS] for i in range(0, len(spill), INDIRECT_EXTENTS)]
+		chain = []
+		for chunk in chunks:
+			sector = self.sector_alloc(chain[-1] + 1 if chain else node.sector // NODES_PER_SECTOR + 1)
+			if sector == 0:
+				break
+			chain.append(sector)
+
+		# out of space for the chain, drop the extents it can't describe
+		keep = NODE_EXTENTS + len(chain) * INDIRECT_EXTENTS
+		dropped = len(node.extents) > keep
+		for start, count in node.extents[keep:]:
+			for n in range(count):
+				self.sector_free(start + n)
+		del node.extents[keep:]
+		if node.flags & COMPRESSED:
+			# a packed file cut short can't be inflated at all
+			if dropped:
+				node.size = 0
+		else:
+			node.size = min(node.size, sum(count for start, count in node.extents) * BLOCK_SIZE)
 
-		self.sector(block.sector)
-		self.disk.write(struct.pack("<I", block.next))
+		for i, sector in enumerate(chain):
+			buffer = Buffer(512)
+			buffer.write(struct.pack("<II", chain[i + 1] if i + 1 < len(chain) else 0, len(chunks[i])))
+			for start, count in chunks[i]:
+				buffer.write(struct.pack("<II", start, count))
+			self.sector(sector)
+			self.disk.write(buffer.getvalue())
+		node.indirect = chain[0] if chain else 0
 
-		buffer = Buffer(508)
-		buffer.write(block.data)
+		buffer = Buffer(NODE_SIZE - NODE_EXTENT_OFFSET)
+		for start, count in node.extents[:NODE_EXTENTS]:
+			buffer.write(struct.pack("<II", start, count))
+		self.disk.seek(self.node_offset(node.sector) + NODE_EXTENT_OFFSET)
 		self.disk.write(buffer.getvalue())
 
-		self.disk.seek(sector)
+	def indirect_free(self, indirect):
+		while indirect:
+			self.sector(indirect)
+			following = struct.unpack("<I", self.disk.read(4))[0]
+			self.sector_free(indirect)
+			indirect = following
 
 	def read_data(self, node):
 		if node.get_type() != "FILE":
 			raise TypeError("Node is not readable!")
 
+		if node.flags & INLINE:
+			self.disk.seek(self.node_offset(node.sector) + NODE_EXTENT_OFFSET)
+			return self.disk.read(node.size)
+
 		data = io.BytesIO()
-		written = 0
-		remaining = node.size - written
-		size = remaining if remaining < 508 else 508
+		for start, count in node.extents:
+			self.sector(start)
+			data.write(self.disk.read(count * BLOCK_SIZE))
 
-		block = self.read_block(node.first_block, size)
-		while block.next:
-			data.write(block.data)
-			block = self.read_block(block.next, size)
-		data.write(block.data)
+		if node.flags & COMPRESSED:
+			return chunks_unpack(data.getvalue(), node.size)
 
 		data = data.getvalue()[:node.size]
 		return data
@@ -403,20 +762,8 @@ class Disk:
 			if name == "":
 				continue
 
-			found = False
-			child = current.child_head
-
-			while child:
-				node = self.read_node(child)
-
-				if node.name == name:
-					found = True
-					current = node
-					break
-
-				child = node.child_next
-
-			if not found:
+			current = self.index_find(current, name)
+			if not current:
 				return None
 
 		return current
@@ -424,34 +771,99 @@ class Disk:
 	def sector_free(self, sector):
 		self.read_sb()
 
-		self.sector(sector)
-		self.disk.write(struct.pack("<I", self.sb_free_list))
-
-		self.sb_free_list = sector
-		self.sb_used -= 1
+		# a block shared with a clone only loses an owner
+		self.disk.seek(512 * self.sb_refcount + sector)
+		owners = struct.unpack("<B", self.disk.read(1))[0]
+		if owners:
+			self.disk.seek(512 * self.sb_refcount + sector)
+			self.disk.write(struct.pack("<B", owners - 1))
+			if owners == 1:
+				self.sb_shared -= 1
+		elif self.bitmap_test(sector):
+			self.bitmap_mark(sector, False)
+			self.sb_used -= 1
 
 		self.write_sb()
 
-	def sector_alloc(self):
+	def node_spans(self, n):
+		self.disk.seek(self.node_offset(n) + NODE_FLAGS_OFFSET)
+		if not struct.unpack("<B", self.disk.read(1))[0] & INLINE:
+			return 0
+		self.disk.seek(self.node_offset(n) + 40)
+		return inline_spans(struct.unpack("<I", self.disk.read(4))[0])
+
+	def node_used(self, n):
+		self.disk.seek(self.node_offset(n) + NODE_FLAGS_OFFSET)
+		return struct.unpack("<B", self.disk.read(1))[0] != 0
+
+	# inline bytes the node can hold, its own slot plus the free slots straight after it
+	def inline_room(self, n):
+		last = n + self.node_spans(n)
+		while (last + 1) % NODES_PER_SECTOR and not self.node_used(last + 1):
+			last += 1
+		return INLINE_SLOT + (last - n) * NODE_SIZE
+
+	def spans_clear(self, n):
+		spans = self.node_spans(n)
+		self.disk.seek(self.node_offset(n) + NODE_SIZE)
+		self.disk.write(bytes(spans * NODE_SIZE))
+
+	# nodes are packed into sectors, a slot without flags that no inline file runs on into is free
+	def node_claim(self, sector):
+		slot = 0
+		while slot < NODES_PER_SECTOR:
+			n = sector * NODES_PER_SECTOR + slot
+			if not self.node_used(n):
+				return n
+			slot += 1 + self.node_spans(n)
+		return 0
+
+	def node_alloc(self, near = 0):
+		if near:
+			node = self.node_claim(near // NODES_PER_SECTOR)
+			if node:
+				return node
+
+		sector = self.sector_alloc(near // NODES_PER_SECTOR + 1 if near else 0)
+		if sector == 0:
+			return 0
+		return sector * NODES_PER_SECTOR
+
+	def node_free(self, n):
+		spans = self.node_spans(n)
+		self.disk.seek(self.node_offset(n))
+		self.disk.write(Buffer(NODE_SIZE * (spans + 1)).getvalue())
+
+		sector = n // NODES_PER_SECTOR
+		for slot in range(NODES_PER_SECTOR):
+			self.disk.seek(512 * sector + slot * NODE_SIZE + NODE_FLAGS_OFFSET)
+			if struct.unpack("<B", self.disk.read(1))[0]:
+				return
+		self.sector_free(sector)
+
+	def sector_alloc(self, near = 0):
 		self.read_sb()
 
-		if self.sb_used > self.sb_sectors:
-			sys.stderr.write("error: disk full!")
-			return 0
+		first = self.sb_refcount + self.sb_refcount_sectors
+		if near < first or near >= self.sb_sectors:
+			near = self.sb_hint
+		if near < first or near >= self.sb_sectors:
+			near = first
 
+		# next free sector from near, wrapping around once
 		sector = 0
-		if self.sb_free_list != 0:
-			sector = self.sb_free_list
+		for n in list(range(near, self.sb_sectors)) + list(range(first, near)):
+			if not self.bitmap_test(n):
+				sector = n
+				break
 
-			curr = self.disk.tell()
-			self.sector(sector)
-			self.sb_free_list = struct.unpack("<I", self.disk.read(4))[0]
-			self.disk.seek(curr)
-		else:
-			sector = self.sb_free
-			self.sb_free += 1
+		if sector == 0:
+			sys.stderr.write("error: disk full!")
+			return 0
 
+		self.bitmap_mark(sector, True)
 		self.sb_used += 1
+		self.sb_hint = sector + 1
 		self.write_sb()
 
 		curr = self.disk.tell()
@@ -511,6 +923,7 @@ if __name__ == "__main__":
 			print("... push <localfile> <path>\n\tpush a local file into the disk")
 			print("... newfile <path>\n\tcreate a new file")
 			print("... newfolder <path>\n\tcreate a new folder")
+			print("... compress <path> [-d]\n\tstore a file deflated, or plainly again with -d")
 		elif args[1] == "info":
 			if not disk.formatted:
 				sys.exit("error: disk is not formatted!")
@@ -621,6 +1034,31 @@ if __name__ == "__main__":
 				sys.exit("error: path is not a folder!")
 
 			disk.node_create(parent_node, name, FOLDER)
+		elif args[1] == "compress":
+			if not disk.formatted:
+				sys.exit("error: disk is not formatted!")
+
+			if len(args) < 3:
+				sys.exit("usage: mangofs <disk> compress <path> [-d]")
+
+			if args[2][0] != '/':
+				sys.exit("error: invalid path!")
+
+			node = disk.get_node(args[2])
+			if not node:
+				sys.exit("error: not found!")
+			elif node.get_type() != "FILE":
+				sys.exit("error: not a file!")
+
+			data = disk.read_data(node)
+			if len(args) > 3 and args[3] == "-d":
+				node.flags &= ~COMPRESSED
+			else:
+				node.flags |= COMPRESSED
+
+			disk.file_write(node, data)
+			if len(args) <= 3 and not node.flags & COMPRESSED:
+				print("file doesn't compress, left as it is.")
 		elif args[1] == "format":
 			disk.format()
 			print("Disk formatted successfuly!")
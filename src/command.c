@@ -7,10 +7,14 @@
 #include "color.h"
 #include "time.h"
 #include "file.h"
+#include "fio.h"
 #include "keyboard.h"
 #include "editor.h"
 #include "font.h"
 #include "ata.h"
+#include "ide.h"
+#include "ramdisk.h"
+#include "bcache.h"
 #include "unit.h"
 #include "io.h"
 #include "script.h"
@@ -88,6 +92,7 @@ static int command_shutdown(int argc, char *argv[]) {
     unused(argc); unused(argv);
 
     term_write("Shutting down...\n");
+    file_sync();
 
     outw(0x604, 0x2000);
     outw(0xB004, 0x2000);
@@ -102,6 +107,19 @@ static int command_shutdown(int argc, char *argv[]) {
     return 0;
 }
 
+static int command_sync(int argc, char *argv[]) {
+    unused(argc); unused(argv);
+
+    if (nodisk()) return 1;
+
+    if (!file_sync()) {
+        term_write("Failed flushing disk cache!\n");
+        return 1;
+    }
+
+    return 0;
+}
+
 static int command_fetch(int argc, char *argv[]) {
     int show_diskname = 0;
     int show_ribbon = 1;
@@ -140,19 +158,13 @@ static int command_fetch(int argc, char *argv[]) {
     term_write(buff);
 
     if (file_drive_status == FILE_DRIVE_OK) {
-        uint8_t ata_id[512];
-        ata_identify(file_port, ata_id);
-        uint16_t *w = (uint16_t*) ata_id;
-        uint32_t sectors = (uint32_t)w[60] | ((uint32_t)w[61] << 16);
         char disk_total[16];
-        unit_get_size(sectors * 512, disk_total);
+        unit_get_size(file_device.blocks * file_device.block_size, disk_total);
 
         term_write("Disk: ");
 
         if (show_diskname) {
-            char name[64];
-            ata_get_string(w, 27, 46, name, 64);
-            term_write(name);
+            term_write(file_device.model);
             term_write(" - ");
         }
 
@@ -414,6 +426,12 @@ static int command_newfolder(int argc, char *argv[]) {
     }
 }
 
+static void delfolder_progress(uint32_t removed) {
+    char buff[48];
+    strfmt(buff, "Deleted %d items...\n", removed);
+    term_write(buff);
+}
+
 static int command_delfolder(int argc, char *argv[]) {
     if (nodisk()) return 1;
 
@@ -422,8 +440,8 @@ static int command_delfolder(int argc, char *argv[]) {
         file_node_t target_node;
         file_node(target, &target_node);
 
-        if (target != FILE_SECTOR_ROOT) {
-            if (!folder_delete(target_node.parent, target_node.name)) {
+        if (target != FILE_NODE_ROOT) {
+            if (!folder_delete_progress(target_node.parent, target_node.name, delfolder_progress)) {
                 term_write("Failed deleting folder!\n");
                 return 1;
             }
@@ -547,9 +565,10 @@ static int command_copyfile(int argc, char *argv[]) {
             file_node(dest, &dest_node);
         }
 
-        char *data = file_read(src);
-        file_write(dest, data, src_node.size);
-        heap_free(data);
+        if (!file_clone(src, dest) && !fio_copy(src, dest)) {
+            term_write("Failed copying file!\n");
+            exit = 1;
+        }
     } else {
         if (strlen(dest_basename) > FILE_MAX_NAME) {
             term_write("File name is too long!\n");
@@ -561,9 +580,10 @@ static int command_copyfile(int argc, char *argv[]) {
         dest = file_get(dest_parent_node, dest_basename);
         file_node(dest, &dest_node);
 
-        char *data = file_read(src);
-        file_write(dest, data, src_node.size);
-        heap_free(data);
+        if (!file_clone(src, dest) && !fio_copy(src, dest)) {
+            term_write("Failed copying file!\n");
+            exit = 1;
+        }
     }
 
 cleanup:
@@ -581,14 +601,69 @@ static int command_movefile(int argc, char *argv[]) {
         return 1;
     }
 
-    command_copyfile(argc, argv);
-
     uint32_t src = file_get_node(argv[0]);
     file_node_t src_node;
     file_node(src, &src_node);
 
-    file_delete(src_node.parent, src_node.name);
-    return 0;
+    if (!src) {
+        term_write("Source file doesn't exist!\n");
+        return 1;
+    }
+
+    if (!(src_node.flags & FILE_DATA)) {
+        term_write("Not a file!\n");
+        return 1;
+    }
+
+    int exit = 0;
+
+    char *dest_parent = heap_alloc(FILE_MAX_PATH - FILE_MAX_NAME);
+    char *dest_basename = heap_alloc(FILE_MAX_NAME);
+    if (!file_split_path(argv[1], dest_parent, dest_basename)) {
+        term_write("Invalid destination path!\n");
+        exit = 1;
+        goto cleanup;
+    }
+
+    uint32_t dest_parent_node;
+    if (dest_parent[0] == '\0')
+        dest_parent_node = file_current;
+    else
+        dest_parent_node = file_get_node(dest_parent);
+
+    if (!dest_parent_node) {
+        term_write("Parent folder doesn't exist!\n");
+        exit = 1;
+        goto cleanup;
+    }
+
+    uint32_t dest = file_get_node2(dest_parent, dest_basename);
+    file_node_t dest_node;
+    file_node(dest, &dest_node);
+
+    // a folder takes the file under its own name
+    if (dest && (dest_node.flags & FILE_FOLDER)) {
+        dest_parent_node = dest;
+        strcpy(dest_basename, src_node.name);
+    }
+
+    if (strlen(dest_basename) > FILE_MAX_NAME) {
+        term_write("File name is too long!\n");
+        exit = 1;
+        goto cleanup;
+    }
+
+    // the file is relinked, not copied, so its data never moves, a file already there goes once it has
+    if (!file_move(src, dest_parent_node, dest_basename, 1)) {
+        term_write("Failed moving file!\n");
+        exit = 1;
+    }
+
+cleanup:
+    heap_free(dest_parent);
+    heap_free(dest_basename);
+
+    return exit;
 }
 
 static int command_copyfolder(int argc, char *argv[]) {
@@ -614,6 +689,7 @@ static int command_copyfolder(int argc, char *argv[]) {
     }
 
     int exit = 0;
+    file_batch_begin();
 
     char *dest_parent = heap_alloc(FILE_MAX_PATH - FILE_MAX_NAME);
     char *dest_basename = heap_alloc(FILE_MAX_NAME);
@@ -665,14 +741,18 @@ static int command_copyfolder(int argc, char *argv[]) {
         file_create(dest, child_node.name);
 
         uint32_t dest_child = file_get(dest, child_node.name);
-        char *data = file_read(child);
-        file_write(dest_child, data, child_node.size);
-        heap_free(data);
+        if (!file_clone(child, dest_child) && !fio_copy(child, dest_child)) {
+            char buff[FILE_MAX_NAME + 32];
+            strfmt(buff, "Failed copying %s!\n", child_node.name);
+            term_write(buff);
+            exit = 1;
+        }
 
         child = child_node.child_next;
     }
 
 cleanup:
+    file_batch_end();
     heap_free(dest_parent);
     heap_free(dest_basename);
 
@@ -687,13 +767,204 @@ static int command_movefolder(int argc, char *argv[]) {
         return 1;
     }
 
-    command_copyfolder(argc, argv);
-
     uint32_t src = file_get_node(argv[0]);
     file_node_t src_node;
     file_node(src, &src_node);
 
-    folder_delete(src_node.parent, src_node.name);
+    if (!src) {
+        term_write("Source folder doesn't exist!\n");
+        return 1;
+    }
+
+    if (!(src_node.flags & FILE_FOLDER)) {
+        term_write("Not a folder!\n");
+        return 1;
+    }
+
+    int exit = 0;
+
+    char *dest_parent = heap_alloc(FILE_MAX_PATH - FILE_MAX_NAME);
+    char *dest_basename = heap_alloc(FILE_MAX_NAME);
+    if (!file_split_path(argv[1], dest_parent, dest_basename)) {
+        term_write("Invalid destination path!\n");
+        exit = 1;
+        goto cleanup;
+    }
+
+    uint32_t dest_parent_node;
+    if (dest_parent[0] == '\0')
+        dest_parent_node = file_current;
+    else
+        dest_parent_node = file_get_node(dest_parent);
+
+    if (!dest_parent_node) {
+        term_write("Parent folder doesn't exist!\n");
+        exit = 1;
+        goto cleanup;
+    }
+
+    // an existing folder takes the moved one inside it, under its own name
+    uint32_t dest = folder_get(dest_parent_node, dest_basename);
+    if (dest && dest != src) {
+        dest_parent_node = dest;
+        strcpy(dest_basename, src_node.name);
+
+        if (folder_exists(dest_parent_node, dest_basename)) {
+            term_write("Destination folder already exists!\n");
+            exit = 1;
+            goto cleanup;
+        }
+    }
+
+    if (strlen(dest_basename) > FILE_MAX_NAME) {
+        term_write("Folder name is too long!\n");
+        exit = 1;
+        goto cleanup;
+    }
+
+    // the whole tree under it comes along by relinking just the folder
+    if (!file_move(src, dest_parent_node, dest_basename, 0)) {
+        term_write("Failed moving folder!\n");
+        exit = 1;
+    }
+
+cleanup:
+    heap_free(dest_parent);
+    heap_free(dest_basename);
+
+    return exit;
+}
+
+static int command_compress(int argc, char *argv[]) {
+    if (nodisk()) return 1;
+
+    if (argc < 1) {
+        term_write("Usage: compress <path> [-d]\n");
+        return 1;
+    }
+
+    uint32_t target = file_get_node(argv[0]);
+    file_node_t node;
+    file_node(target, &node);
+
+    if (!target) {
+        term_write("File doesn't exist!\n");
+        return 1;
+    }
+
+    if (!(node.flags & FILE_DATA)) {
+        term_write("Not a file!\n");
+        return 1;
+    }
+
+    // -d stores it plainly again
+    if (argc > 1 && !strcmp(argv[1], "-d")) {
+        if (!file_expand(target)) {
+            term_write("Failed decompressing file!\n");
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (!file_compress(target)) {
+        term_write("Failed compressing file!\n");
+        return 1;
+    }
+
+    file_node(target, &node);
+    if (!(node.flags & FILE_COMPRESSED))
+        term_write("File doesn't compress, left as it is.\n");
+    return 0;
+}
+
+static void defrag_progress(uint32_t done) {
+    char buff[48];
+    strfmt(buff, "Defragmented %d items...\n", done);
+    term_write(buff);
+}
+
+// average run length in blocks, to one decimal place
+static void frag_average(char *buff, const char *label, uint32_t blocks, uint32_t extents) {
+    uint32_t tenths = extents ? blocks * 10 / extents : 0;
+    strfmt(buff, "%s%d.%d blocks\n", label, tenths / 10, tenths % 10);
+}
+
+static int command_defrag(int argc, char *argv[]) {
+    if (nodisk()) return 1;
+
+    uint32_t target = argc > 0 ? file_get_node(argv[0]) : FILE_NODE_ROOT;
+    if (!target) {
+        term_write("Not found\n");
+        return 1;
+    }
+
+    if (file_handles) {
+        term_write("Files are still open, close them before defragmenting\n");
+        return 1;
+    }
+
+    file_frag_t before;
+    file_frag_t after;
+    file_fragstat(target, &before, NULL);
+
+    // the node can move, the report after looks it up again
+    char *path = heap_alloc(FILE_MAX_PATH);
+    file_get_abspath(target, path, FILE_MAX_PATH);
+
+    int status = file_defrag(target, defrag_progress);
+    file_fragstat(file_get_node(path), &after, NULL);
+    heap_free(path);
+
+    char buff[64];
+    frag_average(buff, "AVERAGE RUN BEFORE = ", before.blocks, before.extents);
+    term_write(buff);
+    frag_average(buff, "AVERAGE RUN AFTER = ", after.blocks, after.extents);
+    term_write(buff);
+
+    if (!status) {
+        term_write("Failed defragmenting, the disk is full or a block could not be read!\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void fragstat_each(uint32_t sector, uint32_t blocks, uint32_t extents) {
+    if (extents < 2)
+        return;
+
+    char *path = heap_alloc(FILE_MAX_PATH);
+    file_get_abspath(sector, path, FILE_MAX_PATH);
+    term_write(path);
+    heap_free(path);
+
+    char buff[64];
+    strfmt(buff, ": %d runs, ", extents);
+    term_write(buff);
+    frag_average(buff, "", blocks, extents);
+    term_write(buff);
+}
+
+static int command_fragstat(int argc, char *argv[]) {
+    if (nodisk()) return 1;
+
+    uint32_t target = argc > 0 ? file_get_node(argv[0]) : FILE_NODE_ROOT;
+    if (!target) {
+        term_write("Not found\n");
+        return 1;
+    }
+
+    file_frag_t frag;
+    file_fragstat(target, &frag, fragstat_each);
+
+    char buff[64];
+    strfmt(buff, "ITEMS = %d (%d fragmented)\n", frag.items, frag.fragmented);
+    term_write(buff);
+    strfmt(buff, "BLOCKS = %d in %d runs\n", frag.blocks, frag.extents);
+    term_write(buff);
+    frag_average(buff, "AVERAGE RUN = ", frag.blocks, frag.extents);
+    term_write(buff);
     return 0;
 }
 
@@ -739,9 +1010,7 @@ static int command_nodeinfo(int argc, char *argv[]) {
     }
 
     file_node_t node;
-    file_data_t block;
     file_node(node_sector, &node);
-    file_data(node.first_block, &block);
 
     char buff[128];
     strfmt(buff, "NAME = %s\n", node.name);
@@ -775,13 +1044,25 @@ static int command_nodeinfo(int argc, char *argv[]) {
         day, month, dt.year);
     term_write(buff);
     
-    strfmt(buff, "SECTOR = %d\n", node_sector);
+    strfmt(buff, "NODE = %d\n", node_sector);
     term_write(buff);
     if (node.flags & FILE_FOLDER)
         strcpy(buff, "TYPE = FOLDER\n");
     else if (node.flags & FILE_DATA) {
-        strfmt(buff, "SIZE = %d (%d sectors)\n", node.size, (int)node.size / sizeof(block.data));
+        strfmt(buff, "SIZE = %d (%d sectors)\n", node.size, (int)((node.size + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE));
         term_write(buff);
+        if (node.flags & FILE_INLINE)
+            strcpy(buff, "EXTENTS = INLINE\n");
+        else
+            strfmt(buff, "EXTENTS = %d\n", node.extent_count);
+        term_write(buff);
+        if (node.flags & FILE_COMPRESSED) {
+            file_map_t map;
+            file_map_load(node_sector, &node, &map);
+            strfmt(buff, "COMPRESSED = %d sectors\n", map.blocks);
+            file_map_free(&map);
+            term_write(buff);
+        }
         strcpy(buff, "TYPE = FILE\n");
     }
     term_write(buff);
@@ -811,6 +1092,10 @@ static int command_printfile(int argc, char *argv[]) {
     }
 
     char *file_content = file_read(file_sector);
+    if (!file_content) {
+        term_write("Failed reading file!\n");
+        return 1;
+    }
     term_write(file_content);
 
     heap_free(file_content);
@@ -881,12 +1166,8 @@ static int command_diskinfo(int argc, char *argv[]) {
 
     char buffer[64];
 
-    uint8_t ata_id[512];
-    if (ata_identify(file_port, ata_id)) {
-        uint16_t *w = (uint16_t*) ata_id;
-        drive_t drive;
-        file_drive_spec(&drive);
-
+    drive_t drive;
+    if (file_drive_spec(&drive)) {
         strfmt(buffer, "SLOT = %d\n", file_drive_slot());
         term_write(buffer);
 
@@ -902,9 +1183,9 @@ static int command_diskinfo(int argc, char *argv[]) {
         term_write(drive.model);
         term_write("\n");
 
-        uint32_t sectors = (uint32_t)w[60] | ((uint32_t)w[61] << 16);
+        uint32_t sectors = file_device.blocks;
         char disk_total[16];
-        unit_get_size(sectors * 512, disk_total);
+        unit_get_size(sectors * file_device.block_size, disk_total);
         strfmt(buffer, "SECTORS = %d (%s)\n", sectors, disk_total);
         term_write(buffer);
     } else term_write("Couldn't identify disk.\n");
@@ -912,6 +1193,168 @@ static int command_diskinfo(int argc, char *argv[]) {
     return 0;
 }
 
+static int command_dma(int argc, char *argv[]) {
+    if (file_drive_status != FILE_DRIVE_OK) {
+        term_write("No drive.\n");
+        return 1;
+    }
+
+    if (file_device.type != BLKDEV_ATA) {
+        term_write("DMA setting only applies to IDE drives.\n");
+        return 1;
+    }
+
+    if (argc > 0) {
+        if (!strcmp(argv[0], "on")) {
+            uint8_t ata_id[512];
+            if (!ata_identify(file_device.dev, ata_id) || !ide_dma_enable(file_device.dev, ata_id)) {
+                term_write("DMA is not supported.\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[0], "off")) {
+            ide_dma_disable(file_device.dev);
+        } else {
+            term_write("Usage: dma [on|off]\n");
+            return 1;
+        }
+    }
+
+    term_write(ide_dma_enabled(file_device.dev) ? "DMA = ON\n" : "DMA = OFF\n");
+    return 0;
+}
+
+static int command_ramdisk(int argc, char *argv[]) {
+    int kb = argc > 0 ? intstr(argv[0]) : RAMDISK_DEFAULT_KB;
+    if (kb <= 0) {
+        term_write("Usage: ramdisk [size in KB]\n");
+        return 1;
+    }
+
+    if (!file_ramdisk(kb * 2)) {
+        char buffer[64];
+        strfmt(buffer, "Couldn't create ramdisk (minimum %d KB).\n", RAMDISK_MIN_BLOCKS / 2);
+        term_write(buffer);
+        return 1;
+    }
+
+    file_init_by_slot(FILE_SLOT_RAM);
+    file_format();
+
+    term_write("Ramdisk mounted. Use \"mount <slot>\" to switch back.\n");
+    return 0;
+}
+
+static void iostat_histogram(const char *title, uint32_t *hist) {
+    char buffer[64];
+    int shown = 0;
+
+    for (int i = 0; i < BLKDEV_HIST_BUCKETS; i++) {
+        if (!hist[i])
+            continue;
+
+        if (!shown++) {
+            term_write(title);
+            term_write(":\n");
+        }
+
+        // bucket i holds latencies below 2^i microseconds
+        uint32_t limit = 1u << i;
+        if (i == BLKDEV_HIST_BUCKETS - 1)
+            strfmt(buffer, "  >= %d ms: %d\n", (limit >> 1) / 1000, hist[i]);
+        else if (limit < 1000)
+            strfmt(buffer, "  < %d us: %d\n", limit, hist[i]);
+        else
+            strfmt(buffer, "  < %d ms: %d\n", limit / 1000, hist[i]);
+        term_write(buffer);
+    }
+}
+
+static int command_iostat(int argc, char *argv[]) {
+    if (file_drive_status != FILE_DRIVE_OK) {
+        term_write("No drive.\n");
+        return 1;
+    }
+
+    if (argc > 0) {
+        if (strcmp(argv[0], "reset")) {
+            term_write("Usage: iostat [reset]\n");
+            return 1;
+        }
+
+        blkdev_stats_reset(&file_device);
+        return 0;
+    }
+
+    blkdev_stats_t *stats = &file_device.stats;
+    char buffer[64];
+
+    strfmt(buffer, "DEVICE = %s (slot: %d)\n", file_device.model, file_drive_slot());
+    term_write(buffer);
+    strfmt(buffer, "READS = %d (%d sectors)\n", stats->reads, stats->read_sectors);
+    term_write(buffer);
+    strfmt(buffer, "WRITES = %d (%d sectors)\n", stats->writes, stats->write_sectors);
+    term_write(buffer);
+    strfmt(buffer, "FLUSHES = %d\n", stats->flushes);
+    term_write(buffer);
+    strfmt(buffer, "ERRORS = %d, RETRIES = %d, TIMEOUTS = %d\n", stats->errors, stats->retries, stats->timeouts);
+    term_write(buffer);
+
+    iostat_histogram("READ LATENCY", stats->read_hist);
+    iostat_histogram("WRITE LATENCY", stats->write_hist);
+    iostat_histogram("FLUSH LATENCY", stats->flush_hist);
+    return 0;
+}
+
+static int command_cache(int argc, char *argv[]) {
+    char buffer[64];
+
+    if (argc > 0) {
+        int kb = intstr(argv[0]);
+        if (kb <= 0) {
+            term_write("Usage: cache [size in KB]\n");
+            return 1;
+        }
+
+        bcache_set_budget(kb * 2);
+    }
+
+    char used[16];
+    char budget[16];
+    unit_get_size(bcache_blocks * 512, used);
+    unit_get_size(bcache_budget * 512, budget);
+
+    strfmt(buffer, "SIZE = %s / %s (%d dirty)\n", used, budget, bcache_dirty);
+    term_write(buffer);
+    strfmt(buffer, "HITS = %d, MISSES = %d\n", bcache_stats.hits, bcache_stats.misses);
+    term_write(buffer);
+    strfmt(buffer, "EVICTIONS = %d, WRITEBACKS = %d\n", bcache_stats.evictions, bcache_stats.writebacks);
+    term_write(buffer);
+    return 0;
+}
+
+static int command_mount(int argc, char *argv[]) {
+    char buffer[64];
+
+    if (argc < 1) {
+        strfmt(buffer, "SLOT = %d\n", file_drive_slot());
+        term_write(buffer);
+        return 0;
+    }
+
+    int slot = intstr(argv[0]);
+    if (slot <= 0 || slot > 255 || !file_init_by_slot(slot)) {
+        term_write("Invalid slot.\n");
+        return 1;
+    }
+
+    if (file_drive_status != FILE_DRIVE_OK) {
+        term_write("No usable drive in that slot.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
 static int command_reloadconfig(int argc, char *argv[]) {
     unused(argc); unused(argv);
 
@@ -944,6 +1387,10 @@ static int command_viewimage(int argc, char *argv[]) {
     }
 
     char *content = file_read(file_sector);
+    if (!content) {
+        term_write("Failed reading file!");
+        return 1;
+    }
     image_t *image = image_png(content, file.size);
 
     screen_draw_rgba(image->data, image->size, 0, term_y + (FONT_HEIGHT * screen_scale), image->width, image->height, 0);
@@ -977,6 +1424,10 @@ static int command_playaudio(int argc, char *argv[]) {
     }
 
     uint8_t *mp3_data = (uint8_t*)file_read(file_sector);
+    if (!mp3_data) {
+        term_write("Failed reading file!");
+        return 1;
+    }
     uint32_t mp3_size = file.size;
 
     mp3dec_t *decoder = heap_alloc(sizeof(mp3dec_t));
@@ -1127,6 +1578,7 @@ static commands_t commands[] = {
     { "scaledown", command_scaledown },
     { "clear", command_clear },
     { "shutdown", command_shutdown },
+    { "sync", command_sync },
     { "fetch", command_fetch },
     { "echo", command_echo },
     { "list", command_list },
@@ -1142,6 +1594,9 @@ static commands_t commands[] = {
     { "movefile" ,command_movefile },
     { "copyfolder" ,command_copyfolder },
     { "movefolder" ,command_movefolder },
+    { "compress" ,command_compress },
+    { "defrag" ,command_defrag },
+    { "fragstat" ,command_fragstat },
     { "formatdisk" ,command_formatdisk },
     { "nodeinfo", command_nodeinfo },
     { "printfile", command_printfile },
@@ -1150,6 +1605,11 @@ static commands_t commands[] = {
     { "date", command_date },
     { "datetime", command_datetime },
     { "diskinfo", command_diskinfo },
+    { "dma", command_dma },
+    { "ramdisk", command_ramdisk },
+    { "mount", command_mount },
+    { "iostat", command_iostat },
+    { "cache", command_cache },
     { "reloadconfig", command_reloadconfig },
     { "viewimage", command_viewimage },
     { "playaudio", command_playaudio },
@@ -1,11 +1,39 @@
 #include <cpuid.h>
 #include "cpu.h"
 #include "string.h"
+#include "io.h"
+#include "pit.h"
 
 char cpu_name[64] = {0};
 char cpu_vendor[16] = {0};
 uint32_t cpu_family = 0;
 uint32_t cpu_model = 0;
+uint32_t cpu_tsc_khz = 0;
+
+static void cpu_tsc_calibrate() {
+    // time 10ms on pit channel 2 through the speaker gate, works with interrupts off
+    uint16_t count = PIT_BASE_FREQ / 100;
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+    outb(PIT_COMMAND, PIT_CMD_CHANNEL2 | PIT_CMD_ACCESS_LOHI | PIT_CMD_MODE0 | PIT_CMD_BINARY);
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, count >> 8);
+
+    uint64_t start = cpu_rdtsc();
+    for (uint32_t i = 0; !(inb(0x61) & 0x20); i++) {
+        if (i > 10000000)
+            return;
+    }
+
+    cpu_tsc_khz = (uint32_t) ((cpu_rdtsc() - start) / 10);
+}
+
+uint64_t cpu_micros() {
+    if (cpu_tsc_khz) {
+        uint64_t tsc = cpu_rdtsc();
+        return tsc / cpu_tsc_khz * 1000 + tsc % cpu_tsc_khz * 1000 / cpu_tsc_khz;
+    }
+    return (uint64_t) pit_ticks * 1000000 / (pit_hz ? pit_hz : 1);
+}
 
 void cpu_init() {
     uint32_t eax, ebx, ecx, edx;
@@ -48,4 +76,8 @@ void cpu_init() {
 
         strfmt(cpu_name, "%s (Family %d Model %d)", cpu_vendor, family, model);
     }
+
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (edx & (1 << 4))
+        cpu_tsc_calibrate();
 }
\ No newline at end of file
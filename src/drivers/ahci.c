@@ -0,0 +1,396 @@
+#include "ahci.h"
+#include "ata.h"
+#include "pit.h"
+#include "heap.h"
+#include "paging.h"
+#include "string.h"
+#include "kernel.h"
+
+pci_device_t *ahci_device = NULL;
+uint32_t ahci_abar = 0;
+ahci_port_t ahci_ports[AHCI_MAX_PORTS];
+
+static uint32_t ahci_slots = 1;
+static uint32_t ahci_page_table[1024] __attribute__((aligned(4096)));
+
+static volatile uint32_t *ahci_reg(uint32_t reg) {
+    return (volatile uint32_t*) (ahci_abar + reg);
+}
+
+static volatile uint32_t *ahci_port_reg(int port, uint32_t reg) {
+    return ahci_reg(AHCI_PORT(port) + reg);
+}
+
+static void *ahci_alloc(size_t size, size_t align) {
+    uint32_t ptr = (uint32_t) heap_alloc(size + align);
+    ptr = (ptr + align - 1) & ~(align - 1);
+
+    memset((void*) ptr, 0, size);
+    return (void*) ptr;
+}
+
+static int ahci_spin(int port, uint32_t reg, uint32_t mask) {
+    for (int i = 0; i < 1000000; i++) {
+        if (!(*ahci_port_reg(port, reg) & mask))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void ahci_stop(int port) {
+    volatile uint32_t *cmd = ahci_port_reg(port, AHCI_PxCMD);
+
+    *cmd &= ~AHCI_PxCMD_ST;
+    ahci_spin(port, AHCI_PxCMD, AHCI_PxCMD_CR);
+    *cmd &= ~AHCI_PxCMD_FRE;
+    ahci_spin(port, AHCI_PxCMD, AHCI_PxCMD_FR);
+}
+
+static void ahci_start(int port) {
+    volatile uint32_t *cmd = ahci_port_reg(port, AHCI_PxCMD);
+
+    ahci_spin(port, AHCI_PxCMD, AHCI_PxCMD_CR);
+    ahci_spin(port, AHCI_PxTFD, ATA_STATUS_BSY | ATA_STATUS_DRQ);
+
+    *ahci_port_reg(port, AHCI_PxSERR) = 0xFFFFFFFF;
+    *ahci_port_reg(port, AHCI_PxIS) = 0xFFFFFFFF;
+
+    *cmd |= AHCI_PxCMD_FRE;
+    *cmd |= AHCI_PxCMD_ST;
+}
+
+static void ahci_port_init(int port) {
+    ahci_port_t *p = &ahci_ports[port];
+
+    uint32_t ssts = *ahci_port_reg(port, AHCI_PxSSTS);
+    if (AHCI_SSTS_DET(ssts) != AHCI_DET_PRESENT || *ahci_port_reg(port, AHCI_PxSIG) != AHCI_SIG_ATA)
+        return;
+
+    ahci_stop(port);
+
+    p->list = ahci_alloc(sizeof(ahci_header_t) * AHCI_MAX_SLOTS, 1024);
+    p->fis = ahci_alloc(256, 256);
+    p->tables = ahci_alloc(sizeof(ahci_table_t) * AHCI_MAX_SLOTS, 128);
+
+    for (int i = 0; i < AHCI_MAX_SLOTS; i++) {
+        p->list[i].ctba = (uint32_t) &p->tables[i];
+        p->list[i].ctbau = 0;
+    }
+
+    *ahci_port_reg(port, AHCI_PxCLB) = (uint32_t) p->list;
+    *ahci_port_reg(port, AHCI_PxCLBU) = 0;
+    *ahci_port_reg(port, AHCI_PxFB) = (uint32_t) p->fis;
+    *ahci_port_reg(port, AHCI_PxFBU) = 0;
+    *ahci_port_reg(port, AHCI_PxIE) = 0; // completions are polled
+
+    ahci_start(port);
+
+    p->present = 1;
+    p->ncq = 0;
+    p->depth = 1;
+    p->busy = 0;
+}
+
+int ahci_init() {
+    pci_device_t dev;
+    if (!pci_find_class(&dev, 0x01, 0x06))
+        return 0;
+
+    ahci_device = heap_alloc(sizeof(pci_device_t));
+    memcpy(ahci_device, &dev, sizeof(pci_device_t));
+
+    uint32_t io = pci_device_read(ahci_device, ahci_device->func, PCI_REG_IO);
+    io |= PCI_CMD_MEMORY;
+    io |= PCI_CMD_MASTER;
+    pci_device_write(ahci_device, io, ahci_device->func, PCI_REG_IO);
+
+    ahci_abar = pci_device_read(ahci_device, ahci_device->func, PCI_REG_BAR(5)) & 0xFFFFFFF0;
+    if (!ahci_abar)
+        return 0;
+
+    if (!(page_directory[PAGE_DIR_SLOT(ahci_abar)] & 1))
+        page_map_physical(ahci_abar, ahci_page_table);
+
+    *ahci_reg(AHCI_GHC) |= AHCI_GHC_AE;
+
+    uint32_t cap = *ahci_reg(AHCI_CAP);
+    ahci_slots = AHCI_CAP_NCS(cap);
+
+    uint32_t implemented = *ahci_reg(AHCI_PI);
+    for (int port = 0; port < AHCI_MAX_PORTS; port++) {
+        if (implemented & (1u << port))
+            ahci_port_init(port);
+    }
+
+    return 1;
+}
+
+int ahci_first_port() {
+    for (int port = 0; port < AHCI_MAX_PORTS; port++) {
+        if (ahci_ports[port].present)
+            return port;
+    }
+
+    return -1;
+}
+
+int ahci_port_ready(int port) {
+    return port >= 0 && port < AHCI_MAX_PORTS && ahci_ports[port].present;
+}
+
+static void ahci_build(int port, int slot, uint8_t command, uint32_t lba, uint32_t count, void *buffer, uint32_t bytes, int write) {
+    ahci_port_t *p = &ahci_ports[port];
+    ahci_table_t *table = &p->tables[slot];
+    uint8_t *fis = table->cfis;
+
+    memset(fis, 0, 20);
+    fis[0] = AHCI_FIS_H2D;
+    fis[1] = 1 << 7; // command, not control
+    fis[2] = command;
+    fis[4] = (uint8_t) lba;
+    fis[5] = (uint8_t) (lba >> 8);
+    fis[6] = (uint8_t) (lba >> 16);
+    fis[8] = (uint8_t) (lba >> 24);
+
+    if (command == ATA_READ_FPDMA || command == ATA_WRITE_FPDMA) {
+        fis[3] = (uint8_t) count; // queued commands carry the count in the feature field
+        fis[11] = (uint8_t) (count >> 8);
+        fis[12] = slot << 3; // and the tag in the count field
+        fis[7] = ATA_DRV_LBA;
+    } else if (command != ATA_IDENTIFY) {
+        fis[12] = (uint8_t) count;
+        fis[13] = (uint8_t) (count >> 8);
+        fis[7] = ATA_DRV_LBA;
+    }
+
+    int prds = 0;
+    uint8_t *at = (uint8_t*) buffer;
+    while (bytes > 0 && prds < AHCI_PRD_MAX) {
+        uint32_t chunk = bytes < (4 << 20) ? bytes : (4 << 20);
+
+        table->prdt[prds].dba = (uint32_t) at;
+        table->prdt[prds].dbau = 0;
+        table->prdt[prds].dbc = chunk - 1;
+        prds++;
+
+        at += chunk;
+        bytes -= chunk;
+    }
+
+    ahci_header_t *header = &p->list[slot];
+    header->flags = AHCI_CMD_CFL(5) | (write ? AHCI_CMD_WRITE : 0) | AHCI_CMD_PRDTL(prds);
+    header->prdbc = 0;
+}
+
+static int ahci_free_slot(int port) {
+    ahci_port_t *p = &ahci_ports[port];
+    uint32_t active = p->busy | *ahci_port_reg(port, AHCI_PxCI) | *ahci_port_reg(port, AHCI_PxSACT);
+
+    for (uint32_t slot = 0; slot < p->depth; slot++) {
+        if (!(active & (1u << slot)))
+            return slot;
+    }
+
+    return -1;
+}
+
+static int ahci_issue(int port, uint8_t command, uint32_t lba, uint32_t count, void *buffer, uint32_t bytes, int write) {
+    ahci_port_t *p = &ahci_ports[port];
+
+    int slot = ahci_free_slot(port);
+    if (slot < 0)
+        return -1;
+
+    ahci_build(port, slot, command, lba, count, buffer, bytes, write);
+    p->busy |= 1u << slot;
+
+    if (command == ATA_READ_FPDMA || command == ATA_WRITE_FPDMA)
+        *ahci_port_reg(port, AHCI_PxSACT) = 1u << slot;
+    *ahci_port_reg(port, AHCI_PxCI) = 1u << slot;
+
+    return slot;
+}
+
+int ahci_submit(int port, uint32_t lba, uint32_t count, void *buffer, int write) {
+    if (!ahci_port_ready(port) || count == 0 || count > AHCI_MAX_SECTORS)
+        return -1;
+
+    uint8_t command;
+    if (ahci_ports[port].ncq)
+        command = write ? ATA_WRITE_FPDMA : ATA_READ_FPDMA;
+    else
+        command = write ? ATA_WRITE_DMA_EXT : ATA_READ_DMA_EXT;
+
+    return ahci_issue(port, command, lba, count, buffer, count * 512, write);
+}
+
+int ahci_wait(int port, int slot) {
+    ahci_port_t *p = &ahci_ports[port];
+    uint32_t bit = 1u << slot;
+
+    if (slot < 0 || !(p->busy & bit))
+        return 0;
+
+    uint32_t start = pit_ticks;
+    for (;;) {
+        uint32_t active = *ahci_port_reg(port, AHCI_PxCI) | *ahci_port_reg(port, AHCI_PxSACT);
+        if (!(active & bit))
+            break;
+
+        int timeout = pit_ticks - start > AHCI_TIMEOUT;
+        if (timeout)
+            blkdev_timeouts++;
+
+        if (*ahci_port_reg(port, AHCI_PxIS) & AHCI_PxIS_TFES || timeout) {
+            // a failed queued command aborts everything in flight, restart the port
+            ahci_stop(port);
+            ahci_start(port);
+            p->busy = 0;
+            return 0;
+        }
+    }
+
+    p->busy &= ~bit;
+    return !(*ahci_port_reg(port, AHCI_PxTFD) & ATA_STATUS_ERR);
+}
+
+int ahci_drain(int port) {
+    ahci_port_t *p = &ahci_ports[port];
+    int status = 1;
+
+    for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (p->busy & (1u << slot) && !ahci_wait(port, slot))
+            status = 0;
+    }
+
+    return status;
+}
+
+static int ahci_transfer(int port, uint32_t lba, uint32_t count, uint8_t *buffer, int write) {
+    int status = 1;
+
+    // keep as many chunks in flight as the queue depth allows, then reap them all
+    while (count > 0) {
+        uint32_t n = count < AHCI_MAX_SECTORS ? count : AHCI_MAX_SECTORS;
+
+        int slot = ahci_submit(port, lba, n, buffer, write);
+        if (slot < 0) {
+            if (!ahci_ports[port].busy)
+                return 0;
+
+            if (!ahci_drain(port))
+                status = 0;
+            continue;
+        }
+
+        lba += n;
+        buffer += n * 512;
+        count -= n;
+    }
+
+    return ahci_drain(port) && status;
+}
+
+int ahci_read(int port, uint32_t lba, uint32_t count, void *buffer) {
+    return ahci_transfer(port, lba, count, (uint8_t*) buffer, 0);
+}
+
+int ahci_write(int port, uint32_t lba, uint32_t count, void *buffer) {
+    return ahci_transfer(port, lba, count, (uint8_t*) buffer, 1);
+}
+
+static int ahci_command(int port, uint8_t command, void *buffer, uint32_t bytes) {
+    if (!ahci_port_ready(port))
+        return 0;
+
+    ahci_drain(port); // non-queued commands can't overlap queued ones
+
+    int slot = ahci_issue(port, command, 0, 0, buffer, bytes, 0);
+    return ahci_wait(port, slot);
+}
+
+int ahci_identify(int port, void *buffer) {
+    return ahci_command(port, ATA_IDENTIFY, buffer, 512);
+}
+
+int ahci_enable_ncq(int port, void *identify) {
+    uint16_t *w = (uint16_t*) identify;
+    ahci_port_t *p = &ahci_ports[port];
+
+    p->ncq = 0;
+    p->depth = 1;
+
+    if (!(*ahci_reg(AHCI_CAP) & AHCI_CAP_SNCQ) || !(w[76] & (1 << 8)))
+        return 0;
+
+    uint32_t depth = (w[75] & 0x1F) + 1;
+    if (depth > ahci_slots)
+        depth = ahci_slots;
+
+    p->ncq = 1;
+    p->depth = depth;
+    return depth;
+}
+
+int ahci_flush(int port) {
+    return ahci_command(port, ATA_FLUSH_EXT, NULL, 0);
+}
+
+static int ahci_blk_read(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer) {
+    return ahci_read(dev->dev, lba, count, buffer);
+}
+
+static int ahci_blk_write(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer) {
+    return ahci_write(dev->dev, lba, count, buffer);
+}
+
+static int ahci_blk_flush(blkdev_t *dev) {
+    return ahci_flush(dev->dev);
+}
+
+static int ahci_blk_issue(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer, int write) {
+    return ahci_submit(dev->dev, lba, count, buffer, write);
+}
+
+static int ahci_blk_wait(blkdev_t *dev, int tag) {
+    return ahci_wait(dev->dev, tag);
+}
+
+int ahci_blkdev(blkdev_t *dev, int port) {
+    memset(dev, 0, sizeof(blkdev_t));
+    dev->type = BLKDEV_AHCI;
+    dev->dev = port;
+    dev->max_blocks = AHCI_MAX_SECTORS;
+    dev->read = ahci_blk_read;
+    dev->write = ahci_blk_write;
+    dev->flush = ahci_blk_flush;
+    dev->issue = ahci_blk_issue;
+    dev->wait = ahci_blk_wait;
+
+    char msg[64];
+
+    if (!ahci_port_ready(port)) {
+        strfmt(msg, "[ WARNING ] AHCI: No drive on port %d\n", port);
+        log(msg);
+        return BLKDEV_ABSENT;
+    }
+
+    uint8_t ata_id[512];
+    if (!ahci_identify(port, ata_id)) {
+        log("[ WARNING ] AHCI: Failed to identify drive.\n");
+        return BLKDEV_INCOMPATIBLE;
+    }
+
+    int depth = ahci_enable_ncq(port, ata_id);
+    if (depth) {
+        strfmt(msg, "[ INFO ] AHCI: NCQ enabled (depth: %d)\n", depth);
+        log(msg);
+    }
+
+    blkdev_from_identify(dev, (uint16_t*) ata_id);
+
+    strfmt(msg, "[ INFO ] AHCI: Drive OK. (port: %d)\n", port);
+    log(msg);
+    return BLKDEV_OK;
+}
@@ -1,7 +1,21 @@
 #include "ata.h"
+#include "ide.h"
 #include "io.h"
 #include "pit.h"
+#include "pic.h"
 #include "string.h"
+#include "kernel.h"
+
+int ata_irq_enabled = 0;
+
+static uint8_t ata_multiple[2][2]; // sectors per DRQ block for READ/WRITE MULTIPLE, per drive, 0 when unsupported
+static uint8_t ata_selected[2]; // drive last selected on each channel
+static volatile int ata_irq_pending[2];
+static volatile uint8_t ata_irq_status[2];
+
+static int ata_channel(uint16_t base) {
+    return base == ATA_SECONDARY;
+}
 
 uint16_t ata_port(uint16_t base, uint8_t port) {
     return (uint16_t) base + port;
@@ -12,6 +26,7 @@ uint8_t ata_status(uint16_t base) {
 }
 
 void ata_command(uint16_t base, uint8_t command) {
+    ata_irq_pending[ata_channel(base)] = 0;
     outb(ata_port(base, ATA_PORT_COMMAND), command);
 }
 
@@ -30,8 +45,8 @@ void ata_clear_lba(uint16_t base) {
     outb(ata_port(base, ATA_PORT_LBA_HI), 0);
 }
 
-void ata_set_lba(uint16_t base, uint32_t lba) {
-    outb(ata_port(base, ATA_PORT_SECTOR), 1);
+void ata_set_lba(uint16_t base, uint32_t lba, uint32_t count) {
+    outb(ata_port(base, ATA_PORT_SECTOR), (uint8_t) count); // 256 wraps to 0
     outb(ata_port(base, ATA_PORT_LBA_LO), (uint8_t) lba);
     outb(ata_port(base, ATA_PORT_LBA_MID), (uint8_t) (lba >> 8));
     outb(ata_port(base, ATA_PORT_LBA_HI), (uint8_t) (lba >> 16));
@@ -45,8 +60,10 @@ void ata_wait_io(uint16_t base) {
 int ata_wait_ready(uint16_t base) {
     uint32_t start = pit_ticks;
     while (ata_status(base) & ATA_STATUS_BSY) {
-        if (pit_ticks - start > 1000)
+        if (pit_ticks - start > 1000) {
+            blkdev_timeouts++;
             return 0;
+        }
     }
 
     return 1;
@@ -56,24 +73,118 @@ int ata_wait_data(uint16_t base) {
     uint32_t start = pit_ticks;
     while (!(ata_status(base) & ATA_STATUS_DRQ)) {
         uint8_t status = ata_status(base);
-        if (status & ATA_STATUS_ERR || status & ATA_STATUS_DF || pit_ticks - start > 5000)
+        if (status & ATA_STATUS_ERR || status & ATA_STATUS_DF)
+            return 0;
+
+        if (pit_ticks - start > 5000) {
+            blkdev_timeouts++;
             return 0;
+        }
     }
 
     return 1;
 }
 
 void ata_select(uint16_t base, uint8_t drive) {
+    ata_selected[ata_channel(base)] = drive & 1;
     outb(ata_port(base, ATA_PORT_DRIVE), ATA_DRV_BASE | (drive << 4) | ATA_DRV_LBA);
     ata_wait_io(base);
 }
 
-int ata_prepare(uint16_t base, uint32_t lba, uint8_t command) {
+void ata_irq_init() {
+    outb(ATA_PRIMARY + ATA_CTRL_OFFSET, 0);
+    outb(ATA_SECONDARY + ATA_CTRL_OFFSET, 0);
+
+    ata_irq_pending[0] = 0;
+    ata_irq_pending[1] = 0;
+
+    pic_unmask(ATA_IRQ_PRIMARY);
+    pic_unmask(ATA_IRQ_SECONDARY);
+    ata_irq_enabled = 1;
+}
+
+void ata_handle(uint8_t irq) {
+    int channel = irq == ATA_IRQ_SECONDARY;
+    uint16_t base = channel ? ATA_SECONDARY : ATA_PRIMARY;
+
+    ata_irq_status[channel] = ata_status(base); // reading status acknowledges the drive
+    ata_irq_pending[channel] = 1;
+}
+
+int ata_wait_irq(uint16_t base, uint8_t *status) {
+    int channel = ata_channel(base);
+
+    uint32_t eflags;
+    __asm__ volatile("pushf\npop %0" : "=r"(eflags));
+
+    // shell commands run inside the keyboard handler, keep input from re-entering while halted
+    int nested = !(eflags & (1 << 9));
+    uint8_t mask1 = inb(PIC1_DATA);
+    uint8_t mask2 = inb(PIC2_DATA);
+    if (nested) {
+        pic_mask(1);
+        pic_mask(12);
+    }
+
+    int fired = 0;
+    uint32_t start = pit_ticks;
+    for (;;) {
+        __asm__ volatile("cli");
+        if (ata_irq_pending[channel]) {
+            fired = 1;
+            break;
+        }
+
+        if (pit_ticks - start > ATA_IRQ_TIMEOUT) {
+            blkdev_timeouts++;
+            break;
+        }
+
+        __asm__ volatile("sti\nhlt"); // sti holds interrupts off until after hlt, no wakeup is lost
+    }
+
+    ata_irq_pending[channel] = 0;
+    if (status)
+        *status = fired ? ata_irq_status[channel] : ata_status(base);
+
+    if (nested) {
+        outb(PIC1_DATA, mask1);
+        outb(PIC2_DATA, mask2);
+    } else
+        __asm__ volatile("sti");
+
+    return fired;
+}
+
+static int ata_wait_drq(uint16_t base, int irq) {
+    if (irq && ata_irq_enabled) {
+        uint8_t status;
+        if (!ata_wait_irq(base, &status) || status & (ATA_STATUS_ERR | ATA_STATUS_DF))
+            return 0;
+    }
+
+    return ata_wait_ready(base) && ata_wait_data(base);
+}
+
+static int ata_wait_done(uint16_t base) {
+    if (ata_irq_enabled) {
+        uint8_t status;
+        if (!ata_wait_irq(base, &status))
+            return 0;
+
+        return !(status & (ATA_STATUS_ERR | ATA_STATUS_DF));
+    }
+
+    ata_wait_io(base);
+    return ata_wait_ready(base) && !(ata_status(base) & ATA_STATUS_ERR);
+}
+
+int ata_prepare(uint16_t base, uint32_t lba, uint32_t count, uint8_t command) {
     if (!ata_wait_ready(base))
         return 0;
 
     if (command != ATA_IDENTIFY)
-        ata_set_lba(base, lba);
+        ata_set_lba(base, lba, count);
     else
         ata_clear_lba(base);
 
@@ -84,7 +195,7 @@ int ata_prepare(uint16_t base, uint32_t lba, uint8_t command) {
 }
 
 int ata_identify(uint16_t base, void *buffer) {
-    if (!ata_prepare(base, 0, ATA_IDENTIFY))
+    if (!ata_prepare(base, 0, 0, ATA_IDENTIFY))
         return 0;
 
     uint8_t status = ata_status(base);
@@ -98,40 +209,121 @@ int ata_identify(uint16_t base, void *buffer) {
     return 1;
 }
 
-int ata_read_sector(uint16_t base, uint32_t lba, void *buffer) {
-    if (!ata_prepare(base, lba, ATA_READ))
-        return 0;
+int ata_set_multiple(uint16_t base, void *identify) {
+    uint16_t *w = (uint16_t*) identify;
+    uint8_t sectors = w[47] & 0xFF;
 
-    uint8_t status = ata_status(base);
-    if (status & ATA_STATUS_ERR) return 0;
+    uint8_t *multiple = &ata_multiple[ata_channel(base)][ata_selected[ata_channel(base)]];
+    *multiple = 0;
+    if (sectors == 0 || !ata_wait_ready(base))
+        return 0;
 
-    uint16_t *word = (uint16_t*) buffer;
+    outb(ata_port(base, ATA_PORT_SECTOR), sectors);
+    ata_command(base, ATA_SET_MULTIPLE);
+    ata_wait_io(base);
 
-    for (int i = 0; i < 256; i++)
-        word[i] = ata_read(base);
+    if (!ata_wait_ready(base) || ata_status(base) & ATA_STATUS_ERR)
+        return 0;
 
+    *multiple = sectors;
     return 1;
 }
 
-int ata_write_sector(uint16_t base, uint32_t lba, void *buffer) {
-    if (!ata_prepare(base, lba, ATA_WRITE))
+static int ata_transfer(uint16_t base, uint32_t lba, uint32_t count, uint8_t *buffer, int write) {
+    uint32_t multiple = ata_multiple[ata_channel(base)][ata_selected[ata_channel(base)]];
+    uint8_t command;
+
+    if (multiple) {
+        command = write ? ATA_WRITE_MULTIPLE : ATA_READ_MULTIPLE;
+    } else {
+        command = write ? ATA_WRITE : ATA_READ;
+        multiple = 1;
+    }
+
+    if (!ata_wait_ready(base))
         return 0;
 
-    uint8_t status = ata_status(base);
-    if (status & ATA_STATUS_ERR) return 0;
+    ata_set_lba(base, lba, count);
+    ata_command(base, command);
+    ata_wait_io(base);
 
-    uint16_t *word = (uint16_t*) buffer;
+    // a write's first DRQ block raises no interrupt
+    if (!ata_wait_drq(base, !write))
+        return 0;
 
-    for (int i = 0; i < 256; i++)
-        ata_write(base, word[i]);
+    while (count > 0) {
+        uint32_t block = count < multiple ? count : multiple;
 
-    ata_command(base, ATA_FLUSH);
-    ata_wait_io(base);
-    ata_wait_ready(base);
+        if (write)
+            outsw(ata_port(base, ATA_PORT_DATA), buffer, block * 256);
+        else
+            insw(ata_port(base, ATA_PORT_DATA), buffer, block * 256);
+
+        buffer += block * 512;
+        count -= block;
+
+        if (count > 0) {
+            ata_wait_io(base);
+            if (!ata_wait_drq(base, 1))
+                return 0;
+        }
+    }
+
+    if (write)
+        return ata_wait_done(base);
+
+    return !(ata_status(base) & ATA_STATUS_ERR);
+}
+
+int ata_read_sectors(uint16_t base, uint32_t lba, uint32_t count, void *buffer) {
+    uint8_t *data = (uint8_t*) buffer;
+
+    while (count > 0) {
+        uint32_t n = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+        if (!ide_dma_transfer(base, lba, n, data, 0) && !ata_transfer(base, lba, n, data, 0))
+            return 0;
+
+        lba += n;
+        data += n * 512;
+        count -= n;
+    }
 
     return 1;
 }
 
+int ata_write_sectors(uint16_t base, uint32_t lba, uint32_t count, void *buffer) {
+    uint8_t *data = (uint8_t*) buffer;
+
+    while (count > 0) {
+        uint32_t n = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+        if (!ide_dma_transfer(base, lba, n, data, 1) && !ata_transfer(base, lba, n, data, 1))
+            return 0;
+
+        lba += n;
+        data += n * 512;
+        count -= n;
+    }
+
+    return 1;
+}
+
+int ata_read_sector(uint16_t base, uint32_t lba, void *buffer) {
+    return ata_read_sectors(base, lba, 1, buffer);
+}
+
+int ata_write_sector(uint16_t base, uint32_t lba, void *buffer) {
+    return ata_write_sectors(base, lba, 1, buffer);
+}
+
+int ata_flush(uint16_t base) {
+    if (!ata_wait_ready(base))
+        return 0;
+
+    ata_command(base, ATA_FLUSH);
+    ata_wait_io(base);
+    return ata_wait_done(base);
+}
+
 int ata_get_string(uint16_t *w, int start, int end, char *dest, size_t size) {
     int j = 0;
 
@@ -149,3 +341,75 @@ int ata_get_string(uint16_t *w, int start, int end, char *dest, size_t size) {
         return 0;
     return 1;
 }
+
+static int ata_blk_transfer(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer, int write) {
+    for (int attempt = 0; attempt <= ATA_RETRIES; attempt++) {
+        if (attempt)
+            dev->stats.retries++;
+
+        int status = write ? ata_write_sectors(dev->dev, lba, count, buffer) : ata_read_sectors(dev->dev, lba, count, buffer);
+        if (status)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int ata_blk_read(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer) {
+    return ata_blk_transfer(dev, lba, count, buffer, 0);
+}
+
+static int ata_blk_write(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer) {
+    return ata_blk_transfer(dev, lba, count, buffer, 1);
+}
+
+static int ata_blk_flush(blkdev_t *dev) {
+    return ata_flush(dev->dev);
+}
+
+int ata_blkdev(blkdev_t *dev, uint16_t base, uint8_t drive) {
+    memset(dev, 0, sizeof(blkdev_t));
+    dev->type = BLKDEV_ATA;
+    dev->dev = base;
+    dev->max_blocks = ATA_MAX_SECTORS;
+    dev->read = ata_blk_read;
+    dev->write = ata_blk_write;
+    dev->flush = ata_blk_flush;
+
+    ata_select(base, drive);
+
+    char msg[64];
+    uint8_t status = ata_status(base);
+
+    if (status == 0x00 || status == 0x7F || status == 0xFF) {
+        strfmt(msg, "[ WARNING ] ATA: Could not detect drive. (status: 0x%x2)\n", status);
+        log(msg);
+        return BLKDEV_ABSENT;
+    }
+
+    uint8_t ata_id[512];
+    if (!ata_identify(base, ata_id)) {
+        log("[ WARNING ] ATA: Failed to identify drive.\n");
+        return BLKDEV_INCOMPATIBLE;
+    }
+
+    uint16_t *w = (uint16_t*) ata_id;
+    if (w[0] & (1 << 15)) {
+        log("[ WARNING ] ATA: Drive is not compatible.\n");
+        return BLKDEV_INCOMPATIBLE;
+    }
+
+    if (ata_set_multiple(base, ata_id)) {
+        strfmt(msg, "[ INFO ] ATA: Multiple mode (%d sectors/block)\n", w[47] & 0xFF);
+        log(msg);
+    }
+
+    if (ide_dma_enable(base, ata_id))
+        log("[ INFO ] ATA: Bus master DMA enabled\n");
+
+    blkdev_from_identify(dev, w);
+
+    strfmt(msg, "[ INFO ] ATA: Drive OK. (status: 0x%x2)\n", status);
+    log(msg);
+    return BLKDEV_OK;
+}
@@ -0,0 +1,286 @@
+#include "bcache.h"
+#include "heap.h"
+#include "string.h"
+
+uint32_t bcache_budget = BCACHE_DEFAULT_BLOCKS;
+uint32_t bcache_blocks = 0;
+uint32_t bcache_dirty = 0;
+uint32_t bcache_pinned = 0;
+bcache_stats_t bcache_stats;
+int (*bcache_pressure)(blkdev_t *dev) = NULL;
+
+static bcache_buf_t *bcache_hash[BCACHE_HASH];
+static bcache_buf_t *bcache_lru_head = NULL; // most recently used
+static bcache_buf_t *bcache_lru_tail = NULL;
+
+static uint32_t bcache_slot(blkdev_t *dev, uint32_t lba) {
+    return (lba ^ ((uint32_t) dev >> 4)) % BCACHE_HASH;
+}
+
+static void bcache_unlink(bcache_buf_t *buf) {
+    if (buf->lru_prev)
+        buf->lru_prev->lru_next = buf->lru_next;
+    else
+        bcache_lru_head = buf->lru_next;
+
+    if (buf->lru_next)
+        buf->lru_next->lru_prev = buf->lru_prev;
+    else
+        bcache_lru_tail = buf->lru_prev;
+}
+
+static void bcache_push(bcache_buf_t *buf) {
+    buf->lru_prev = NULL;
+    buf->lru_next = bcache_lru_head;
+    if (bcache_lru_head)
+        bcache_lru_head->lru_prev = buf;
+    bcache_lru_head = buf;
+
+    if (!bcache_lru_tail)
+        bcache_lru_tail = buf;
+}
+
+static void bcache_touch(bcache_buf_t *buf) {
+    if (bcache_lru_head == buf)
+        return;
+
+    bcache_unlink(buf);
+    bcache_push(buf);
+}
+
+static bcache_buf_t *bcache_find(blkdev_t *dev, uint32_t lba) {
+    for (bcache_buf_t *buf = bcache_hash[bcache_slot(dev, lba)]; buf; buf = buf->hash_next) {
+        if (buf->dev == dev && buf->lba == lba)
+            return buf;
+    }
+
+    return NULL;
+}
+
+static void bcache_remove(bcache_buf_t *buf) {
+    bcache_buf_t **link = &bcache_hash[bcache_slot(buf->dev, buf->lba)];
+    while (*link != buf)
+        link = &(*link)->hash_next;
+    *link = buf->hash_next;
+
+    bcache_unlink(buf);
+    if (buf->dirty)
+        bcache_dirty--;
+    if (buf->pinned)
+        bcache_pinned--;
+
+    heap_free(buf);
+    bcache_blocks--;
+}
+
+// a block is clean once its write has completed, a failed one stays dirty for the next writeback
+static void bcache_written(blkq_request_t *request, int status) {
+    bcache_buf_t *buf = (bcache_buf_t*) request->data;
+    if (status && buf->dirty) {
+        buf->dirty = 0;
+        bcache_dirty--;
+    }
+}
+
+static int bcache_writeback(blkq_t *queue) {
+    if (!bcache_dirty)
+        return 1;
+
+    // hand every dirty block of the device to the queue, it sorts and merges them into runs
+    for (bcache_buf_t *buf = bcache_lru_head; buf; buf = buf->lru_next) {
+        if (!buf->dirty || buf->pinned || buf->dev != queue->dev)
+            continue;
+
+        blkq_submit(queue, buf->lba, 1, buf->data, 1, bcache_written, buf);
+        bcache_stats.writebacks++;
+    }
+
+    return blkq_run(queue);
+}
+
+static void bcache_evict(blkq_t *queue) {
+    while (bcache_blocks >= bcache_budget) {
+        bcache_buf_t *victim = bcache_lru_tail;
+        while (victim && victim->pinned)
+            victim = victim->lru_prev;
+
+        // only pinned blocks left, their owner is asked to release them
+        if (!victim) {
+            if (bcache_pressure && bcache_pressure(queue->dev))
+                continue;
+            return; // held back until its next commit, that many blocks over budget
+        }
+
+        // write back in one batch rather than a block at a time
+        if (victim->dirty) {
+            if (victim->dev != queue->dev)
+                return; // no queue for that device here, let the cache run over budget
+            if (!bcache_writeback(queue) || victim->dirty)
+                return; // never dropped before it's on the disk
+        }
+
+        bcache_remove(victim);
+        bcache_stats.evictions++;
+    }
+}
+
+static bcache_buf_t *bcache_insert(blkq_t *queue, uint32_t lba) {
+    bcache_evict(queue);
+
+    bcache_buf_t *buf = heap_alloc(sizeof(bcache_buf_t));
+    if (!buf)
+        return NULL;
+
+    buf->dev = queue->dev;
+    buf->lba = lba;
+    buf->dirty = 0;
+    buf->pinned = 0;
+
+    uint32_t slot = bcache_slot(buf->dev, lba);
+    buf->hash_next = bcache_hash[slot];
+    bcache_hash[slot] = buf;
+
+    bcache_push(buf);
+
+    bcache_blocks++;
+    return buf;
+}
+
+void bcache_set_budget(uint32_t blocks) {
+    bcache_budget = blocks < BCACHE_MIN_BLOCKS ? BCACHE_MIN_BLOCKS : blocks;
+
+    // shrink by dropping clean blocks only, dirty ones leave at the next sync
+    bcache_buf_t *buf = bcache_lru_tail;
+    while (buf && bcache_blocks > bcache_budget) {
+        bcache_buf_t *prev = buf->lru_prev;
+        if (!buf->dirty && !buf->pinned)
+            bcache_remove(buf);
+        buf = prev;
+    }
+}
+
+int bcache_read(blkq_t *queue, uint32_t lba, uint32_t count, void *buffer) {
+    uint8_t *out = (uint8_t*) buffer;
+    int status = 1;
+
+    uint32_t i = 0;
+    while (i < count) {
+        bcache_buf_t *buf = bcache_find(queue->dev, lba + i);
+        if (buf) {
+            memcpy(out + i * 512, buf->data, 512);
+            bcache_touch(buf);
+            bcache_stats.hits++;
+            i++;
+            continue;
+        }
+
+        // fetch the whole stretch of misses in one transfer
+        uint32_t run = 1;
+        while (i + run < count && !bcache_find(queue->dev, lba + i + run))
+            run++;
+        bcache_stats.misses += run;
+
+        if (!blkq_read(queue, lba + i, run, out + i * 512)) {
+            status = 0;
+            i += run;
+            continue;
+        }
+
+        if (run < BCACHE_BYPASS) {
+            for (uint32_t j = 0; j < run; j++) {
+                buf = bcache_insert(queue, lba + i + j);
+                if (buf)
+                    memcpy(buf->data, out + (i + j) * 512, 512);
+            }
+        }
+
+        i += run;
+    }
+
+    return status;
+}
+
+static int bcache_any_pinned(blkq_t *queue, uint32_t lba, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        bcache_buf_t *buf = bcache_find(queue->dev, lba + i);
+        if (buf && buf->pinned)
+            return 1;
+    }
+
+    return 0;
+}
+
+// pinned blocks are pinned as they go in, so filling the cache can't push an earlier one of them out
+int bcache_write(blkq_t *queue, uint32_t lba, uint32_t count, const void *buffer, int pin) {
+    const uint8_t *in = (const uint8_t*) buffer;
+
+    // long writes skip the cache like long reads, copies already cached are kept in step
+    if (!pin && count >= BCACHE_BYPASS && !bcache_any_pinned(queue, lba, count)) {
+        if (!blkq_write(queue, lba, count, (void*) in))
+            return 0;
+
+        for (uint32_t i = 0; i < count; i++) {
+            bcache_buf_t *buf = bcache_find(queue->dev, lba + i);
+            if (!buf)
+                continue;
+
+            memcpy(buf->data, in + i * 512, 512);
+            if (buf->dirty) {
+                buf->dirty = 0;
+                bcache_dirty--;
+            }
+        }
+
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        bcache_buf_t *buf = bcache_find(queue->dev, lba + i);
+        if (buf)
+            bcache_touch(buf);
+        else
+            buf = bcache_insert(queue, lba + i);
+
+        if (!buf) {
+            // out of memory, write this one through, unless it's held back for its owner
+            if (pin || !blkq_write(queue, lba + i, 1, (void*) (in + i * 512)))
+                return 0;
+            continue;
+        }
+
+        memcpy(buf->data, in + i * 512, 512);
+        if (!buf->dirty) {
+            buf->dirty = 1;
+            bcache_dirty++;
+        }
+        if (pin && !buf->pinned) {
+            buf->pinned = 1;
+            bcache_pinned++;
+        }
+    }
+
+    return 1;
+}
+
+int bcache_sync(blkq_t *queue) {
+    return bcache_writeback(queue);
+}
+
+void bcache_invalidate(blkdev_t *dev) {
+    bcache_buf_t *buf = bcache_lru_head;
+    while (buf) {
+        bcache_buf_t *next = buf->lru_next;
+        if (buf->dev == dev)
+            bcache_remove(buf);
+        buf = next;
+    }
+}
+
+void bcache_unpin_all(blkdev_t *dev) {
+    for (bcache_buf_t *buf = bcache_lru_head; buf; buf = buf->lru_next) {
+        if (buf->dev == dev && buf->pinned) {
+            buf->pinned = 0;
+            bcache_pinned--;
+        }
+    }
+}
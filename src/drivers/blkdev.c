@@ -0,0 +1,123 @@
+#include "blkdev.h"
+#include "ata.h"
+#include "cpu.h"
+#include "string.h"
+
+uint32_t blkdev_timeouts = 0;
+
+static void blkdev_histogram(uint32_t *hist, uint64_t start) {
+    uint64_t elapsed = cpu_micros() - start;
+
+    int bucket = 0;
+    while (elapsed && bucket < BLKDEV_HIST_BUCKETS - 1) {
+        elapsed >>= 1;
+        bucket++;
+    }
+
+    hist[bucket]++;
+}
+
+static void blkdev_account(blkdev_t *dev, int write, uint32_t count, uint64_t start, uint32_t timeouts, int status) {
+    blkdev_stats_t *stats = &dev->stats;
+
+    if (write) {
+        stats->writes++;
+        stats->write_sectors += count;
+        blkdev_histogram(stats->write_hist, start);
+    } else {
+        stats->reads++;
+        stats->read_sectors += count;
+        blkdev_histogram(stats->read_hist, start);
+    }
+
+    stats->timeouts += blkdev_timeouts - timeouts;
+    if (!status)
+        stats->errors++;
+}
+
+void blkdev_from_identify(blkdev_t *dev, uint16_t *identify) {
+    dev->block_size = 512;
+    dev->blocks = (uint32_t) identify[60] | ((uint32_t) identify[61] << 16);
+
+    ata_get_string(identify, 10, 19, dev->serial, sizeof(dev->serial));
+    ata_get_string(identify, 23, 26, dev->rev, sizeof(dev->rev));
+    ata_get_string(identify, 27, 46, dev->model, sizeof(dev->model));
+}
+
+// written so that lba + count can't wrap past the top of a uint32_t
+static int blkdev_in_range(blkdev_t *dev, uint32_t lba, uint32_t count) {
+    return count <= dev->blocks && lba <= dev->blocks - count;
+}
+
+int blkdev_read(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer) {
+    if (!blkdev_in_range(dev, lba, count))
+        return 0;
+
+    uint64_t start = cpu_micros();
+    uint32_t timeouts = blkdev_timeouts;
+
+    int status = dev->read(dev, lba, count, buffer);
+    blkdev_account(dev, 0, count, start, timeouts, status);
+    return status;
+}
+
+int blkdev_write(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer) {
+    if (!blkdev_in_range(dev, lba, count))
+        return 0;
+
+    uint64_t start = cpu_micros();
+    uint32_t timeouts = blkdev_timeouts;
+
+    int status = dev->write(dev, lba, count, buffer);
+    blkdev_account(dev, 1, count, start, timeouts, status);
+    return status;
+}
+
+int blkdev_flush(blkdev_t *dev) {
+    if (!dev->flush)
+        return 1;
+
+    uint64_t start = cpu_micros();
+    uint32_t timeouts = blkdev_timeouts;
+
+    int status = dev->flush(dev);
+
+    dev->stats.flushes++;
+    dev->stats.timeouts += blkdev_timeouts - timeouts;
+    if (!status)
+        dev->stats.errors++;
+    blkdev_histogram(dev->stats.flush_hist, start);
+    return status;
+}
+
+int blkdev_issue(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer, int write) {
+    if (!blkdev_in_range(dev, lba, count))
+        return -1;
+
+    uint64_t start = cpu_micros();
+    int tag = dev->issue(dev, lba, count, buffer, write);
+    if (tag >= 0 && tag < BLKDEV_MAX_TAGS) {
+        dev->tags[tag].start = start;
+        dev->tags[tag].count = count;
+        dev->tags[tag].write = write;
+    }
+
+    return tag;
+}
+
+int blkdev_wait(blkdev_t *dev, int tag) {
+    uint32_t timeouts = blkdev_timeouts;
+    int status = dev->wait(dev, tag);
+
+    // latency runs from issue to reaping, time spent queued behind other tags included
+    if (tag >= 0 && tag < BLKDEV_MAX_TAGS) {
+        blkdev_tag_t *t = &dev->tags[tag];
+        blkdev_account(dev, t->write, t->count, t->start, timeouts, status);
+    }
+
+    return status;
+}
+
+void blkdev_stats_reset(blkdev_t *dev) {
+    memset(&dev->stats, 0, sizeof(blkdev_stats_t));
+}
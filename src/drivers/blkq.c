@@ -0,0 +1,298 @@
+#include "blkq.h"
+#include "heap.h"
+#include "string.h"
+
+typedef struct {
+    blkq_request_t *first;
+    uint32_t total;
+    uint8_t *buffer;
+    int tag;
+} blkq_run_t;
+
+static void blkq_complete(blkq_request_t *request, int status) {
+    if (request->callback)
+        request->callback(request, status);
+    heap_free(request);
+}
+
+void blkq_init(blkq_t *queue, blkdev_t *dev) {
+    blkq_request_t *r = queue->pending;
+    while (r) {
+        blkq_request_t *next = r->next;
+        blkq_complete(r, 0);
+        r = next;
+    }
+
+    queue->dev = dev;
+    queue->head = 0;
+    queue->sectors = 0;
+    queue->pending = NULL;
+}
+
+static int blkq_overlaps(blkq_request_t *a, uint32_t lba, uint32_t count) {
+    return a->lba < lba + count && lba < a->lba + a->count;
+}
+
+static int blkq_covers(blkq_request_t *a, uint32_t lba, uint32_t count) {
+    return a->lba <= lba && lba + count <= a->lba + a->count;
+}
+
+static void blkq_prepare(blkq_run_t *run) {
+    blkq_request_t *first = run->first;
+    run->buffer = first->buffer;
+
+    if (first->next) {
+        run->buffer = heap_alloc(run->total * 512);
+
+        if (first->write) {
+            uint8_t *at = run->buffer;
+            for (blkq_request_t *r = first; r; r = r->next) {
+                memcpy(at, r->buffer, r->count * 512);
+                at += r->count * 512;
+            }
+        }
+    }
+}
+
+static void blkq_finish(blkq_run_t *run, int status) {
+    int merged = run->first->next != NULL;
+
+    uint8_t *at = run->buffer;
+    blkq_request_t *r = run->first;
+    while (r) {
+        blkq_request_t *next = r->next;
+
+        if (merged && !r->write)
+            memcpy(r->buffer, at, r->count * 512);
+        at += r->count * 512;
+
+        blkq_complete(r, status);
+        r = next;
+    }
+
+    if (merged)
+        heap_free(run->buffer);
+}
+
+static void blkq_next(blkq_t *queue, blkq_run_t *run) {
+    // c-look: take the first request at or past the head, wrapping back to the lowest lba
+    blkq_request_t *prev = NULL;
+    blkq_request_t *first = queue->pending;
+    while (first && first->lba < queue->head) {
+        prev = first;
+        first = first->next;
+    }
+
+    if (!first) {
+        prev = NULL;
+        first = queue->pending;
+    }
+
+    // stretch it over adjacent requests going the same direction
+    blkq_request_t *last = first;
+    uint32_t total = first->count;
+    while (last->next && last->next->write == first->write &&
+        last->next->lba == last->lba + last->count &&
+        total + last->next->count <= queue->dev->max_blocks) {
+        last = last->next;
+        total += last->count;
+    }
+
+    if (prev)
+        prev->next = last->next;
+    else
+        queue->pending = last->next;
+    last->next = NULL;
+    queue->sectors -= total;
+    queue->head = first->lba + total;
+
+    run->first = first;
+    run->total = total;
+    run->tag = -1;
+}
+
+static int blkq_transfer(blkq_t *queue, blkq_run_t *run) {
+    blkq_request_t *first = run->first;
+    if (first->write)
+        return blkdev_write(queue->dev, first->lba, run->total, run->buffer);
+    return blkdev_read(queue->dev, first->lba, run->total, run->buffer);
+}
+
+static int blkq_reap(blkq_t *queue, blkq_run_t *runs, int count) {
+    int status = 1;
+
+    for (int i = 0; i < count; i++) {
+        int result = blkdev_wait(queue->dev, runs[i].tag);
+        blkq_finish(&runs[i], result);
+
+        if (!result)
+            status = 0;
+    }
+
+    return status;
+}
+
+int blkq_run(blkq_t *queue) {
+    int status = 1;
+
+    if (!queue->dev->issue) {
+        while (queue->pending) {
+            blkq_run_t run;
+            blkq_next(queue, &run);
+            blkq_prepare(&run);
+
+            int result = blkq_transfer(queue, &run);
+            blkq_finish(&run, result);
+
+            if (!result)
+                status = 0;
+        }
+
+        return status;
+    }
+
+    // keep the device's queue full, it reorders the runs further on its own
+    blkq_run_t runs[BLKQ_MAX_INFLIGHT];
+    int inflight = 0;
+
+    while (queue->pending) {
+        blkq_run_t *run = &runs[inflight];
+        blkq_next(queue, run);
+        blkq_prepare(run);
+
+        blkq_request_t *first = run->first;
+        run->tag = blkdev_issue(queue->dev, first->lba, run->total, run->buffer, first->write);
+
+        if (run->tag < 0 && inflight > 0) {
+            if (!blkq_reap(queue, runs, inflight))
+                status = 0;
+
+            runs[0] = *run;
+            run = &runs[0];
+            inflight = 0;
+
+            run->tag = blkdev_issue(queue->dev, first->lba, run->total, run->buffer, first->write);
+        }
+
+        if (run->tag < 0) {
+            int result = blkq_transfer(queue, run);
+            blkq_finish(run, result);
+
+            if (!result)
+                status = 0;
+            continue;
+        }
+
+        if (++inflight == BLKQ_MAX_INFLIGHT) {
+            if (!blkq_reap(queue, runs, inflight))
+                status = 0;
+            inflight = 0;
+        }
+    }
+
+    if (!blkq_reap(queue, runs, inflight))
+        status = 0;
+
+    return status;
+}
+
+int blkq_submit(blkq_t *queue, uint32_t lba, uint32_t count, void *buffer, int write, blkq_callback_t callback, void *data) {
+    blkq_request_t *request = heap_alloc(sizeof(blkq_request_t));
+    request->lba = lba;
+    request->count = count;
+    request->buffer = (uint8_t*) buffer;
+    request->write = write;
+    request->callback = callback;
+    request->data = data;
+    request->next = NULL;
+
+    // pending writes never overlap each other or a pending read, resolve any conflict up front
+    blkq_request_t *prev = NULL;
+    blkq_request_t *current = queue->pending;
+    while (current) {
+        blkq_request_t *next = current->next;
+
+        if (blkq_overlaps(current, lba, count) && (current->write || write)) {
+            if (current->write && blkq_covers(current, lba, count)) {
+                uint8_t *at = current->buffer + (lba - current->lba) * 512;
+                if (write)
+                    memcpy(at, buffer, count * 512);
+                else
+                    memcpy(buffer, at, count * 512);
+
+                blkq_complete(request, 1);
+                return 1;
+            }
+
+            if (write && current->write && blkq_covers(request, current->lba, current->count)) {
+                if (prev)
+                    prev->next = next;
+                else
+                    queue->pending = next;
+
+                queue->sectors -= current->count;
+                blkq_complete(current, 1); // superseded by the newer write
+
+                current = next;
+                continue;
+            }
+
+            blkq_run(queue);
+            break;
+        }
+
+        prev = current;
+        current = next;
+    }
+
+    prev = NULL;
+    current = queue->pending;
+    while (current && current->lba <= lba) {
+        prev = current;
+        current = current->next;
+    }
+
+    request->next = current;
+    if (prev)
+        prev->next = request;
+    else
+        queue->pending = request;
+    queue->sectors += count;
+
+    if (queue->sectors >= BLKQ_MAX_SECTORS)
+        return blkq_run(queue);
+
+    return 1;
+}
+
+int blkq_pending(blkq_t *queue) {
+    return queue->pending != NULL;
+}
+
+int blkq_read(blkq_t *queue, uint32_t lba, uint32_t count, void *buffer) {
+    for (blkq_request_t *r = queue->pending; r; r = r->next) {
+        if (!r->write || !blkq_overlaps(r, lba, count))
+            continue;
+
+        if (blkq_covers(r, lba, count)) {
+            memcpy(buffer, r->buffer + (lba - r->lba) * 512, count * 512);
+            return 1;
+        }
+
+        blkq_run(queue);
+        break;
+    }
+
+    return blkdev_read(queue->dev, lba, count, buffer);
+}
+
+int blkq_write(blkq_t *queue, uint32_t lba, uint32_t count, void *buffer) {
+    for (blkq_request_t *r = queue->pending; r; r = r->next) {
+        if (blkq_overlaps(r, lba, count)) {
+            blkq_run(queue);
+            break;
+        }
+    }
+
+    return blkdev_write(queue->dev, lba, count, buffer);
+}
@@ -0,0 +1,134 @@
+#include "ide.h"
+#include "ata.h"
+#include "io.h"
+#include "pit.h"
+#include "heap.h"
+#include "string.h"
+
+pci_device_t *ide_device = NULL;
+uint16_t ide_bm = 0;
+
+static int ide_dma[2];
+static ide_prd_t ide_prdt[2][IDE_PRD_MAX] __attribute__((aligned(4096)));
+
+static int ide_channel(uint16_t base) {
+    return base == ATA_SECONDARY;
+}
+
+uint16_t ide_bm_port(uint16_t base, uint8_t reg) {
+    return ide_bm + (ide_channel(base) ? 8 : 0) + reg;
+}
+
+int ide_init() {
+    pci_device_t dev;
+    if (!pci_find_class(&dev, 0x01, 0x01))
+        return 0;
+
+    // programming interface bit 7 advertises bus mastering
+    if (!(dev.interface & (1 << 7)))
+        return 0;
+
+    ide_device = heap_alloc(sizeof(pci_device_t));
+    memcpy(ide_device, &dev, sizeof(pci_device_t));
+
+    uint32_t io = pci_device_read(ide_device, ide_device->func, PCI_REG_IO);
+    io |= PCI_CMD_IO;
+    io |= PCI_CMD_MASTER;
+    pci_device_write(ide_device, io, ide_device->func, PCI_REG_IO);
+
+    ide_bm = pci_device_read(ide_device, ide_device->func, PCI_REG_BAR(4)) & 0xFFFC;
+    return ide_bm != 0;
+}
+
+int ide_dma_enable(uint16_t base, void *identify) {
+    uint16_t *w = (uint16_t*) identify;
+
+    ide_dma[ide_channel(base)] = 0;
+    if (!ide_bm || !(w[49] & (1 << 8)))
+        return 0;
+
+    ide_dma[ide_channel(base)] = 1;
+    return 1;
+}
+
+void ide_dma_disable(uint16_t base) {
+    ide_dma[ide_channel(base)] = 0;
+}
+
+int ide_dma_enabled(uint16_t base) {
+    return ide_bm && ide_dma[ide_channel(base)];
+}
+
+static int ide_build_prdt(ide_prd_t *prdt, uint8_t *buffer, uint32_t size) {
+    int n = 0;
+
+    // the memory is identity mapped, so the caller's buffer is used as-is; regions can't cross 64K
+    while (size > 0) {
+        if (n >= IDE_PRD_MAX)
+            return 0;
+
+        uint32_t addr = (uint32_t) buffer;
+        uint32_t chunk = 0x10000 - (addr & 0xFFFF);
+        if (chunk > size)
+            chunk = size;
+
+        prdt[n].addr = addr;
+        prdt[n].size = (uint16_t) chunk;
+        prdt[n].flags = 0;
+        n++;
+
+        buffer += chunk;
+        size -= chunk;
+    }
+
+    prdt[n - 1].flags = IDE_PRD_EOT;
+    return n;
+}
+
+int ide_dma_transfer(uint16_t base, uint32_t lba, uint32_t count, void *buffer, int write) {
+    if (!ide_dma_enabled(base) || count == 0 || count > ATA_MAX_SECTORS || ((uint32_t) buffer & 1))
+        return 0;
+
+    ide_prd_t *prdt = ide_prdt[ide_channel(base)];
+    if (!ide_build_prdt(prdt, (uint8_t*) buffer, count * 512))
+        return 0;
+
+    if (!ata_wait_ready(base))
+        return 0;
+
+    outb(ide_bm_port(base, IDE_BM_COMMAND), 0);
+    outl(ide_bm_port(base, IDE_BM_PRDT), (uint32_t) prdt);
+    outb(ide_bm_port(base, IDE_BM_COMMAND), write ? 0 : IDE_BM_CMD_READ);
+    outb(ide_bm_port(base, IDE_BM_STATUS), IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+
+    ata_set_lba(base, lba, count);
+    ata_command(base, write ? ATA_WRITE_DMA : ATA_READ_DMA);
+    outb(ide_bm_port(base, IDE_BM_COMMAND), (write ? 0 : IDE_BM_CMD_READ) | IDE_BM_CMD_START);
+
+    if (ata_irq_enabled)
+        ata_wait_irq(base, NULL); // the bus master status latches the interrupt, checked below
+
+    uint32_t start = pit_ticks;
+    uint8_t bm_status;
+    for (;;) {
+        bm_status = inb(ide_bm_port(base, IDE_BM_STATUS));
+        if (bm_status & IDE_BM_STATUS_IRQ || !(bm_status & IDE_BM_STATUS_ACTIVE))
+            break;
+
+        if (pit_ticks - start > 5000) {
+            blkdev_timeouts++;
+            break;
+        }
+    }
+
+    outb(ide_bm_port(base, IDE_BM_COMMAND), 0);
+    outb(ide_bm_port(base, IDE_BM_STATUS), IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+
+    ata_wait_ready(base);
+    uint8_t status = ata_status(base); // also acknowledges the drive interrupt
+
+    if (bm_status & IDE_BM_STATUS_ERR || bm_status & IDE_BM_STATUS_ACTIVE)
+        return 0;
+
+    return !(status & (ATA_STATUS_ERR | ATA_STATUS_DF));
+}
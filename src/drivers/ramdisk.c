@@ -0,0 +1,45 @@
+#include "ramdisk.h"
+#include "heap.h"
+#include "string.h"
+
+static int ramdisk_read(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer) {
+    memcpy(buffer, (uint8_t*) dev->data + lba * 512, count * 512);
+    return 1;
+}
+
+static int ramdisk_write(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer) {
+    memcpy((uint8_t*) dev->data + lba * 512, buffer, count * 512);
+    return 1;
+}
+
+int ramdisk_create(blkdev_t *dev, uint32_t blocks) {
+    memset(dev, 0, sizeof(blkdev_t));
+    if (blocks < RAMDISK_MIN_BLOCKS)
+        return 0;
+
+    dev->data = heap_alloc(blocks * 512);
+    if (!dev->data)
+        return 0;
+    memset(dev->data, 0, blocks * 512);
+
+    dev->type = BLKDEV_RAM;
+    dev->block_size = 512;
+    dev->blocks = blocks;
+    dev->max_blocks = blocks;
+    dev->read = ramdisk_read;
+    dev->write = ramdisk_write;
+
+    strcpy(dev->serial, "RAM0");
+    strcpy(dev->rev, "1.0");
+    strcpy(dev->model, "RAMDISK");
+    return 1;
+}
+
+void ramdisk_destroy(blkdev_t *dev) {
+    if (dev->type != BLKDEV_RAM || !dev->data)
+        return;
+
+    heap_free(dev->data);
+    dev->data = NULL;
+    dev->blocks = 0;
+}
@@ -0,0 +1,305 @@
+#include "virtio.h"
+#include "io.h"
+#include "pit.h"
+#include "heap.h"
+#include "string.h"
+#include "kernel.h"
+
+pci_device_t *virtio_device = NULL;
+uint16_t virtio_io = 0;
+uint64_t virtio_blk_sectors = 0;
+
+static uint32_t virtio_features = 0;
+static uint16_t virtq_size = 0;
+static uint16_t virtq_last_used = 0;
+static uint32_t virtio_depth = 0;
+static uint32_t virtio_busy = 0;
+static volatile uint32_t virtio_done = 0;
+
+static volatile virtq_desc_t *virtq_desc;
+static volatile virtq_avail_t *virtq_avail;
+static volatile virtq_used_t *virtq_used;
+
+static virtio_blk_header_t virtio_headers[VIRTIO_BLK_MAX_INFLIGHT];
+static volatile uint8_t virtio_status[VIRTIO_BLK_MAX_INFLIGHT];
+
+static uint32_t virtq_align(uint32_t size) {
+    return (size + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1);
+}
+
+static void virtio_barrier() {
+    __asm__ volatile("" ::: "memory"); // x86 keeps stores ordered, just stop the compiler
+}
+
+static int virtio_queue_init() {
+    outw(virtio_io + VIRTIO_REG_QUEUE_SELECT, 0);
+    virtq_size = inw(virtio_io + VIRTIO_REG_QUEUE_SIZE);
+    if (virtq_size == 0)
+        return 0;
+
+    // legacy layout: descriptors and the avail ring, then the used ring on the next page
+    uint32_t avail_end = virtq_align(sizeof(virtq_desc_t) * virtq_size + 6 + 2 * virtq_size);
+    uint32_t size = avail_end + virtq_align(6 + sizeof(virtq_used_elem_t) * virtq_size);
+
+    uint32_t ring = (uint32_t) heap_alloc(size + VIRTQ_ALIGN);
+    ring = virtq_align(ring);
+    memset((void*) ring, 0, size);
+
+    virtq_desc = (virtq_desc_t*) ring;
+    virtq_avail = (virtq_avail_t*) (ring + sizeof(virtq_desc_t) * virtq_size);
+    virtq_used = (virtq_used_t*) (ring + avail_end);
+    virtq_avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT; // completions are polled
+    virtq_last_used = 0;
+
+    virtio_depth = virtq_size / 3;
+    if (virtio_depth > VIRTIO_BLK_MAX_INFLIGHT)
+        virtio_depth = VIRTIO_BLK_MAX_INFLIGHT;
+
+    // every request owns a fixed chain: header, data, status
+    for (uint32_t tag = 0; tag < virtio_depth; tag++) {
+        volatile virtq_desc_t *d = &virtq_desc[tag * 3];
+
+        d[0].addr = (uint32_t) &virtio_headers[tag];
+        d[0].len = sizeof(virtio_blk_header_t);
+        d[0].flags = VIRTQ_DESC_F_NEXT;
+
+        d[2].addr = (uint32_t) &virtio_status[tag];
+        d[2].len = 1;
+        d[2].flags = VIRTQ_DESC_F_WRITE;
+    }
+
+    outl(virtio_io + VIRTIO_REG_QUEUE_PFN, ring / VIRTQ_ALIGN);
+    return 1;
+}
+
+int virtio_blk_init() {
+    pci_device_t dev;
+    if (!pci_find_id(&dev, VIRTIO_VENDOR, VIRTIO_DEV_BLK))
+        return 0;
+
+    virtio_device = heap_alloc(sizeof(pci_device_t));
+    memcpy(virtio_device, &dev, sizeof(pci_device_t));
+
+    uint32_t io = pci_device_read(virtio_device, virtio_device->func, PCI_REG_IO);
+    io |= PCI_CMD_IO;
+    io |= PCI_CMD_MASTER;
+    pci_device_write(virtio_device, io, virtio_device->func, PCI_REG_IO);
+
+    virtio_io = pci_device_read(virtio_device, virtio_device->func, PCI_REG_BAR(0)) & 0xFFFC;
+    if (!virtio_io)
+        return 0;
+
+    outb(virtio_io + VIRTIO_REG_STATUS, 0); // reset
+    outb(virtio_io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK);
+    outb(virtio_io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    virtio_features = inl(virtio_io + VIRTIO_REG_DEVICE_FEATURES) & (VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH);
+    outl(virtio_io + VIRTIO_REG_GUEST_FEATURES, virtio_features);
+
+    if (!virtio_queue_init()) {
+        outb(virtio_io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        virtio_io = 0;
+        return 0;
+    }
+
+    virtio_blk_sectors = inl(virtio_io + VIRTIO_REG_CONFIG) | ((uint64_t) inl(virtio_io + VIRTIO_REG_CONFIG + 4) << 32);
+
+    outb(virtio_io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    return 1;
+}
+
+int virtio_blk_ready() {
+    return virtio_io != 0 && virtq_size != 0;
+}
+
+static int virtio_issue(uint32_t type, uint32_t lba, void *buffer, uint32_t bytes) {
+    if (!virtio_blk_ready())
+        return -1;
+
+    int tag = -1;
+    for (uint32_t i = 0; i < virtio_depth; i++) {
+        if (!(virtio_busy & (1u << i))) {
+            tag = i;
+            break;
+        }
+    }
+
+    if (tag < 0)
+        return -1;
+
+    virtio_headers[tag].type = type;
+    virtio_headers[tag].reserved = 0;
+    virtio_headers[tag].sector = lba;
+    virtio_status[tag] = 0xFF;
+
+    volatile virtq_desc_t *d = &virtq_desc[tag * 3];
+    if (bytes) {
+        // the caller's buffer goes straight into the chain, no bounce copy
+        d[0].next = tag * 3 + 1;
+        d[1].addr = (uint32_t) buffer;
+        d[1].len = bytes;
+        d[1].flags = VIRTQ_DESC_F_NEXT | (type == VIRTIO_BLK_T_OUT ? 0 : VIRTQ_DESC_F_WRITE);
+        d[1].next = tag * 3 + 2;
+    } else {
+        d[0].next = tag * 3 + 2;
+    }
+
+    virtio_busy |= 1u << tag;
+    virtio_done &= ~(1u << tag);
+
+    virtq_avail->ring[virtq_avail->idx % virtq_size] = tag * 3;
+    virtio_barrier();
+    virtq_avail->idx++;
+    virtio_barrier();
+
+    outw(virtio_io + VIRTIO_REG_QUEUE_NOTIFY, 0);
+    return tag;
+}
+
+static void virtio_reap() {
+    while (virtq_last_used != virtq_used->idx) {
+        virtio_barrier();
+        uint32_t id = virtq_used->ring[virtq_last_used % virtq_size].id;
+        virtio_done |= 1u << (id / 3);
+        virtq_last_used++;
+    }
+}
+
+int virtio_blk_submit(uint32_t lba, uint32_t count, void *buffer, int write) {
+    if (count == 0 || count > VIRTIO_BLK_MAX_SECTORS)
+        return -1;
+
+    if (write && (virtio_features & VIRTIO_BLK_F_RO))
+        return -1;
+
+    return virtio_issue(write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, lba, buffer, count * 512);
+}
+
+int virtio_blk_wait(int tag) {
+    uint32_t bit = 1u << tag;
+    if (tag < 0 || !(virtio_busy & bit))
+        return 0;
+
+    uint32_t start = pit_ticks;
+    for (;;) {
+        virtio_reap();
+        if (virtio_done & bit)
+            break;
+
+        if (pit_ticks - start > VIRTIO_BLK_TIMEOUT) {
+            blkdev_timeouts++;
+            return 0;
+        } // leave the chain claimed, the device may still write into it
+    }
+
+    virtio_busy &= ~bit;
+    virtio_done &= ~bit;
+    return virtio_status[tag] == VIRTIO_BLK_S_OK;
+}
+
+int virtio_blk_drain() {
+    int status = 1;
+
+    for (uint32_t tag = 0; tag < virtio_depth; tag++) {
+        if (virtio_busy & (1u << tag) && !virtio_blk_wait(tag))
+            status = 0;
+    }
+
+    return status;
+}
+
+static int virtio_transfer(uint32_t lba, uint32_t count, uint8_t *buffer, int write) {
+    int status = 1;
+
+    while (count > 0) {
+        uint32_t n = count < VIRTIO_BLK_MAX_SECTORS ? count : VIRTIO_BLK_MAX_SECTORS;
+
+        int tag = virtio_blk_submit(lba, n, buffer, write);
+        if (tag < 0) {
+            if (!virtio_busy)
+                return 0;
+
+            if (!virtio_blk_drain())
+                status = 0;
+            continue;
+        }
+
+        lba += n;
+        buffer += n * 512;
+        count -= n;
+    }
+
+    return virtio_blk_drain() && status;
+}
+
+int virtio_blk_read(uint32_t lba, uint32_t count, void *buffer) {
+    return virtio_transfer(lba, count, (uint8_t*) buffer, 0);
+}
+
+int virtio_blk_write(uint32_t lba, uint32_t count, void *buffer) {
+    return virtio_transfer(lba, count, (uint8_t*) buffer, 1);
+}
+
+int virtio_blk_flush() {
+    if (!(virtio_features & VIRTIO_BLK_F_FLUSH))
+        return 1; // no write cache to flush
+
+    virtio_blk_drain();
+    return virtio_blk_wait(virtio_issue(VIRTIO_BLK_T_FLUSH, 0, NULL, 0));
+}
+
+static int virtio_blk_read_dev(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer) {
+    unused(dev);
+    return virtio_blk_read(lba, count, buffer);
+}
+
+static int virtio_blk_write_dev(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer) {
+    unused(dev);
+    return virtio_blk_write(lba, count, buffer);
+}
+
+static int virtio_blk_flush_dev(blkdev_t *dev) {
+    unused(dev);
+    return virtio_blk_flush();
+}
+
+static int virtio_blk_issue_dev(blkdev_t *dev, uint32_t lba, uint32_t count, void *buffer, int write) {
+    unused(dev);
+    return virtio_blk_submit(lba, count, buffer, write);
+}
+
+static int virtio_blk_wait_dev(blkdev_t *dev, int tag) {
+    unused(dev);
+    return virtio_blk_wait(tag);
+}
+
+int virtio_blkdev(blkdev_t *dev) {
+    memset(dev, 0, sizeof(blkdev_t));
+    dev->type = BLKDEV_VIRTIO;
+    dev->max_blocks = VIRTIO_BLK_MAX_SECTORS;
+    dev->read = virtio_blk_read_dev;
+    dev->write = virtio_blk_write_dev;
+    dev->flush = virtio_blk_flush_dev;
+    dev->issue = virtio_blk_issue_dev;
+    dev->wait = virtio_blk_wait_dev;
+
+    if (!virtio_blk_ready()) {
+        log("[ WARNING ] VIRTIO: No block device.\n");
+        return BLKDEV_ABSENT;
+    }
+
+    dev->block_size = 512; // virtio always counts in 512 byte sectors
+    dev->blocks = virtio_blk_sectors > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) virtio_blk_sectors;
+    strcpy(dev->rev, "1.0");
+    strcpy(dev->model, "VIRTIO BLOCK DEVICE");
+
+    char serial[21] = {0};
+    int tag = virtio_issue(VIRTIO_BLK_T_GET_ID, 0, serial, 20);
+    if (virtio_blk_wait(tag))
+        strcpy(dev->serial, serial);
+
+    char msg[64];
+    strfmt(msg, "[ INFO ] VIRTIO: Drive OK. (sectors: %d)\n", dev->blocks);
+    log(msg);
+    return BLKDEV_OK;
+}
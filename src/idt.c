@@ -10,6 +10,7 @@
 #include "rtc.h"
 #include "sound.h"
 #include "mouse.h"
+#include "ata.h"
 
 static idt_entry_t idt[256];
 static idt_ptr_t idt_ptr;
@@ -153,5 +154,6 @@ void irq_handler(int_frame_t *frame) {
     else if (irq == 1) keyboard_handle();
     else if (irq == 12) mouse_handle();
     else if (irq == 8) rtc_handle();
+    else if (irq == ATA_IRQ_PRIMARY || irq == ATA_IRQ_SECONDARY) ata_handle(irq);
     else if (irq == sound_irq) sound_handle();
 }
@@ -16,6 +16,10 @@
 #include "keyboard.h"
 #include "editor.h"
 #include "ata.h"
+#include "ide.h"
+#include "ahci.h"
+#include "bcache.h"
+#include "virtio.h"
 #include "rtc.h"
 #include "config.h"
 #include "acpi.h"
@@ -27,7 +31,6 @@
 #include "pci.h"
 #include "sound.h"
 #include "command.h"
-#include "fio.h"
 #include "mouse.h"
 #include "desktop.h"
 
@@ -55,9 +58,9 @@ void log(const char *msg) {
     if (file_is_ready() && !boot_logging) {
         setup_log();
 
-        fio_t *syslog = fio_open("/system/system.log", 'a');
-        fio_write(syslog, msg, strlen(msg));
-        fio_close(syslog);
+        uint32_t syslog = file_get_node("/system/system.log");
+        if (syslog)
+            file_append(syslog, msg, strlen(msg));
     }
 }
 
@@ -194,8 +197,33 @@ void main(uint32_t magic, multiboot_info_t *mbi) {
     string_puts(boot_log, buffer);
     log(buffer);
 
+    if (ide_init()) {
+        strfmt(buffer, "[ INFO ] IDE: Bus master at 0x%x4\n", ide_bm);
+        string_puts(boot_log, buffer);
+        log(buffer);
+    }
+
+    if (ahci_init()) {
+        strfmt(buffer, "[ INFO ] AHCI: Controller at 0x%x8\n", ahci_abar);
+        string_puts(boot_log, buffer);
+        log(buffer);
+    }
+
+    if (virtio_blk_init()) {
+        strfmt(buffer, "[ INFO ] VIRTIO: Block device at 0x%x4\n", virtio_io);
+        string_puts(boot_log, buffer);
+        log(buffer);
+    }
+
     file_init_by_slot(1);
 
+    // no drive on the legacy channels, fall back to the first sata port, then virtio
+    int port = ahci_first_port();
+    if (file_drive_status == FILE_DRIVE_ABSENT && port >= 0)
+        file_init_by_slot(FILE_SLOT_AHCI + port);
+    if (file_drive_status == FILE_DRIVE_ABSENT && virtio_blk_ready())
+        file_init_by_slot(FILE_SLOT_VIRTIO);
+
     pit_set_frequency(250);
     strfmt(buffer, "[ INFO ] PIT frequency: %d\n", pit_hz);
     string_puts(boot_log, buffer);
@@ -205,6 +233,10 @@ void main(uint32_t magic, multiboot_info_t *mbi) {
     msg = "[ INFO ] PIT OK\n";
     string_puts(boot_log, msg);
     log(msg);
+    ata_irq_init();
+    msg = "[ INFO ] ATA IRQ OK\n";
+    string_puts(boot_log, msg);
+    log(msg);
     pic_unmask(1);
     msg = "[ INFO ] PS/2 Keyboard OK\n";
     string_puts(boot_log, msg);
@@ -240,13 +272,19 @@ void main(uint32_t magic, multiboot_info_t *mbi) {
     log(msg);
 
     setup_log();
-    fio_t *syslog = fio_open("/system/system.log", 'w');
-    fio_write(syslog, boot_log->value, boot_log->size);
-    fio_close(syslog);
+    uint32_t syslog = file_get_node("/system/system.log");
+    if (syslog)
+        file_write(syslog, boot_log->value, boot_log->size);
     string_free(boot_log);
     boot_logging = 0;
     boot_status = 1;
 
+    char *cache_config = config_get("/system/config/system.cfg", "cache_size");
+    if (cache_config) {
+        bcache_set_budget(intstr(cache_config) * 2);
+        heap_free(cache_config);
+    }
+
     char *scale_config = config_get("/system/config/screen.cfg", "scale");
     if (scale_config) {
         screen_scale = doublestr(scale_config);
@@ -263,6 +301,10 @@ void main(uint32_t magic, multiboot_info_t *mbi) {
     for (;;) {
         if (keyboard_mode == KEYBOARD_MODE_DESKTOP)
             desktop_update();
-        __asm__ volatile("hlt");
+
+        // commands run from the keyboard handler, keep them out while the idle sync runs
+        __asm__ volatile("cli");
+        file_idle();
+        __asm__ volatile("sti\nhlt");
     }
 }
@@ -33,6 +33,8 @@ int config_has(const char *path, const char *name) {
 	if (!file_is_ready() || !file_path_isfile(path)) return 0;
 
 	char *buffer = file_read(file_get_node(path));
+	if (!buffer) return 0;
+
 	list_t *lines = readlines(buffer);
 	for (size_t i = 0; i < lines->size; i++) {
 		string_t *line = (string_t*) list_get(lines, i);
@@ -59,6 +61,8 @@ char *config_get(const char *path, const char *name) {
 	if (!file_is_ready() || !file_path_isfile(path)) return NULL;
 
 	char *buffer = file_read(file_get_node(path));
+	if (!buffer) return NULL;
+
 	list_t *lines = readlines(buffer);
 	for (size_t i = 0; i < lines->size; i++) {
 		string_t *line = (string_t*) list_get(lines, i);
@@ -2,42 +2,627 @@
 #include "string.h"
 #include "heap.h"
 #include "ata.h"
+#include "ahci.h"
+#include "virtio.h"
+#include "ramdisk.h"
+#include "blkq.h"
+#include "bcache.h"
 #include "terminal.h"
 #include "color.h"
 #include "rtc.h"
 #include "kernel.h"
+#include "pit.h"
+
+#include <external/zlib/zlib.h>
 
 int file_drive_status = FILE_DRIVE_UNSET;
+blkdev_t file_device;
+uint32_t file_handles = 0;
+
+static int file_slot = -1;
+static int file_batching = 0;
+static blkq_t file_queue;
+static blkdev_t file_ram;
+
+// the superblock stays resident once loaded, allocation only touches this copy
+static file_superblock_t file_sb;
+static int file_sb_loaded = 0;
+static int file_sb_dirty = 0;
+
+// resident copy of the free-space bitmap, written back with the superblock
+static uint8_t *file_bitmap = NULL;
+static uint8_t *file_bitmap_dirty = NULL; // one flag per bitmap sector
+static uint32_t file_node_hint = 0; // node sector last seen with a free slot
+
+// recent name lookups, misses included, dropped whenever the named child changes
+static file_dentry_t file_dentries[FILE_DENTRY_ENTRIES];
+
+typedef struct file_blocks {
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *blocks;
+} file_blocks_t;
+
+// a freed block that was logged, images of it up to this commit aren't replayed
+typedef struct file_revoke {
+    uint32_t block;
+    uint32_t sequence;
+} file_revoke_t;
+
+// metadata blocks of the open transaction stay pinned in the cache until it commits
+static file_blocks_t file_txn;
+static file_blocks_t file_logged; // blocks with images in the log since the last checkpoint
+static file_blocks_t file_revokes;
+static file_map_t file_frees; // runs freed by the open transaction, still taken until it commits
+static uint32_t file_journal_head = 0; // log sectors in use
+static uint32_t file_journal_sequence = 0; // carried by the next commit
+static int file_txn_open = 0;
+static uint32_t file_txn_opened; // pit tick of the first change since the last commit
+static int file_committing = 0;
+static int file_op_open = 0; // metadata written since the last operation finished
+
+static void file_tree_release(uint32_t top, void (*progress)(uint32_t removed));
+static void file_orphan_finish();
+static void file_dentry_clear();
+static void file_run_release(uint32_t sector, uint32_t count);
+static int file_journal_commit();
+static int file_journal_settle();
+
+static int file_disk_read(uint32_t lba, uint32_t count, void *buffer) {
+    return bcache_read(&file_queue, lba, count, buffer);
+}
+
+static int file_disk_write(uint32_t lba, uint32_t count, void *buffer) {
+    return bcache_write(&file_queue, lba, count, buffer, 0);
+}
+
+static int file_blocks_find(file_blocks_t *list, uint32_t block) {
+    for (uint32_t i = 0; i < list->count; i++) {
+        if (list->blocks[i] == block)
+            return i;
+    }
+
+    return -1;
+}
+
+// 1 when the block was added, 0 when it was there already or memory ran out
+static int file_blocks_add(file_blocks_t *list, uint32_t block) {
+    if (file_blocks_find(list, block) >= 0)
+        return 0;
+
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 16;
+        uint32_t *blocks = heap_realloc(list->blocks, sizeof(uint32_t) * capacity);
+        if (!blocks)
+            return 0;
+
+        list->blocks = blocks;
+        list->capacity = capacity;
+    }
+
+    list->blocks[list->count++] = block;
+    return 1;
+}
+
+static void file_blocks_free(file_blocks_t *list) {
+    heap_free(list->blocks);
+    list->blocks = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+static void file_txn_touch() {
+    if (!file_txn_open)
+        file_txn_opened = pit_ticks;
+    file_txn_open = 1;
+}
+
+void file_batch_begin() {
+    file_batching++;
+}
+
+void file_batch_end() {
+    if (file_batching > 0 && --file_batching == 0)
+        file_sync();
+}
+
+static file_superblock_t *file_sb_get() {
+    if (!file_sb_loaded) {
+        uint8_t buffer[512];
+        file_disk_read(FILE_SECTOR_SUPERBLOCK, 1, buffer);
+        memcpy(&file_sb, buffer, sizeof(file_sb));
+        file_sb_loaded = 1;
+        file_sb_dirty = 0;
+    }
+
+    return &file_sb;
+}
+
+static void file_sb_touch() {
+    file_sb_dirty = 1;
+    file_txn_touch();
+}
+
+static uint32_t file_bitmap_size(uint32_t sectors) {
+    return (sectors + 4095) / 4096;
+}
+
+// room for the superblock and the whole bitmap and refcount table in one commit, twice over
+static uint32_t file_journal_size(uint32_t bitmap_sectors, uint32_t refcount_sectors) {
+    return FILE_JOURNAL_SECTORS + 2 * (bitmap_sectors + refcount_sectors);
+}
+
+static uint32_t file_refcount_size(uint32_t sectors) {
+    return (sectors + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE;
+}
+
+// forgets the open transaction, whatever it pinned goes back to plain dirty blocks
+static void file_journal_drop() {
+    bcache_unpin_all(&file_device);
+    file_blocks_free(&file_txn);
+    file_blocks_free(&file_logged);
+    file_blocks_free(&file_revokes);
+    file_map_free(&file_frees);
+
+    file_journal_head = 0;
+    file_txn_open = 0;
+    file_committing = 0;
+}
+
+static void file_sb_drop() {
+    heap_free(file_bitmap);
+    heap_free(file_bitmap_dirty);
+    file_bitmap = NULL;
+    file_bitmap_dirty = NULL;
+
+    file_sb_loaded = 0;
+    file_sb_dirty = 0;
+    file_node_hint = 0;
+    file_journal_drop();
+}
+
+static uint8_t *file_bitmap_get() {
+    if (file_bitmap)
+        return file_bitmap;
+
+    file_superblock_t *sb = file_sb_get();
+    if (sb->magic != FILE_MAGIC || sb->version != FILE_VERSION)
+        return NULL;
+    if (sb->sectors > file_device.blocks || sb->bitmap_sectors != file_bitmap_size(sb->sectors))
+        return NULL;
+    if (sb->journal != sb->bitmap + sb->bitmap_sectors || sb->journal_sectors != file_journal_size(sb->bitmap_sectors, sb->refcount_sectors))
+        return NULL;
+    if (sb->refcount != sb->journal + sb->journal_sectors || sb->refcount_sectors != file_refcount_size(sb->sectors))
+        return NULL;
+
+    file_bitmap = heap_alloc(sb->bitmap_sectors * 512);
+    file_bitmap_dirty = heap_alloc(sb->bitmap_sectors);
+    memset(file_bitmap_dirty, 0, sb->bitmap_sectors);
+    file_disk_read(sb->bitmap, sb->bitmap_sectors, file_bitmap);
+
+    return file_bitmap;
+}
+
+static int file_bitmap_test(uint32_t sector) {
+    return (file_bitmap[sector / 8] >> (sector % 8)) & 1;
+}
+
+static void file_bitmap_mark(uint32_t sector, uint32_t count, int used) {
+    for (uint32_t i = sector; i < sector + count; i++) {
+        if (used)
+            file_bitmap[i / 8] |= 1 << (i % 8);
+        else
+            file_bitmap[i / 8] &= ~(1 << (i % 8));
+
+        file_bitmap_dirty[i / 4096] = 1;
+    }
+}
+
+// metadata goes through the journal, its blocks join the open transaction and stay in the cache until it commits
+static int file_meta_write(uint32_t lba, uint32_t count, void *buffer) {
+    if (!file_bitmap_get())
+        return file_disk_write(lba, count, buffer);
+
+    int status = bcache_write(&file_queue, lba, count, buffer, 1);
+    if (!status)
+        term_write("Error: No memory to hold metadata for the journal!\n");
+
+    for (uint32_t i = 0; i < count; i++)
+        file_blocks_add(&file_txn, lba + i);
+    file_txn_touch();
+    file_op_open = 1;
+    return status;
+}
+
+// one sector of the refcount table, held while a stretch of blocks is looked at
+typedef struct file_refs {
+    uint32_t sector; // 0 while none is held
+    int dirty;
+    uint8_t counts[FILE_BLOCK_SIZE];
+} file_refs_t;
+
+static void file_refs_done(file_refs_t *refs) {
+    if (refs->sector && refs->dirty)
+        file_meta_write(refs->sector, 1, refs->counts);
+    refs->dirty = 0;
+}
+
+static uint8_t *file_refs_at(file_refs_t *refs, uint32_t block) {
+    uint32_t sector = file_sb.refcount + block / FILE_BLOCK_SIZE;
+    if (refs->sector != sector) {
+        file_refs_done(refs);
+        refs->sector = sector;
+        file_disk_read(sector, 1, refs->counts);
+    }
+
+    return &refs->counts[block % FILE_BLOCK_SIZE];
+}
+
+static void file_sb_save() {
+    if (!file_sb_dirty)
+        return;
+
+    uint8_t buffer[512] = {0};
+    memcpy(buffer, &file_sb, sizeof(file_sb));
+    file_meta_write(FILE_SECTOR_SUPERBLOCK, 1, buffer);
+
+    // write the changed stretches of the bitmap
+    for (uint32_t i = 0; file_bitmap && i < file_sb.bitmap_sectors; i++) {
+        if (!file_bitmap_dirty[i])
+            continue;
+
+        uint32_t count = 0;
+        while (i + count < file_sb.bitmap_sectors && file_bitmap_dirty[i + count])
+            file_bitmap_dirty[i + count++] = 0;
+
+        file_meta_write(file_sb.bitmap + i, count, file_bitmap + i * 512);
+        i += count;
+    }
+
+    file_sb_dirty = 0;
+}
 
 void file_read_sb(file_superblock_t *sb) {
-    uint8_t buffer[512];
-    ata_read_sector(file_port, FILE_SECTOR_SUPERBLOCK, buffer);
-    memcpy(sb, buffer, sizeof(*sb));
+    *sb = *file_sb_get();
 }
 
 void file_write_sb(file_superblock_t *sb) {
+    file_sb = *sb;
+    file_sb_loaded = 1;
+    file_sb_touch();
+}
+
+static uint32_t file_journal_hash(uint32_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static uint32_t file_journal_checksum(file_journal_desc_t *desc) {
+    uint32_t hash = file_journal_hash(2166136261u, desc, offsetof(file_journal_desc_t, checksum));
+    hash = file_journal_hash(hash, desc->entries, sizeof(uint32_t) * (desc->count + desc->revokes));
+    return file_journal_hash(hash, desc + 1, (size_t) desc->count * FILE_BLOCK_SIZE);
+}
+
+// log sectors the next commit may take, with every logged block revoked in it
+// short of a group it can still take one more operation, plus the superblock and every table sector
+static uint32_t file_journal_reserve() {
+    uint32_t images = FILE_JOURNAL_GROUP + FILE_JOURNAL_TXN + 1 + file_sb.bitmap_sectors + file_sb.refcount_sectors;
+    return images + (images + file_logged.count + FILE_JOURNAL_ENTRIES - 1) / FILE_JOURNAL_ENTRIES;
+}
+
+static int file_journal_header_write(uint32_t sequence) {
     uint8_t buffer[512] = {0};
-    memcpy(buffer, sb, sizeof(*sb));
-    ata_write_sector(file_port, FILE_SECTOR_SUPERBLOCK, buffer);
+    file_journal_header_t header = {FILE_JOURNAL_MAGIC, sequence};
+    memcpy(buffer, &header, sizeof(header));
+
+    return blkq_write(&file_queue, file_sb.journal, 1, buffer) && blkdev_flush(&file_device);
+}
+
+// the runs freed since the last commit become free in the bitmap this commit writes
+static void file_frees_apply() {
+    for (uint32_t i = 0; i < file_frees.count; i++) {
+        uint32_t start = file_frees.extents[i].start;
+        uint32_t count = file_frees.extents[i].count;
+        file_run_release(start, count);
+
+        // a freed block needn't be logged, and older images of it mustn't land on whatever reuses it
+        for (uint32_t j = 0; j < file_txn.count;) {
+            if (file_txn.blocks[j] - start < count)
+                file_txn.blocks[j] = file_txn.blocks[--file_txn.count]; // stays pinned until the commit is down
+            else
+                j++;
+        }
+
+        for (uint32_t j = 0; j < file_logged.count; j++) {
+            if (file_logged.blocks[j] - start < count)
+                file_blocks_add(&file_revokes, file_logged.blocks[j]);
+        }
+    }
+
+    file_map_free(&file_frees);
+}
+
+// writes every logged block home, the log starts over empty
+static int file_journal_checkpoint() {
+    int status = bcache_sync(&file_queue);
+    status = blkdev_flush(&file_device) && status;
+    if (!status || file_journal_head == 0)
+        return status;
+
+    if (!file_journal_header_write(file_journal_sequence))
+        return 0;
+
+    file_journal_head = 0;
+    file_logged.count = 0;
+    return 1;
+}
+
+// logs the open transaction as one commit: its data first, then descriptors and images, then a flush
+static int file_journal_commit() {
+    if (!file_bitmap_get() || !file_txn_open || file_committing)
+        return 1;
+
+    file_committing = 1;
+    file_frees_apply();
+    file_sb_save();
+
+    // blocks outside the transaction, data among them, reach the disk before a commit that points at them
+    int status = 1;
+    if (bcache_dirty > bcache_pinned) {
+        status = bcache_sync(&file_queue);
+        status = blkdev_flush(&file_device) && status;
+    }
+
+    uint32_t entries = file_txn.count + file_revokes.count;
+    uint32_t need = file_txn.count + (entries + FILE_JOURNAL_ENTRIES - 1) / FILE_JOURNAL_ENTRIES;
+
+    // the reserve kept after every commit should rule this out, an operation went past FILE_JOURNAL_TXN
+    if (status && file_journal_head + need > file_sb.journal_sectors - 1) {
+        char msg[96];
+        strfmt(msg, "Warning: A commit of %d blocks outgrew the journal reserve!\n", file_txn.count);
+        term_write(msg);
+
+        // the log starts over, the commit still goes in ahead of its blocks. those held pinned have
+        // their last committed images in the log, those go home first or the checkpoint drops them
+        status = file_journal_settle() && file_journal_checkpoint();
+        if (status && need > file_sb.journal_sectors - 1)
+            status = 0;
+    }
+    uint32_t at = file_sb.journal + 1 + file_journal_head;
+
+    // one descriptor per stretch of entries, each followed by its images
+    for (uint32_t done = 0; status && done < entries;) {
+        uint32_t take = entries - done < FILE_JOURNAL_ENTRIES ? entries - done : FILE_JOURNAL_ENTRIES;
+        uint32_t images = done < file_txn.count ? file_txn.count - done : 0;
+        if (images > take)
+            images = take;
+
+        file_journal_desc_t *desc = heap_alloc((size_t)(1 + images) * FILE_BLOCK_SIZE);
+        if (!desc) {
+            status = 0;
+            break;
+        }
+
+        memset(desc, 0, sizeof(file_journal_desc_t));
+        desc->magic = FILE_JOURNAL_MAGIC;
+        desc->sequence = file_journal_sequence;
+        desc->count = images;
+        desc->revokes = take - images;
+        desc->last = done + take == entries;
+
+        uint8_t *image = (uint8_t *)(desc + 1);
+        for (uint32_t j = 0; j < take; j++) {
+            if (j < images) {
+                desc->entries[j] = file_txn.blocks[done + j];
+                file_disk_read(desc->entries[j], 1, image + j * FILE_BLOCK_SIZE);
+            } else
+                desc->entries[j] = file_revokes.blocks[done + j - file_txn.count];
+        }
+        desc->checksum = file_journal_checksum(desc);
+
+        status = blkq_write(&file_queue, at, 1 + images, desc);
+        heap_free(desc);
+        at += 1 + images;
+        done += take;
+    }
+    status = blkdev_flush(&file_device) && status;
+
+    if (status) {
+        for (uint32_t i = 0; i < file_txn.count; i++)
+            file_blocks_add(&file_logged, file_txn.blocks[i]);
+        file_journal_head += need;
+        file_journal_sequence++;
+    }
+
+    if (!status)
+        term_write("Warning: Journal commit failed, its blocks go home unlogged!\n");
+
+    // committed, or when the log couldn't be written, left to reach home like any other block
+    bcache_unpin_all(&file_device);
+    file_txn.count = 0;
+    file_revokes.count = 0;
+    file_txn_open = 0;
+    file_committing = 0;
+
+    if (file_journal_head + file_journal_reserve() > file_sb.journal_sectors - 1 || !status)
+        return file_journal_checkpoint() && status;
+    return status;
+}
+
+// reads the log descriptor at the given offset with its images, 0 unless it's whole and belongs to the sequence
+static uint32_t file_journal_read(file_superblock_t *sb, uint32_t at, uint32_t sequence, file_journal_desc_t *desc) {
+    uint32_t log = sb->journal_sectors - 1;
+    if (at >= log || !blkq_read(&file_queue, sb->journal + 1 + at, 1, desc))
+        return 0;
+
+    if (desc->magic != FILE_JOURNAL_MAGIC || desc->sequence != sequence)
+        return 0;
+    if (desc->count + desc->revokes > FILE_JOURNAL_ENTRIES || at + 1 + desc->count > log)
+        return 0;
+    if (desc->count && !blkq_read(&file_queue, sb->journal + 2 + at, desc->count, desc + 1))
+        return 0;
+    if (desc->checksum != file_journal_checksum(desc))
+        return 0;
+
+    return 1 + desc->count;
+}
+
+// writes home, past the cache, the latest logged image of each block the open transaction holds pinned
+static int file_journal_settle() {
+    uint8_t buffer[512];
+    if (!blkq_read(&file_queue, file_sb.journal, 1, buffer))
+        return 0;
+
+    file_journal_header_t header;
+    memcpy(&header, buffer, sizeof(header));
+    if (header.magic != FILE_JOURNAL_MAGIC)
+        return 0;
+
+    file_journal_desc_t *desc = heap_alloc(sizeof(file_journal_desc_t) + FILE_JOURNAL_ENTRIES * FILE_BLOCK_SIZE);
+    if (!desc)
+        return 0;
+
+    // commits are gone through in order, so a later image of a block lands over an earlier one
+    int status = 1;
+    uint32_t sequence = header.sequence;
+    uint32_t taken;
+    for (uint32_t at = 0; status && at < file_journal_head && (taken = file_journal_read(&file_sb, at, sequence, desc)); at += taken) {
+        uint8_t *image = (uint8_t *)(desc + 1);
+        for (uint32_t i = 0; status && i < desc->count; i++) {
+            if (file_blocks_find(&file_txn, desc->entries[i]) >= 0)
+                status = blkq_write(&file_queue, desc->entries[i], 1, image + i * FILE_BLOCK_SIZE);
+        }
+
+        if (desc->last)
+            sequence++;
+    }
+
+    heap_free(desc);
+    return blkdev_flush(&file_device) && status;
+}
+
+// writes home the images of every whole commit in the log, minus those revoked later on
+static void file_journal_replay() {
+    file_superblock_t sb = *file_sb_get();
+    file_journal_header_t header;
+    uint8_t buffer[512];
+
+    blkq_read(&file_queue, sb.journal, 1, buffer);
+    memcpy(&header, buffer, sizeof(header));
+    if (header.magic != FILE_JOURNAL_MAGIC) {
+        log("[ WARNING ] FILE: Journal header is damaged, not replaying\n");
+        return;
+    }
+
+    file_journal_desc_t *desc = heap_alloc(sizeof(file_journal_desc_t) + FILE_JOURNAL_ENTRIES * FILE_BLOCK_SIZE);
+    file_revoke_t *revokes = NULL;
+    uint32_t revoked = 0;
+    uint32_t capacity = 0;
+    uint32_t commits = 0;
+    uint32_t end = 0;
+    uint32_t sequence = header.sequence;
+
+    // first pass finds where the whole commits end and gathers their revokes
+    uint32_t kept = 0;
+    uint32_t taken;
+    for (uint32_t at = 0; (taken = file_journal_read(&sb, at, sequence, desc)); at += taken) {
+        for (uint32_t i = 0; i < desc->revokes; i++) {
+            if (revoked == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                revokes = heap_realloc(revokes, sizeof(file_revoke_t) * capacity);
+            }
+
+            revokes[revoked].block = desc->entries[desc->count + i];
+            revokes[revoked++].sequence = sequence;
+        }
+
+        if (desc->last) {
+            end = at + taken;
+            kept = revoked;
+            commits++;
+            sequence++;
+        }
+    }
+
+    sequence = header.sequence;
+    for (uint32_t at = 0; at < end && (taken = file_journal_read(&sb, at, sequence, desc)); at += taken) {
+        uint8_t *image = (uint8_t *)(desc + 1);
+        for (uint32_t i = 0; i < desc->count; i++) {
+            uint32_t block = desc->entries[i];
+            int skip = block >= sb.sectors;
+            for (uint32_t r = 0; r < kept && !skip; r++)
+                skip = revokes[r].block == block && revokes[r].sequence >= sequence;
+
+            if (!skip)
+                file_disk_write(block, 1, image + i * FILE_BLOCK_SIZE);
+        }
+
+        if (desc->last)
+            sequence++;
+    }
+
+    heap_free(revokes);
+    heap_free(desc);
+
+    // the replayed superblock and bitmap are read afresh
+    file_sb_drop();
+    file_journal_sequence = sequence;
+    if (commits) {
+        bcache_sync(&file_queue);
+        blkdev_flush(&file_device);
+        file_sb_get();
+        file_journal_header_write(sequence);
+
+        char msg[64];
+        strfmt(msg, "[ INFO ] FILE: Replayed %d journal commits\n", commits);
+        log(msg);
+    }
 }
 
 void file_format() {
     uint8_t buffer[512] = {0};
+    uint32_t bitmap_sectors = file_bitmap_size(file_device.blocks);
+    uint32_t refcount_sectors = file_refcount_size(file_device.blocks);
+    uint32_t journal_sectors = file_journal_size(bitmap_sectors, refcount_sectors);
 
-    file_superblock_t sb;
+    file_superblock_t sb = {0};
     sb.magic = FILE_MAGIC;
     sb.version = FILE_VERSION;
 
-    uint8_t ata_id[512];
-    ata_identify(file_port, ata_id);
-    uint16_t *w = (uint16_t*) ata_id;
-    sb.sectors = (uint32_t) w[60] | ((uint32_t) w[61] << 16);
-    sb.free = FILE_SECTOR_ROOT + 1;
-    sb.free_list = 0;
-    sb.used = 2; // superblock + root
+    sb.sectors = file_device.blocks;
+    sb.bitmap = FILE_SECTOR_BITMAP;
+    sb.bitmap_sectors = bitmap_sectors;
+    sb.journal = FILE_SECTOR_BITMAP + bitmap_sectors;
+    sb.journal_sectors = journal_sectors;
+    sb.refcount = sb.journal + journal_sectors;
+    sb.refcount_sectors = refcount_sectors;
+    sb.shared = 0;
+    sb.orphan = 0;
+    sb.hint = sb.refcount + refcount_sectors;
+    sb.used = 2 + bitmap_sectors + journal_sectors + refcount_sectors; // superblock + root + bitmap + journal + refcounts
+
+    file_sb_drop();
+    file_dentry_clear();
+    file_bitmap = heap_alloc(bitmap_sectors * 512);
+    file_bitmap_dirty = heap_alloc(bitmap_sectors);
+    memset(file_bitmap, 0, bitmap_sectors * 512);
+    file_bitmap_mark(0, sb.hint, 1); // everything before the first data sector is reserved
+    file_write_sb(&sb);
+
+    // a fresh header over an empty log, cached leftovers of the region go out before it
+    bcache_sync(&file_queue);
+    file_journal_sequence = 1;
+    blkq_write(&file_queue, sb.journal + 1, 1, buffer);
+    file_journal_header_write(file_journal_sequence);
 
-    memcpy(buffer, &sb, sizeof(sb));
-    ata_write_sector(file_port, FILE_SECTOR_SUPERBLOCK, buffer);
+    // every block starts with a single owner
+    for (uint32_t i = 0; i < refcount_sectors; i++)
+        file_disk_write(sb.refcount + i, 1, buffer);
 
     file_node_t root = {0};
     root.time_created = datetime_packed();
@@ -46,18 +631,68 @@ void file_format() {
     root.flags = FILE_FOLDER;
     root.child_head = 0;
     root.child_next = 0;
+    root.child_tail = 0;
+    root.children = 0;
     root.size = 0;
-    root.first_block = 0;
+    root.extent_count = 0;
+    root.indirect = 0;
     strcpy(root.name, "root");
-    memcpy(buffer, &root, sizeof(root));
-    ata_write_sector(file_port, FILE_SECTOR_ROOT, buffer);
+    memcpy(buffer, &root, sizeof(root)); // the root takes the first slot of its sector
+    file_meta_write(FILE_SECTOR_ROOT, 1, buffer);
+
+    file_sync();
+}
+
+// commits what's pending and checkpoints, everything is on the disk in its place afterwards
+int file_sync() {
+    if (file_drive_status != FILE_DRIVE_OK)
+        return 0;
+
+    // batched operations sync once when the outermost batch ends
+    if (file_batching)
+        return 1;
+    file_op_open = 0;
+
+    if (!file_bitmap_get()) {
+        int status = bcache_sync(&file_queue);
+        return blkdev_flush(&file_device) && status;
+    }
+
+    int status = file_journal_commit();
+    return file_journal_checkpoint() && status;
+}
+
+// an operation is done, it commits along with the ones before it once enough have gathered
+void file_commit() {
+    if (file_drive_status != FILE_DRIVE_OK)
+        return;
+
+    file_op_open = 0;
+    if (file_txn.count >= FILE_JOURNAL_GROUP || bcache_pinned > bcache_budget / 2)
+        file_journal_commit();
+}
+
+// a cache holding nothing but the open transaction gets it committed, only ever between operations
+static int file_cache_pressure(blkdev_t *dev) {
+    if (dev != &file_device || file_committing || file_op_open || !file_txn_open)
+        return 0;
+
+    uint32_t pinned = bcache_pinned;
+    file_journal_commit();
+    return bcache_pinned < pinned;
+}
+
+void file_idle() {
+    if (file_txn_open && file_drive_status == FILE_DRIVE_OK
+        && pit_ticks - file_txn_opened >= (uint32_t)(FILE_COMMIT_SECONDS * pit_hz))
+        file_journal_commit();
 }
 
 int file_is_formatted() {
     file_superblock_t sb;
     file_read_sb(&sb);
 
-    return sb.magic == FILE_MAGIC;
+    return sb.magic == FILE_MAGIC && sb.version == FILE_VERSION;
 }
 
 int file_is_ready() {
@@ -65,191 +700,1558 @@ int file_is_ready() {
 }
 
 int file_drive_slot() {
-    int slot = -1;
+    return file_slot;
+}
+
+int file_init(blkdev_t *dev, int status) {
+    // whatever is still queued belongs to the previous device
+    if (file_drive_status == FILE_DRIVE_OK)
+        file_sync();
+    bcache_invalidate(&file_device);
+    file_sb_drop();
+    file_dentry_clear();
+
+    file_device = *dev;
+    blkq_init(&file_queue, &file_device);
+    bcache_pressure = file_cache_pressure;
+
+    file_current = FILE_NODE_ROOT;
+    file_drive_status = status;
+
+    if (status == FILE_DRIVE_OK) {
+        file_superblock_t sb;
+        file_read_sb(&sb);
+
+        if (sb.magic == FILE_MAGIC && sb.version != FILE_VERSION) {
+            char msg[96];
+            strfmt(msg, "[ WARNING ] FILE: Disk format version %d is not supported (expected %d)\n", sb.version, FILE_VERSION);
+            log(msg);
+        } else if (sb.magic == FILE_MAGIC) {
+            file_journal_replay();
+            file_orphan_finish();
+        }
+    }
+    return 1;
+}
 
-    if (file_port == ATA_PRIMARY) slot = 0;
-    else if (file_port == ATA_SECONDARY) slot = 2;
+int file_ramdisk(uint32_t blocks) {
+    if (file_device.type == BLKDEV_RAM)
+        file_drive_status = FILE_DRIVE_UNSET; // about to be freed, nothing worth syncing
 
-    if (file_drive == ATA_MASTER) slot += 1;
-    else if (file_drive == ATA_SLAVE) slot += 2;
+    ramdisk_destroy(&file_ram);
+    if (!ramdisk_create(&file_ram, blocks))
+        return 0;
 
-    return slot;
+    char msg[64];
+    strfmt(msg, "[ INFO ] RAMDISK: Created (sectors: %d)\n", blocks);
+    log(msg);
+    return 1;
 }
 
-int file_init(uint16_t base, uint8_t drive) {
-    ata_select(base, drive);
-    file_port = base;
-    file_drive = drive;
+int file_init_by_slot(uint8_t slot) {
+    blkdev_t dev;
+    int status;
+    char msg[64];
+
+    if (slot == FILE_SLOT_RAM) {
+        if (file_ram.type != BLKDEV_RAM || !file_ram.data) return 0;
 
-    file_current = FILE_SECTOR_ROOT;
-    file_drive_status = FILE_DRIVE_UNSET;
+        log("[ INFO ] RAMDISK: Mounting\n");
+        dev = file_ram;
+        status = BLKDEV_OK;
+    } else if (slot == FILE_SLOT_VIRTIO) {
+        log("[ INFO ] VIRTIO: Initializing drive\n");
+        status = virtio_blkdev(&dev);
+    } else if (slot >= FILE_SLOT_AHCI) {
+        if (slot - FILE_SLOT_AHCI >= AHCI_MAX_PORTS) return 0;
 
-    char msg[64];
-    uint8_t status = ata_status(file_port);
+        strfmt(msg, "[ INFO ] AHCI: Initializing drive (slot: %d)\n", slot);
+        log(msg);
+        status = ahci_blkdev(&dev, slot - FILE_SLOT_AHCI);
+    } else {
+        if (slot < 1 || slot > ATA_MAX_DEV) return 0;
 
-    if (status == 0x00 || status == 0x7F || status == 0xFF) {
-        file_drive_status = FILE_DRIVE_ABSENT;
-        strfmt(msg, "[ WARNING ] ATA: Could not detect drive. (status: 0x%x2)\n", status);
+        strfmt(msg, "[ INFO ] ATA: Initializing drive (slot: %d)\n", slot);
         log(msg);
+
+        switch (slot) {
+            case 1: status = ata_blkdev(&dev, ATA_PRIMARY, ATA_MASTER); break;
+            case 2: status = ata_blkdev(&dev, ATA_PRIMARY, ATA_SLAVE); break;
+            case 3: status = ata_blkdev(&dev, ATA_SECONDARY, ATA_MASTER); break;
+            default: status = ata_blkdev(&dev, ATA_SECONDARY, ATA_SLAVE); break;
+        }
     }
 
-    if (file_drive_status != FILE_DRIVE_ABSENT) {
-        uint8_t ata_id[512];
+    file_slot = slot;
+    return file_init(&dev, status);
+}
+
+static uint8_t *file_node_slot(uint8_t *buffer, uint32_t number) {
+    return buffer + (number % FILE_NODES_PER_SECTOR) * FILE_NODE_SIZE;
+}
 
-        if (!ata_identify(file_port, ata_id)) {
-            file_drive_status = FILE_DRIVE_INCOMPATIBLE;
-            log("[ WARNING ] ATA: Failed to identify drive.\n");
-        } else {
-            uint16_t *w = (uint16_t*) ata_id;
-            if (w[0] & (1 << 15)) {
-                file_drive_status = FILE_DRIVE_INCOMPATIBLE;
-                log("[ WARNING ] ATA: Drive is not compatible.\n");
-            }
+// slots after an inline node that its bytes run on into, they hold no node of their own
+static uint32_t file_node_spans(uint8_t *slot) {
+    file_node_t *node = (file_node_t *) slot;
+    return (node->flags & FILE_INLINE) ? FILE_INLINE_SPANS(node->size) : 0;
+}
+
+// clears the spans the node's old contents reached and the new ones don't
+static void file_spans_trim(uint8_t *buffer, uint32_t number, file_node_t *node) {
+    uint8_t *slot = file_node_slot(buffer, number);
+    uint32_t had = file_node_spans(slot);
+    uint32_t keep = file_node_spans((uint8_t *) node);
+    if (had > keep)
+        memset(slot + (keep + 1) * FILE_NODE_SIZE, 0, (had - keep) * FILE_NODE_SIZE);
+}
+
+// inline bytes the node can hold, its own slot plus the free slots straight after it
+static uint32_t file_inline_fit(uint8_t *buffer, uint32_t number) {
+    uint32_t first = number % FILE_NODES_PER_SECTOR;
+    uint32_t last = first + file_node_spans(file_node_slot(buffer, number));
+    while (last + 1 < FILE_NODES_PER_SECTOR && !((file_node_t *) (buffer + (last + 1) * FILE_NODE_SIZE))->flags)
+        last++;
+    return FILE_INLINE_SLOT + (last - first) * FILE_NODE_SIZE;
+}
+
+void file_node(uint32_t number, file_node_t *node) {
+    uint8_t buffer[512];
+    file_disk_read(FILE_NODE_SECTOR(number), 1, buffer);
+    memcpy(node, file_node_slot(buffer, number), sizeof(file_node_t));
+}
+
+void file_node_write(uint32_t number, file_node_t *node) {
+    uint8_t buffer[512];
+    file_disk_read(FILE_NODE_SECTOR(number), 1, buffer); // keeps the neighbours and the extents after the header
+    file_spans_trim(buffer, number, node);
+    memcpy(file_node_slot(buffer, number), node, sizeof(file_node_t));
+    file_meta_write(FILE_NODE_SECTOR(number), 1, buffer);
+}
+
+// takes the first free slot of a node sector, a slot without flags that no inline file runs on into is free
+static uint32_t file_node_claim(uint32_t sector, const void *node, size_t size) {
+    uint8_t buffer[512];
+    file_disk_read(sector, 1, buffer);
+
+    for (uint32_t i = 0; i < FILE_NODES_PER_SECTOR; i++) {
+        uint32_t number = sector * FILE_NODES_PER_SECTOR + i;
+        uint8_t *slot = file_node_slot(buffer, number);
+        if (((file_node_t *) slot)->flags) {
+            i += file_node_spans(slot);
+            continue;
         }
+
+        memset(slot, 0, FILE_NODE_SIZE);
+        memcpy(slot, node, size);
+        file_meta_write(sector, 1, buffer);
+        return number;
     }
 
-    if (file_drive_status == FILE_DRIVE_UNSET) {
-        file_drive_status = FILE_DRIVE_OK;
+    return 0;
+}
+
+// places the node beside near when that sector has room, so siblings list from few sectors
+uint32_t file_node_alloc(uint32_t near, file_node_t *node) {
+    uint32_t number = 0;
+    if (near)
+        number = file_node_claim(FILE_NODE_SECTOR(near), node, sizeof(file_node_t));
+    if (!number && file_node_hint)
+        number = file_node_claim(file_node_hint, node, sizeof(file_node_t));
+    if (number)
+        return number;
+
+    uint32_t got;
+    uint32_t sector = file_run_alloc(near ? FILE_NODE_SECTOR(near) + 1 : 0, 1, &got);
+    if (sector == 0)
+        return 0;
 
-        strfmt(msg, "[ INFO ] ATA: Drive OK. (status: 0x%x2)\n", status);
-        log(msg);
+    uint8_t buffer[512] = {0};
+    file_disk_write(sector, 1, buffer);
+    file_node_hint = sector;
+
+    return file_node_claim(sector, node, sizeof(file_node_t));
+}
+
+void file_node_free(uint32_t number) {
+    uint32_t sector = FILE_NODE_SECTOR(number);
+    uint8_t buffer[512];
+    file_disk_read(sector, 1, buffer);
+    uint8_t *slot = file_node_slot(buffer, number);
+    memset(slot, 0, (file_node_spans(slot) + 1) * FILE_NODE_SIZE);
+
+    for (uint32_t i = 0; i < FILE_NODES_PER_SECTOR; i++) {
+        if (((file_node_t *) (buffer + i * FILE_NODE_SIZE))->flags) {
+            file_meta_write(sector, 1, buffer);
+            file_node_hint = sector;
+            return;
+        }
     }
 
-    return 1;
+    // that was the last node in the sector
+    if (file_node_hint == sector)
+        file_node_hint = 0;
+    file_sector_free(sector);
 }
 
-int file_init_by_slot(uint8_t slot) {
-    if (slot < 1 || slot > ATA_MAX_DEV) return 0;
+void file_data(uint32_t sector, file_data_t *data) {
+    uint8_t buffer[512];
+    file_disk_read(sector, 1, buffer);
+    memcpy(data, buffer, sizeof(file_data_t));
+}
 
-    char msg[64];
-    strfmt(msg, "[ INFO ] ATA: Initializing drive (slot: %d)\n", slot);
-    log(msg);
+void file_data_write(uint32_t sector, file_data_t *data) {
+    uint8_t buffer[512];
+    memcpy(buffer, data, sizeof(file_data_t));
+    file_disk_write(sector, 1, buffer);
+}
 
-    switch (slot) {
-        case 1: return file_init(ATA_PRIMARY, ATA_MASTER);
-        case 2: return file_init(ATA_PRIMARY, ATA_SLAVE);
-        case 3: return file_init(ATA_SECONDARY, ATA_MASTER);
-        case 4: return file_init(ATA_SECONDARY, ATA_SLAVE);
-        default: return 0;
-    }
+int file_data_run(uint32_t sector, uint32_t count, file_data_t *data) {
+    return file_disk_read(sector, count, data);
+}
+
+int file_data_run_write(uint32_t sector, uint32_t count, file_data_t *data) {
+    return file_disk_write(sector, count, data);
+}
+
+// an inline file's bytes as a data block, zero past its size
+void file_inline_read(uint32_t number, file_data_t *data) {
+    uint8_t buffer[512];
+    file_disk_read(FILE_NODE_SECTOR(number), 1, buffer);
+
+    uint8_t *slot = file_node_slot(buffer, number);
+    uint32_t size = ((file_node_t *) slot)->size;
+    uint32_t fit = file_inline_fit(buffer, number);
+    if (size > fit)
+        size = fit;
+
+    memcpy(data->data, slot + FILE_NODE_EXTENT_OFFSET, size);
+    memset(data->data + size, 0, FILE_BLOCK_SIZE - size);
+}
+
+// header and data go out together in the one sector, 0 when the free slots after the node can't take the data
+int file_inline_write(uint32_t number, file_node_t *node, const void *data, size_t size) {
+    uint8_t buffer[512];
+    file_disk_read(FILE_NODE_SECTOR(number), 1, buffer);
+    if (size > file_inline_fit(buffer, number))
+        return 0;
+
+    uint8_t *slot = file_node_slot(buffer, number);
+    file_spans_trim(buffer, number, node);
+    memset(slot, 0, (FILE_INLINE_SPANS(size) + 1) * FILE_NODE_SIZE);
+    memcpy(slot, node, sizeof(file_node_t));
+    memcpy(slot + FILE_NODE_EXTENT_OFFSET, data, size);
+    file_meta_write(FILE_NODE_SECTOR(number), 1, buffer);
+    return 1;
+}
+
+uint32_t file_inline_room(uint32_t number) {
+    uint8_t buffer[512];
+    file_disk_read(FILE_NODE_SECTOR(number), 1, buffer);
+    return file_inline_fit(buffer, number);
+}
+
+void file_map_load(uint32_t number, file_node_t *node, file_map_t *map) {
+    map->count = 0;
+    map->blocks = 0;
+    map->capacity = node->extent_count > 4 ? node->extent_count : 4;
+    map->extents = heap_alloc(sizeof(file_extent_t) * map->capacity);
+    map->first = heap_alloc(sizeof(uint32_t) * map->capacity);
+
+    uint8_t buffer[512];
+    file_disk_read(FILE_NODE_SECTOR(number), 1, buffer);
+
+    file_extent_t *extents = (file_extent_t *)(file_node_slot(buffer, number) + FILE_NODE_EXTENT_OFFSET);
+    for (uint32_t i = 0; i < node->extent_count && i < FILE_NODE_EXTENTS; i++)
+        file_map_append(map, extents[i].start, extents[i].count);
+
+    uint32_t indirect = node->indirect;
+    while (indirect && map->count < node->extent_count) {
+        file_indirect_t block;
+        file_disk_read(indirect, 1, &block);
+
+        for (uint32_t i = 0; i < block.count && i < FILE_INDIRECT_EXTENTS; i++)
+            file_map_append(map, block.extents[i].start, block.extents[i].count);
+        indirect = block.next;
+    }
+}
+
+static void file_indirect_free(uint32_t indirect) {
+    while (indirect) {
+        file_indirect_t block;
+        file_disk_read(indirect, 1, &block);
+
+        file_sector_free(indirect);
+        indirect = block.next;
+    }
+}
+
+int file_map_store(uint32_t number, file_node_t *node, file_map_t *map) {
+    file_indirect_free(node->indirect);
+    node->indirect = 0;
+
+    // extents past what the node holds go into a chain of indirect blocks
+    uint32_t spill = map->count > FILE_NODE_EXTENTS ? map->count - FILE_NODE_EXTENTS : 0;
+    uint32_t needed = (spill + FILE_INDIRECT_EXTENTS - 1) / FILE_INDIRECT_EXTENTS;
+    uint32_t *chain = NULL;
+    uint32_t chained = 0;
+
+    if (needed) {
+        chain = heap_alloc(sizeof(uint32_t) * needed);
+        uint32_t near = FILE_NODE_SECTOR(number) + 1;
+
+        while (chained < needed) {
+            uint32_t got;
+            chain[chained] = file_run_alloc(near, 1, &got);
+            if (chain[chained] == 0)
+                break;
+            near = chain[chained++] + 1;
+        }
+    }
+
+    // out of space for the chain, drop the extents it can't describe
+    int status = 1;
+    uint32_t keep = FILE_NODE_EXTENTS + chained * FILE_INDIRECT_EXTENTS;
+    if (map->count > keep) {
+        while (map->count > keep) {
+            file_extent_t *last = &map->extents[--map->count];
+            file_run_free(last->start, last->count);
+            map->blocks -= last->count;
+        }
+
+        if (node->size > map->blocks * FILE_BLOCK_SIZE)
+            node->size = map->blocks * FILE_BLOCK_SIZE;
+        status = 0;
+    }
+
+    for (uint32_t n = 0; n < chained; n++) {
+        file_indirect_t block = {0};
+        uint32_t from = FILE_NODE_EXTENTS + n * FILE_INDIRECT_EXTENTS;
+        block.next = n + 1 < chained ? chain[n + 1] : 0;
+        block.count = map->count - from < FILE_INDIRECT_EXTENTS ? map->count - from : FILE_INDIRECT_EXTENTS;
+        memcpy(block.extents, map->extents + from, sizeof(file_extent_t) * block.count);
+        file_disk_write(chain[n], 1, &block); // a fresh chain, written ahead of the commit like data
+    }
+
+    node->indirect = chained ? chain[0] : 0;
+    node->extent_count = map->count;
+    heap_free(chain);
+
+    uint8_t buffer[512];
+    file_disk_read(FILE_NODE_SECTOR(number), 1, buffer);
+
+    uint8_t *slot = file_node_slot(buffer, number);
+    uint32_t count = map->count < FILE_NODE_EXTENTS ? map->count : FILE_NODE_EXTENTS;
+    file_spans_trim(buffer, number, node);
+    memset(slot, 0, FILE_NODE_SIZE);
+    memcpy(slot, node, sizeof(file_node_t));
+    memcpy(slot + FILE_NODE_EXTENT_OFFSET, map->extents, sizeof(file_extent_t) * count);
+    file_meta_write(FILE_NODE_SECTOR(number), 1, buffer);
+
+    return status;
+}
+
+// hands back every block past the first ones, splitting the extent the cut falls in
+void file_map_truncate(file_map_t *map, uint32_t blocks) {
+    while (map->count && map->blocks > blocks) {
+        file_extent_t *last = &map->extents[map->count - 1];
+        uint32_t cut = map->blocks - blocks;
+
+        if (cut >= last->count) {
+            file_run_free(last->start, last->count);
+            map->blocks -= last->count;
+            map->count--;
+        } else {
+            last->count -= cut;
+            file_run_free(last->start + last->count, cut);
+            map->blocks -= cut;
+        }
+    }
+}
+
+void file_map_free(file_map_t *map) {
+    heap_free(map->extents);
+    heap_free(map->first);
+    map->extents = NULL;
+    map->first = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->blocks = 0;
+}
+
+void file_map_release(file_map_t *map) {
+    for (uint32_t i = 0; i < map->count; i++)
+        file_run_free(map->extents[i].start, map->extents[i].count);
+
+    map->count = 0;
+    map->blocks = 0;
+}
+
+int file_map_append(file_map_t *map, uint32_t start, uint32_t count) {
+    if (count == 0)
+        return 1;
+
+    file_extent_t *last = map->count ? &map->extents[map->count - 1] : NULL;
+    if (last && last->start + last->count == start) {
+        last->count += count;
+        map->blocks += count;
+        return 1;
+    }
+
+    if (map->count == map->capacity) {
+        uint32_t capacity = map->capacity ? map->capacity * 2 : 4;
+        file_extent_t *extents = heap_realloc(map->extents, sizeof(file_extent_t) * capacity);
+        uint32_t *first = heap_realloc(map->first, sizeof(uint32_t) * capacity);
+        if (!extents || !first)
+            return 0;
+
+        map->extents = extents;
+        map->first = first;
+        map->capacity = capacity;
+    }
+
+    map->extents[map->count].start = start;
+    map->extents[map->count].count = count;
+    map->first[map->count] = map->blocks;
+    map->count++;
+    map->blocks += count;
+    return 1;
+}
+
+uint32_t file_map_lookup(file_map_t *map, uint32_t block, uint32_t *run) {
+    if (block >= map->blocks)
+        return 0;
+
+    // the last extent starting at or before the block
+    uint32_t low = 0;
+    uint32_t high = map->count - 1;
+    while (low < high) {
+        uint32_t mid = (low + high + 1) / 2;
+        if (map->first[mid] <= block)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    uint32_t offset = block - map->first[low];
+    if (run)
+        *run = map->extents[low].count - offset;
+    return map->extents[low].start + offset;
+}
+
+// points count blocks of the file from block on at a new run, splitting the extents they were in
+static int file_map_replace(file_map_t *map, uint32_t block, uint32_t start, uint32_t count) {
+    file_map_t out = {0};
+    uint32_t end = block + count;
+    int status = 1;
+
+    for (uint32_t i = 0; i < map->count && status; i++) {
+        uint32_t first = map->first[i];
+        uint32_t length = map->extents[i].count;
+
+        if (first < block)
+            status = file_map_append(&out, map->extents[i].start, (block - first < length) ? block - first : length);
+        if (status && first <= block && block < first + length)
+            status = file_map_append(&out, start, count);
+        if (status && first + length > end) {
+            uint32_t skip = end > first ? end - first : 0;
+            status = file_map_append(&out, map->extents[i].start + skip, length - skip);
+        }
+    }
+
+    if (!status) {
+        file_map_free(&out);
+        return 0;
+    }
+
+    file_map_free(map);
+    *map = out;
+    return 1;
+}
+
+// adds the extents holding count blocks of the file from block on to the end of out
+static int file_map_slice(file_map_t *out, file_map_t *map, uint32_t block, uint32_t count) {
+    uint32_t end = block + count;
+
+    for (uint32_t i = 0; i < map->count; i++) {
+        uint32_t first = map->first[i];
+        uint32_t length = map->extents[i].count;
+        if (first >= end || block >= first + length)
+            continue;
+
+        uint32_t from = block > first ? block - first : 0;
+        uint32_t to = end - first < length ? end - first : length;
+        if (!file_map_append(out, map->extents[i].start + from, to - from))
+            return 0;
+    }
+
+    return 1;
+}
+
+// moves shared blocks in the range to fresh ones of the file's own, ready to be written over whole
+int file_map_unshare(file_map_t *map, uint32_t block, uint32_t count, uint32_t *moved) {
+    if (!file_bitmap_get() || !file_sb.shared)
+        return 1;
+
+    for (uint32_t at = block; at < block + count && at < map->blocks;) {
+        uint32_t run;
+        uint32_t start = file_map_lookup(map, at, &run);
+        if (run > block + count - at)
+            run = block + count - at;
+
+        // the stretch at the start of the run that is either all shared or all the file's own
+        file_refs_t refs = {0};
+        int shared = *file_refs_at(&refs, start) != 0;
+        uint32_t length = 1;
+        while (length < run && (*file_refs_at(&refs, start + length) != 0) == shared)
+            length++;
+
+        if (!shared) {
+            at += length;
+            continue;
+        }
+
+        uint32_t near = at ? file_map_lookup(map, at - 1, NULL) + 1 : start;
+        uint32_t got;
+        uint32_t fresh = file_run_alloc(near, length, &got);
+        if (fresh == 0)
+            return 0;
+        if (!file_map_replace(map, at, fresh, got)) {
+            file_run_free(fresh, got);
+            return 0;
+        }
+
+        file_run_free(start, got); // drops this file as an owner
+        *moved += got;
+        at += got;
+    }
+
+    return 1;
+}
+
+// count blocks from data to disk at start, the part past the end of data goes out zeroed
+static void file_write_run(uint32_t start, uint32_t count, const char *data, size_t size) {
+    size_t bytes = (size_t) count * FILE_BLOCK_SIZE;
+    if (bytes > size)
+        bytes = size;
+
+    uint32_t full = bytes / FILE_BLOCK_SIZE;
+    if (full)
+        file_data_run_write(start, full, (file_data_t *) data);
+    if (full < count) {
+        file_data_t tail = {0};
+        memcpy(tail.data, data + full * FILE_BLOCK_SIZE, bytes - full * FILE_BLOCK_SIZE);
+        file_data_write(start + full, &tail);
+    }
+}
+
+// adds blocks after the last extent to hold data, 0 when the disk fills up first
+static int file_grow(uint32_t number, file_map_t *map, const char *data, size_t size) {
+    uint32_t blocks = map->blocks + (size + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE;
+    uint32_t near = FILE_NODE_SECTOR(number) + 1;
+    if (map->count)
+        near = map->extents[map->count - 1].start + map->extents[map->count - 1].count;
+
+    size_t written = 0;
+    while (map->blocks < blocks) {
+        uint32_t got;
+        uint32_t start = file_run_alloc(near, blocks - map->blocks, &got);
+        if (start == 0 || !file_map_append(map, start, got)) {
+            if (start) file_run_free(start, got);
+            return 0;
+        }
+
+        file_write_run(start, got, data + written, size - written);
+        written += (size - written < (size_t) got * FILE_BLOCK_SIZE) ? size - written : (size_t) got * FILE_BLOCK_SIZE;
+        near = start + got;
+    }
+
+    return 1;
+}
+
+// writes whole blocks of the file from block on, shared ones move to blocks of the file's own first
+static int file_write_blocks(file_map_t *map, uint32_t block, uint32_t count, const char *data, size_t size, uint32_t *moved) {
+    if (!file_map_unshare(map, block, count, moved))
+        return 0;
+
+    while (count) {
+        uint32_t run = 0;
+        uint32_t start = file_map_lookup(map, block, &run);
+        if (start == 0)
+            return 0;
+        if (run > count)
+            run = count;
+
+        file_write_run(start, run, data, size);
+        size_t bytes = (size_t) run * FILE_BLOCK_SIZE;
+        data += bytes < size ? bytes : size;
+        size -= bytes < size ? bytes : size;
+        block += run;
+        count -= run;
+    }
+
+    return 1;
+}
+
+// rewrites the first blocks of the map only where they differ from data
+static int file_write_delta(file_map_t *map, uint32_t blocks, const char *data, size_t size, uint32_t *moved) {
+    file_data_t *old = heap_alloc(sizeof(file_data_t) * FILE_DELTA_RUN);
+    if (!old)
+        return 0;
+
+    file_data_t tail;
+    int status = 1;
+
+    // walked by file block, moving a shared block reshapes the extents
+    for (uint32_t block = 0; block < blocks && status;) {
+        uint32_t run = 0;
+        uint32_t start = file_map_lookup(map, block, &run);
+        if (start == 0) {
+            status = 0;
+            break;
+        }
+
+        uint32_t n = run < FILE_DELTA_RUN ? run : FILE_DELTA_RUN;
+        if (n > blocks - block)
+            n = blocks - block;
+
+        // blocks that can't be read back are taken as changed
+        size_t offset = (size_t) block * FILE_BLOCK_SIZE;
+        int compared = file_data_run(start, n, old);
+
+        // changed blocks go back out in stretches, one transfer each
+        uint32_t changed = 0;
+        for (uint32_t j = 0; j <= n && status; j++) {
+            if (j < n) {
+                size_t at = offset + (size_t) j * FILE_BLOCK_SIZE;
+                const void *want = data + at;
+                if (size - at < FILE_BLOCK_SIZE) {
+                    memset(&tail, 0, sizeof(tail));
+                    memcpy(tail.data, data + at, size - at);
+                    want = tail.data;
+                }
+
+                if (!compared || memcmp(old[j].data, want, FILE_BLOCK_SIZE)) {
+                    changed++;
+                    continue;
+                }
+            }
+
+            if (changed) {
+                size_t from = offset + (size_t)(j - changed) * FILE_BLOCK_SIZE;
+                status = file_write_blocks(map, block + j - changed, changed, data + from, size - from, moved);
+            }
+            changed = 0;
+        }
+
+        block += n;
+    }
+
+    heap_free(old);
+    return status;
+}
+
+// count file blocks from block on into out, a transfer per extent they cross
+static int file_map_read(file_map_t *map, uint32_t block, uint32_t count, file_data_t *out) {
+    while (count) {
+        uint32_t run;
+        uint32_t start = file_map_lookup(map, block, &run);
+        if (start == 0)
+            return 0;
+        if (run > count)
+            run = count;
+
+        if (!file_data_run(start, run, out))
+            return 0;
+        out += run;
+        block += run;
+        count -= run;
+    }
+
+    return 1;
+}
+
+// deflated length of a chunk, 0 when it wouldn't save a block and is better kept as is
+static uint32_t file_deflate(z_stream *z, const char *data, uint32_t size, char *out) {
+    deflateReset(z);
+    z->next_in = (Bytef *) data;
+    z->avail_in = size;
+    z->next_out = (Bytef *) out;
+    z->avail_out = size;
+
+    if (deflate(z, Z_FINISH) != Z_STREAM_END)
+        return 0;
+
+    uint32_t length = size - z->avail_out;
+    if ((length + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE >= (size + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE)
+        return 0;
+    return length;
+}
+
+uint32_t file_chunk_read(file_map_t *map, uint32_t size, uint32_t chunk, char *out) {
+    uint32_t per_block = FILE_BLOCK_SIZE / sizeof(file_chunk_t);
+    file_data_t block;
+    if (!file_map_read(map, chunk / per_block, 1, &block))
+        return 0;
+
+    file_chunk_t entry = ((file_chunk_t *) block.data)[chunk % per_block];
+    uint32_t sector = file_map_lookup(map, entry.block, NULL);
+    uint32_t want = size - chunk * FILE_CHUNK_SIZE;
+    if (want > FILE_CHUNK_SIZE)
+        want = FILE_CHUNK_SIZE;
+
+    if (entry.length & FILE_CHUNK_RAW) {
+        if (!file_map_read(map, entry.block, (want + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE, (file_data_t *) out))
+            return 0;
+        return sector;
+    }
+
+    uint32_t length = entry.length;
+    if (length == 0 || length > FILE_CHUNK_SIZE)
+        return 0;
+
+    char *packed = heap_alloc(FILE_CHUNK_SIZE);
+    z_stream z = {0};
+    int status = file_map_read(map, entry.block, (length + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE, (file_data_t *) packed)
+        && inflateInit2(&z, -FILE_DEFLATE_WINDOW) == Z_OK;
+
+    if (status) {
+        z.next_in = (Bytef *) packed;
+        z.avail_in = length;
+        z.next_out = (Bytef *) out;
+        z.avail_out = want;
+        status = inflate(&z, Z_FINISH) == Z_STREAM_END && z.avail_out == 0;
+        inflateEnd(&z);
+    }
+
+    heap_free(packed);
+    return status ? sector : 0;
+}
+
+// lays size bytes out as chunks in fresh blocks behind their index, taken from data or else from
+// the blocks of plain. packed comes back holding the new blocks, or empty when the disk filled up
+static int file_pack(uint32_t number, file_map_t *packed, const char *data, file_map_t *plain, uint32_t size) {
+    uint32_t chunks = (size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+    uint32_t index_blocks = (chunks * sizeof(file_chunk_t) + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE;
+
+    file_chunk_t *index = heap_alloc(index_blocks * FILE_BLOCK_SIZE);
+    char *source = data ? NULL : heap_alloc(FILE_CHUNK_SIZE);
+    char *out = heap_alloc(FILE_CHUNK_SIZE);
+    memset(index, 0, index_blocks * FILE_BLOCK_SIZE);
+
+    z_stream z = {0};
+    int status = deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -FILE_DEFLATE_WINDOW, FILE_DEFLATE_MEMORY, Z_DEFAULT_STRATEGY) == Z_OK;
+    int deflating = status;
+
+    // the index is claimed first so it opens the file, it's filled in once every chunk has a place
+    if (status)
+        status = file_grow(number, packed, (const char *) index, index_blocks * FILE_BLOCK_SIZE);
+
+    for (uint32_t i = 0; i < chunks && status; i++) {
+        uint32_t want = size - i * FILE_CHUNK_SIZE;
+        if (want > FILE_CHUNK_SIZE)
+            want = FILE_CHUNK_SIZE;
+
+        const char *chunk = source;
+        if (data)
+            chunk = data + (size_t) i * FILE_CHUNK_SIZE;
+        else
+            status = file_map_read(plain, i * FILE_CHUNK_BLOCKS, (want + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE, (file_data_t *) source);
+
+        uint32_t length = status ? file_deflate(&z, chunk, want, out) : 0;
+        index[i].block = packed->blocks;
+        index[i].length = length ? length : (want | FILE_CHUNK_RAW);
+
+        if (status)
+            status = file_grow(number, packed, length ? out : chunk, length ? length : want);
+    }
+
+    uint32_t moved = 0;
+    if (status)
+        status = file_write_blocks(packed, 0, index_blocks, (const char *) index, index_blocks * FILE_BLOCK_SIZE, &moved);
+
+    if (!status) {
+        file_map_release(packed);
+        file_map_free(packed);
+    }
+
+    if (deflating)
+        deflateEnd(&z);
+    heap_free(index);
+    heap_free(out);
+    if (source)
+        heap_free(source);
+    return status;
+}
+
+// the node switches over to the new blocks in one write, the old ones are handed back after
+static int file_swap(uint32_t number, file_node_t *node, file_map_t *old, file_map_t *map) {
+    file_map_release(old);
+    file_map_free(old);
+
+    node->flags &= ~FILE_INLINE;
+    node->time_changed = datetime_packed();
+    int status = file_map_store(number, node, map);
+    file_map_free(map);
+
+    file_commit();
+    return status;
+}
+
+int file_compress(uint32_t sector) {
+    file_node_t file;
+    file_node(sector, &file);
+
+    if (!(file.flags & FILE_DATA))
+        return 0;
+
+    // inline files are already as small as they get
+    if (file.flags & (FILE_INLINE | FILE_COMPRESSED))
+        return 1;
+
+    file_map_t plain;
+    file_map_load(sector, &file, &plain);
+
+    file_map_t packed = {0};
+    if (!file_pack(sector, &packed, NULL, &plain, file.size)) {
+        file_map_free(&plain);
+        return 0;
+    }
+
+    // data that doesn't shrink stays plain
+    if (packed.blocks >= plain.blocks) {
+        file_map_release(&packed);
+        file_map_free(&packed);
+        file_map_free(&plain);
+        return 1;
+    }
+
+    file.flags |= FILE_COMPRESSED;
+    return file_swap(sector, &file, &plain, &packed);
+}
+
+int file_expand(uint32_t sector) {
+    file_node_t file;
+    file_node(sector, &file);
+
+    if (!(file.flags & FILE_COMPRESSED))
+        return 1;
+
+    file_map_t packed;
+    file_map_load(sector, &file, &packed);
+
+    file_map_t plain = {0};
+    char *chunk = heap_alloc(FILE_CHUNK_SIZE);
+    int status = 1;
+
+    for (uint32_t i = 0; i * FILE_CHUNK_SIZE < file.size && status; i++) {
+        uint32_t want = file.size - i * FILE_CHUNK_SIZE;
+        if (want > FILE_CHUNK_SIZE)
+            want = FILE_CHUNK_SIZE;
+
+        status = file_chunk_read(&packed, file.size, i, chunk) && file_grow(sector, &plain, chunk, want);
+    }
+    heap_free(chunk);
+
+    if (!status) {
+        file_map_release(&plain);
+        file_map_free(&plain);
+        file_map_free(&packed);
+        return 0;
+    }
+
+    file.flags &= ~FILE_COMPRESSED;
+    return file_swap(sector, &file, &packed, &plain);
+}
+
+int file_write(uint32_t sector, const char *data, size_t size) {
+    file_node_t file;
+    file_node(sector, &file);
+
+    file_map_t map;
+    file_map_load(sector, &file, &map);
+
+    if (size <= file_inline_room(sector)) {
+        file_map_release(&map);
+        file_map_free(&map);
+        file_indirect_free(file.indirect);
+
+        file.flags |= FILE_INLINE;
+        file.flags &= ~FILE_COMPRESSED;
+        file.extent_count = 0;
+        file.indirect = 0;
+        file.size = size;
+        file.time_changed = datetime_packed();
+        file_inline_write(sector, &file, data, size);
+
+        file_commit();
+        return 1;
+    }
+    file.flags &= ~FILE_INLINE;
+
+    // a compressed file stays compressed, laid out afresh from the new contents, unless they don't shrink
+    if (file.flags & FILE_COMPRESSED) {
+        file_map_t packed = {0};
+        if (!file_pack(sector, &packed, data, NULL, size)) {
+            file_map_free(&map);
+            return 0;
+        }
+
+        if (packed.blocks < (size + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE) {
+            file.size = size;
+            return file_swap(sector, &file, &map, &packed);
+        }
+
+        file_map_release(&packed);
+        file_map_free(&packed);
+        file.flags &= ~FILE_COMPRESSED;
+    }
+
+    // blocks the file keeps stay where they are, only the ones whose contents change get written
+    uint32_t blocks = (size + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE;
+    uint32_t old_count = map.count;
+    uint32_t old_blocks = map.blocks;
+    uint32_t moved = 0;
+
+    file_map_truncate(&map, blocks);
+    int status = file_write_delta(&map, map.blocks, data, size, &moved);
+
+    size_t kept = (size_t) map.blocks * FILE_BLOCK_SIZE;
+    if (status && kept < size && !file_grow(sector, &map, data + kept, size - kept))
+        status = 0;
+
+    file.size = size < (size_t) map.blocks * FILE_BLOCK_SIZE ? size : map.blocks * FILE_BLOCK_SIZE;
+    file.time_changed = datetime_packed();
+    if (map.count != old_count || map.blocks != old_blocks || moved) {
+        if (!file_map_store(sector, &file, &map))
+            status = 0;
+    } else
+        file_node_write(sector, &file);
+    file_map_free(&map);
+
+    file_commit();
+    return status;
+}
+
+// blocks of the chunk index a compressed file of size bytes opens with
+static uint32_t file_chunk_index_blocks(size_t size) {
+    uint32_t chunks = (size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+    return (chunks * sizeof(file_chunk_t) + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE;
+}
+
+// appends to a compressed file by laying out its last chunk again, the chunks before it stay as they are.
+// a chunk still filling up is kept plain, so the next append needn't inflate it
+static int file_append_packed(uint32_t sector, file_node_t *file, const char *data, size_t size) {
+    uint32_t index_blocks = file_chunk_index_blocks(file->size);
+    uint32_t grown_blocks = file_chunk_index_blocks(file->size + size);
+    uint32_t last = file->size / FILE_CHUNK_SIZE; // the chunk the new bytes start in
+    size_t held = file->size % FILE_CHUNK_SIZE;
+    size_t total = file->size + size;
+
+    file_map_t map;
+    file_map_load(sector, file, &map);
+
+    file_chunk_t *index = heap_alloc(grown_blocks * FILE_BLOCK_SIZE);
+    char *chunk = heap_alloc(FILE_CHUNK_SIZE);
+    char *out = heap_alloc(FILE_CHUNK_SIZE);
+    int status = index && chunk && out
+        && file_map_read(&map, 0, index_blocks, (file_data_t *) index)
+        && (!held || file_chunk_read(&map, file->size, last, chunk));
+    if (status)
+        memset((char *) index + index_blocks * FILE_BLOCK_SIZE, 0, (grown_blocks - index_blocks) * FILE_BLOCK_SIZE);
+
+    // the new chunk blocks go after the old ones, which are only cut out once all of them are down
+    uint32_t from = status && held ? index[last].block : map.blocks;
+    uint32_t old_blocks = map.blocks;
+    size_t done = 0;
+    z_stream z = {0};
+    int deflating = 0;
+
+    for (uint32_t i = last; status && (size_t) i * FILE_CHUNK_SIZE < total; i++) {
+        size_t take = FILE_CHUNK_SIZE - held < size - done ? FILE_CHUNK_SIZE - held : size - done;
+        memcpy(chunk + held, data + done, take);
+        held += take;
+        done += take;
+
+        uint32_t length = 0;
+        if (held == FILE_CHUNK_SIZE) {
+            if (!deflating)
+                deflating = deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -FILE_DEFLATE_WINDOW, FILE_DEFLATE_MEMORY, Z_DEFAULT_STRATEGY) == Z_OK;
+            if (deflating)
+                length = file_deflate(&z, chunk, held, out);
+        }
+
+        index[i].block = from + (map.blocks - old_blocks);
+        index[i].length = length ? length : (held | FILE_CHUNK_RAW);
+        status = file_grow(sector, &map, length ? out : chunk, length ? length : held);
+        held = 0;
+    }
+
+    // an index outgrowing its blocks takes new ones at the end too, they are moved up behind it below
+    uint32_t fresh = map.blocks - old_blocks;
+    uint32_t extra = grown_blocks - index_blocks;
+    if (status && extra)
+        status = file_grow(sector, &map, (const char *) index, extra * FILE_BLOCK_SIZE);
+
+    // the index, the chunks before the last one and then the new chunks, the old last chunk goes
+    file_map_t laid = {0};
+    file_map_t gone = {0};
+    status = status
+        && file_map_slice(&laid, &map, 0, index_blocks)
+        && file_map_slice(&laid, &map, old_blocks + fresh, extra)
+        && file_map_slice(&laid, &map, index_blocks, from - index_blocks)
+        && file_map_slice(&laid, &map, old_blocks, fresh)
+        && file_map_slice(&gone, &map, from, old_blocks - from);
+
+    if (status) {
+        for (uint32_t i = 0; (size_t) i * FILE_CHUNK_SIZE < total; i++)
+            index[i].block += extra;
+
+        file_map_release(&gone);
+        file_map_free(&map);
+        map = laid;
+    } else {
+        file_map_free(&laid);
+    }
+    file_map_free(&gone);
+
+    // cut short, the fresh blocks go back and the file is left as it was
+    if (!status) {
+        if (map.blocks > old_blocks)
+            file_map_truncate(&map, old_blocks);
+        file_map_free(&map);
+    } else {
+        uint32_t moved = 0;
+        status = file_write_blocks(&map, 0, grown_blocks, (const char *) index, grown_blocks * FILE_BLOCK_SIZE, &moved);
+
+        file->size = total;
+        file->time_changed = datetime_packed();
+        if (!file_map_store(sector, file, &map))
+            status = 0;
+        file_map_free(&map);
+    }
+
+    if (deflating)
+        deflateEnd(&z);
+    heap_free(index);
+    heap_free(chunk);
+    heap_free(out);
+
+    file_commit();
+    return status;
+}
+
+// adds data at the end, touching only the last block and the new ones
+int file_append(uint32_t sector, const char *data, size_t size) {
+    if (size == 0)
+        return 1;
+
+    file_node_t file;
+    file_node(sector, &file);
+
+    // a compressed file only has its last chunk laid out again
+    if ((file.flags & FILE_COMPRESSED) && file.size)
+        return file_append_packed(sector, &file, data, size);
+
+    // otherwise appending works on plain blocks, the file can be compressed again afterwards
+    if (!file_expand(sector))
+        return 0;
+    file_node(sector, &file);
+
+    if (file.flags & FILE_INLINE) {
+        file_data_t block;
+        file_inline_read(sector, &block);
+
+        if (file.size + size <= file_inline_room(sector)) {
+            memcpy(block.data + file.size, data, size);
+            file.size += size;
+            file.time_changed = datetime_packed();
+            file_inline_write(sector, &file, block.data, file.size);
+
+            file_commit();
+            return 1;
+        }
+
+        // outgrowing the node, the few inline bytes are written out along with the rest
+        char *joined = heap_alloc(file.size + size);
+        if (!joined)
+            return 0;
+        memcpy(joined, block.data, file.size);
+        memcpy(joined + file.size, data, size);
+
+        int status = file_write(sector, joined, file.size + size);
+        heap_free(joined);
+        return status;
+    }
+
+    file_map_t map;
+    file_map_load(sector, &file, &map);
+
+    size_t used = file.size % FILE_BLOCK_SIZE;
+    size_t topped = 0;
+    uint32_t moved = 0;
+    if (used) {
+        uint32_t last = file_map_lookup(&map, file.size / FILE_BLOCK_SIZE, NULL);
+        file_data_t block;
+        file_data(last, &block);
+
+        topped = FILE_BLOCK_SIZE - used < size ? FILE_BLOCK_SIZE - used : size;
+        memcpy(block.data + used, data, topped);
+        if (!file_write_blocks(&map, file.size / FILE_BLOCK_SIZE, 1, (const char *) block.data, FILE_BLOCK_SIZE, &moved)) {
+            file_map_free(&map);
+            return 0;
+        }
+    }
+
+    int status = 1;
+    uint32_t old_blocks = map.blocks;
+    if (topped < size && !file_grow(sector, &map, data + topped, size - topped))
+        status = 0;
+
+    size_t total = file.size + size;
+    file.size = total < (size_t) map.blocks * FILE_BLOCK_SIZE ? total : map.blocks * FILE_BLOCK_SIZE;
+    file.time_changed = datetime_packed();
+    if (map.blocks != old_blocks || moved) {
+        if (!file_map_store(sector, &file, &map))
+            status = 0;
+    } else
+        file_node_write(sector, &file);
+    file_map_free(&map);
+
+    file_commit();
+    return status;
+}
+
+// dest takes on source's contents, sharing its blocks until either side writes one of them
+int file_clone(uint32_t source, uint32_t dest) {
+    file_node_t from;
+    file_node_t to;
+    file_node(source, &from);
+    file_node(dest, &to);
+
+    if (!(from.flags & FILE_DATA) || !(to.flags & FILE_DATA) || !file_bitmap_get())
+        return 0;
+    if (source == dest)
+        return 1;
+
+    if (from.flags & FILE_INLINE) {
+        file_data_t block;
+        file_inline_read(source, &block);
+        return file_write(dest, (const char *) block.data, from.size);
+    }
+
+    file_map_t map;
+    file_map_load(source, &from, &map);
+
+    // a block whose count is full can't take another owner, the caller copies the data instead
+    file_refs_t refs = {0};
+    for (uint32_t i = 0; i < map.count; i++) {
+        for (uint32_t j = 0; j < map.extents[i].count; j++) {
+            if (*file_refs_at(&refs, map.extents[i].start + j) < FILE_REF_MAX)
+                continue;
+
+            file_map_free(&map);
+            return 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < map.count; i++) {
+        for (uint32_t j = 0; j < map.extents[i].count; j++) {
+            if ((*file_refs_at(&refs, map.extents[i].start + j))++ == 0)
+                file_sb.shared++;
+            refs.dirty = 1;
+        }
+    }
+    file_refs_done(&refs);
+    file_sb_touch();
+
+    // the old contents go, the shared blocks take their place
+    file_map_t old;
+    file_map_load(dest, &to, &old);
+    file_map_release(&old);
+    file_map_free(&old);
+
+    to.flags &= ~(FILE_INLINE | FILE_COMPRESSED);
+    to.flags |= from.flags & FILE_COMPRESSED;
+    to.size = from.size;
+    to.time_changed = datetime_packed();
+    int status = file_map_store(dest, &to, &map);
+    file_map_free(&map);
+
+    file_commit();
+    return status;
+}
+
+char *file_read(uint32_t sector) {
+    file_node_t file;
+    file_node(sector, &file);
+
+    uint32_t blocks = (file.size + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE;
+    char *buffer = heap_alloc((size_t)blocks * FILE_BLOCK_SIZE + 1);
+    if (!buffer)
+        return NULL;
+    buffer[file.size] = '\0';
+
+    if (file.flags & FILE_INLINE) {
+        if (blocks)
+            file_inline_read(sector, (file_data_t *) buffer);
+        buffer[file.size] = '\0';
+        return buffer;
+    }
+
+    file_map_t map;
+    file_map_load(sector, &file, &map);
+
+    if (file.flags & FILE_COMPRESSED) {
+        int status = 1;
+        for (uint32_t i = 0; i * FILE_CHUNK_SIZE < file.size && status; i++)
+            status = file_chunk_read(&map, file.size, i, buffer + (size_t) i * FILE_CHUNK_SIZE) != 0;
+
+        file_map_free(&map);
+        if (!status) {
+            heap_free(buffer);
+            return NULL;
+        }
+
+        buffer[file.size] = '\0';
+        return buffer;
+    }
+
+    // every extent is one transfer, a failed one fails the read rather than hand back stale bytes
+    int status = 1;
+    for (uint32_t i = 0; i < map.count && map.first[i] < blocks && status; i++) {
+        uint32_t count = map.extents[i].count;
+        if (count > blocks - map.first[i])
+            count = blocks - map.first[i];
+
+        status = file_data_run(map.extents[i].start, count, (file_data_t *)(buffer + map.first[i] * FILE_BLOCK_SIZE));
+    }
+
+    file_map_free(&map);
+    if (!status) {
+        heap_free(buffer);
+        return NULL;
+    }
+
+    buffer[file.size] = '\0';
+    return buffer;
+}
+
+static uint32_t file_name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// a folder's name index, read one data block at a time
+typedef struct file_index {
+    file_map_t map;
+    uint32_t slots;
+    uint32_t block;
+    uint32_t sector; // where the held block lives, 0 when none is held
+    file_index_entry_t entries[FILE_INDEX_ENTRIES];
+} file_index_t;
+
+static void file_index_open(file_index_t *index, uint32_t folder, file_node_t *node) {
+    file_map_load(folder, node, &index->map);
+    index->slots = index->map.blocks * FILE_INDEX_ENTRIES;
+    index->sector = 0;
+}
+
+static file_index_entry_t *file_index_slot(file_index_t *index, uint32_t slot) {
+    uint32_t block = slot / FILE_INDEX_ENTRIES;
+    if (!index->sector || index->block != block) {
+        index->block = block;
+        index->sector = file_map_lookup(&index->map, block, NULL);
+        file_disk_read(index->sector, 1, index->entries);
+    }
+
+    return &index->entries[slot % FILE_INDEX_ENTRIES];
+}
+
+static void file_index_put(file_index_t *index, uint32_t slot, uint32_t hash, uint32_t sector) {
+    file_index_entry_t *entry = file_index_slot(index, slot);
+    entry->hash = hash;
+    entry->sector = sector;
+    file_meta_write(index->sector, 1, index->entries);
+}
+
+static file_dentry_t *file_dentry_slot(uint32_t parent, const char *name) {
+    return &file_dentries[(file_name_hash(name) ^ (parent * 2654435761u)) % FILE_DENTRY_ENTRIES];
+}
+
+static void file_dentry_drop(uint32_t parent, const char *name) {
+    file_dentry_t *dentry = file_dentry_slot(parent, name);
+    if (dentry->parent == parent && !strcmp(dentry->name, name))
+        dentry->parent = 0;
+}
+
+// a released folder sector can come back as a different folder
+static void file_dentry_forget(uint32_t parent) {
+    for (uint32_t i = 0; i < FILE_DENTRY_ENTRIES; i++) {
+        if (file_dentries[i].parent == parent)
+            file_dentries[i].parent = 0;
+    }
+}
+
+static void file_dentry_clear() {
+    memset(file_dentries, 0, sizeof(file_dentries));
+}
+
+// probes the whole run so both types get settled in one pass
+static void file_index_probe(uint32_t folder, const char *name, file_dentry_t *dentry) {
+    dentry->file = 0;
+    dentry->folder = 0;
+
+    file_node_t node;
+    file_node(folder, &node);
+    if (!(node.flags & FILE_FOLDER) || node.children == 0)
+        return;
+
+    file_index_t index;
+    file_index_open(&index, folder, &node);
+
+    uint32_t hash = file_name_hash(name);
+    for (uint32_t i = 0; i < index.slots; i++) {
+        file_index_entry_t *entry = file_index_slot(&index, (hash + i) % index.slots);
+        if (!entry->sector)
+            break;
+        if (entry->hash != hash)
+            continue;
+
+        uint32_t sector = entry->sector;
+        file_node_t child;
+        file_node(sector, &child);
+        if (strcmp(child.name, name))
+            continue;
+
+        if ((child.flags & FILE_DATA) && !dentry->file)
+            dentry->file = sector;
+        else if ((child.flags & FILE_FOLDER) && !dentry->folder)
+            dentry->folder = sector;
+    }
+
+    file_map_free(&index.map);
+}
+
+// flags 0 takes either type, preferring a file
+static uint32_t file_index_find(uint32_t folder, const char *name, uint8_t flags) {
+    file_dentry_t *dentry = file_dentry_slot(folder, name);
+    if (dentry->parent != folder || strcmp(dentry->name, name)) {
+        file_index_probe(folder, name, dentry);
+        dentry->parent = folder;
+        strcpy(dentry->name, name);
+    }
+
+    if (flags & FILE_DATA)
+        return dentry->file;
+    if (flags & FILE_FOLDER)
+        return dentry->folder;
 
-    return 0;
+    return dentry->file ? dentry->file : dentry->folder;
 }
 
-uint32_t file_get(uint32_t parent, const char *name) {
-    file_node_t parent_node;
-    file_node(parent, &parent_node);
+// rebuilds the table at twice the size in freshly allocated blocks
+static int file_index_grow(uint32_t folder, file_node_t *node, file_index_t *index) {
+    uint32_t blocks = index->map.blocks ? index->map.blocks * 2 : 1;
+    uint32_t slots = blocks * FILE_INDEX_ENTRIES;
 
-    uint32_t current = parent_node.child_head;
-    file_node_t current_node;
+    file_index_entry_t *table = heap_alloc(blocks * FILE_BLOCK_SIZE);
+    if (!table)
+        return 0;
+    memset(table, 0, blocks * FILE_BLOCK_SIZE);
 
-    while (current) {
-        file_node(current, &current_node);
-        if (!strcmp(current_node.name, name) && (current_node.flags & FILE_DATA))
-            return current;
+    for (uint32_t i = 0; i < index->slots; i++) {
+        file_index_entry_t *entry = file_index_slot(index, i);
+        if (!entry->sector)
+            continue;
 
-        current = current_node.child_next;
+        uint32_t slot = entry->hash % slots;
+        while (table[slot].sector)
+            slot = (slot + 1) % slots;
+        table[slot] = *entry;
     }
 
-    return 0;
-}
-
-void file_node(uint32_t sector, file_node_t *node) {
-    uint8_t buffer[512];
-    ata_read_sector(file_port, sector, buffer);
-    memcpy(node, buffer, sizeof(file_node_t));
-}
+    file_map_t map = {0};
+    uint32_t near = index->map.count ? index->map.extents[0].start : FILE_NODE_SECTOR(folder) + 1;
+    while (map.blocks < blocks) {
+        uint32_t got;
+        uint32_t start = file_run_alloc(near, blocks - map.blocks, &got);
+        if (start == 0 || !file_map_append(&map, start, got)) {
+            if (start) file_run_free(start, got);
+            file_map_release(&map);
+            file_map_free(&map);
+            heap_free(table);
+            return 0;
+        }
 
-void file_node_write(uint32_t sector, file_node_t *node) {
-    uint8_t buffer[512];
-    memcpy(buffer, node, sizeof(file_node_t));
-    ata_write_sector(file_port, sector, buffer);
-}
+        file_data_run_write(start, got, (file_data_t *) table + (map.blocks - got));
+        near = start + got;
+    }
+    heap_free(table);
 
-void file_data(uint32_t sector, file_data_t *data) {
-    uint8_t buffer[512];
-    ata_read_sector(file_port, sector, buffer);
-    memcpy(data, buffer, sizeof(file_data_t));
-}
+    file_map_release(&index->map);
+    file_map_free(&index->map);
+    index->map = map;
+    index->slots = slots;
+    index->sector = 0;
 
-void file_data_write(uint32_t sector, file_data_t *data) {
-    uint8_t buffer[512];
-    memcpy(buffer, data, sizeof(file_data_t));
-    ata_write_sector(file_port, sector, buffer);
+    return file_map_store(folder, node, &index->map);
 }
 
-int file_write(uint32_t sector, const char *data, size_t size) {
-    file_node_t file;
-    file_node(sector, &file);
-    file.size = 0;
+static int file_index_insert(uint32_t folder, file_node_t *node, const char *name, uint32_t sector) {
+    file_index_t index;
+    file_index_open(&index, folder, node);
 
-    size_t written = 0;
-    uint32_t current = file.first_block;
+    // kept at most three quarters full so probe runs stay short
+    if ((node->children + 1) * 4 > index.slots * 3 && !file_index_grow(folder, node, &index)) {
+        file_map_free(&index.map);
+        return 0;
+    }
 
-    while (written < size) {
-        file_data_t block;
-        file_data(current, &block);
+    uint32_t hash = file_name_hash(name);
+    uint32_t slot = hash % index.slots;
+    while (file_index_slot(&index, slot)->sector)
+        slot = (slot + 1) % index.slots;
 
-        size_t to_write = sizeof(block.data);
-        if (size - written < to_write)
-            to_write = size - written;
+    file_index_put(&index, slot, hash, sector);
+    file_map_free(&index.map);
 
-        memcpy(block.data, data + written, to_write);
-        if (to_write < sizeof(block.data))
-            memset(block.data + to_write, 0, sizeof(block.data) - to_write);
-        file_data_write(current, &block);
-        written += to_write;
+    node->children++;
+    file_node_write(folder, node);
+    return 1;
+}
 
-        file.size += to_write;
+static void file_index_remove(uint32_t folder, file_node_t *node, const char *name, uint32_t sector) {
+    file_index_t index;
+    file_index_open(&index, folder, node);
+    if (index.slots == 0) {
+        file_map_free(&index.map);
+        return;
+    }
 
-        if (written < size) {
-            if (block.next == 0) {
-                uint32_t new_block = file_sector_alloc();
-                if (new_block == 0) return 0;
+    uint32_t hash = file_name_hash(name);
+    uint32_t hole = hash % index.slots;
+    for (uint32_t probed = 0; file_index_slot(&index, hole)->sector != sector; probed++) {
+        if (!file_index_slot(&index, hole)->sector || probed == index.slots) {
+            file_map_free(&index.map);
+            return;
+        }
 
-                block.next = new_block;
-                file_data_write(current, &block);
+        hole = (hole + 1) % index.slots;
+    }
 
-                file_data_t data = {0};
-                data.next = 0;
-                file_data_write(new_block, &data);
+    // pull later entries of the probe run back over the hole, lookups stop at the first free slot
+    for (uint32_t next = (hole + 1) % index.slots;; next = (next + 1) % index.slots) {
+        file_index_entry_t entry = *file_index_slot(&index, next);
+        if (!entry.sector)
+            break;
 
-                current = new_block;
-            } else {
-                current = block.next;
-            }
+        uint32_t home = entry.hash % index.slots;
+        if ((next - home + index.slots) % index.slots >= (next - hole + index.slots) % index.slots) {
+            file_index_put(&index, hole, entry.hash, entry.sector);
+            hole = next;
         }
     }
 
-    file.time_changed = datetime_packed();
-    file_node_write(sector, &file);
+    file_index_put(&index, hole, 0, 0);
 
-    return 1;
+    // an emptied folder gives its table back, the next insert starts a fresh one
+    node->children--;
+    if (node->children == 0) {
+        file_map_release(&index.map);
+        file_map_store(folder, node, &index.map);
+    } else
+        file_node_write(folder, node);
+
+    file_map_free(&index.map);
 }
 
-char *file_read(uint32_t sector) {
-    file_node_t file;
-    file_node(sector, &file);
+// points a child's entry at the number its node moved to, the name and so the probe run stay the same
+static void file_index_retarget(uint32_t folder, file_node_t *node, const char *name, uint32_t from, uint32_t to) {
+    file_index_t index;
+    file_index_open(&index, folder, node);
+
+    uint32_t hash = file_name_hash(name);
+    for (uint32_t i = 0; i < index.slots; i++) {
+        uint32_t slot = (hash + i) % index.slots;
+        file_index_entry_t *entry = file_index_slot(&index, slot);
+        if (!entry->sector)
+            break;
+
+        if (entry->sector == from) {
+            file_index_put(&index, slot, hash, to);
+            break;
+        }
+    }
 
-    size_t offset = 0;
-    char *buffer = heap_alloc(file.size + 1);
-    buffer[file.size] = '\0';
+    file_map_free(&index.map);
+}
 
-    uint32_t current = file.first_block;
-    while (current && offset < file.size) {
-        file_data_t block;
-        file_data(current, &block);
+static int file_child_add(uint32_t parent, file_node_t *parent_node, uint32_t sector, file_node_t *node) {
+    file_dentry_drop(parent, node->name);
 
-        size_t remaining = file.size - offset;
-        size_t size = remaining < sizeof(block.data) ? remaining : sizeof(block.data);
+    node->child_prev = parent_node->child_tail;
+    node->child_next = 0;
+    file_node_write(sector, node);
 
-        memcpy(buffer + offset, block.data, size);
-        offset += size;
+    if (!file_index_insert(parent, parent_node, node->name, sector))
+        return 0;
 
-        current = block.next;
-    }
+    if (parent_node->child_tail) {
+        file_node_t tail;
+        file_node(parent_node->child_tail, &tail);
+        tail.child_next = sector;
+        file_node_write(parent_node->child_tail, &tail);
+    } else
+        parent_node->child_head = sector;
 
-    return buffer;
+    parent_node->child_tail = sector;
+    file_node_write(parent, parent_node);
+    return 1;
+}
+
+static void file_child_remove(uint32_t parent, file_node_t *parent_node, uint32_t sector, file_node_t *node) {
+    file_dentry_drop(parent, node->name);
+    file_index_remove(parent, parent_node, node->name, sector);
+
+    if (node->child_prev) {
+        file_node_t prev;
+        file_node(node->child_prev, &prev);
+        prev.child_next = node->child_next;
+        file_node_write(node->child_prev, &prev);
+    } else
+        parent_node->child_head = node->child_next;
+
+    if (node->child_next) {
+        file_node_t next;
+        file_node(node->child_next, &next);
+        next.child_prev = node->child_prev;
+        file_node_write(node->child_next, &next);
+    } else
+        parent_node->child_tail = node->child_prev;
+
+    file_node_write(parent, parent_node);
+}
+
+// hands back a node's data or index blocks, along with the node itself
+static void file_node_release(uint32_t sector, file_node_t *node) {
+    file_map_t map;
+    file_map_load(sector, node, &map);
+    file_map_release(&map);
+    file_map_free(&map);
+    file_indirect_free(node->indirect);
+
+    if (node->flags & FILE_FOLDER)
+        file_dentry_forget(sector);
+    file_node_free(sector);
+}
+
+uint32_t file_get(uint32_t parent, const char *name) {
+    return file_index_find(parent, name, FILE_DATA);
 }
 
 int file_split_path(const char *path, char *out_parent, char *out_name) {
@@ -306,7 +2308,7 @@ void file_get_abspath(uint32_t node, char *path, size_t size) {
     pos = size - 1;
     path[pos] = '\0';
 
-    while (node && node != FILE_SECTOR_ROOT) {
+    while (node && node != FILE_NODE_ROOT) {
         file_node(node, &node_node);
         size_t len = strlen(node_node.name);
 
@@ -337,10 +2339,10 @@ void file_get_abspath(uint32_t node, char *path, size_t size) {
 uint32_t file_get_node(const char *path) {
     if (!path) return 0;
 
-    uint32_t current = (path[0] == '/') ? FILE_SECTOR_ROOT : file_current;
+    uint32_t current = (path[0] == '/') ? FILE_NODE_ROOT : file_current;
 
     if (path[0] == '/' && path[1] == '\0')
-        return FILE_SECTOR_ROOT;
+        return FILE_NODE_ROOT;
 
     char name[FILE_MAX_NAME];
     size_t name_length = 0;
@@ -355,22 +2357,8 @@ uint32_t file_get_node(const char *path) {
             if (name_length > 0) {
                 name[name_length] = '\0';
 
-                file_node_t current_node;
-                file_node(current, &current_node);
-
-                uint32_t found = 0;
-                uint32_t child = current_node.child_head;
-                while (child) {
-                    file_node_t child_node;
-                    file_node(child, &child_node);
-
-                    if (!strcmp(child_node.name, name)) {
-                        found = child;
-                        break;
-                    }
-
-                    child = child_node.child_next;
-                }
+                // every step but the last has to be a folder
+                uint32_t found = file_index_find(current, name, c == '/' ? FILE_FOLDER : 0);
 
                 if (!found)
                     return 0;
@@ -403,14 +2391,13 @@ uint32_t file_get_node2(const char *parent, const char *basename) {
 }
 
 int file_path_isfile(const char *path) {
-    file_node_t node;
     uint32_t sector = file_get_node(path);
-    file_node(sector, &node);
-
-    if (sector && node.flags & FILE_DATA)
-        return 1;
+    if (!sector)
+        return 0;
 
-    return 0;
+    file_node_t node;
+    file_node(sector, &node);
+    return (node.flags & FILE_DATA) != 0;
 
 }
 
@@ -425,48 +2412,22 @@ int file_create(uint32_t parent, const char *name) {
     if (file_exists(parent, name) || !(parent_node.flags & FILE_FOLDER))
         return 0;
 
-    uint32_t node_sector = file_sector_alloc();
-    uint32_t data_sector = file_sector_alloc();
-    if (node_sector == 0 || data_sector == 0) {
-        if (node_sector) file_sector_free(node_sector);
-        if (data_sector) file_sector_free(data_sector);
-        return 0;
-    }
-
-    file_superblock_t sb; file_read_sb(&sb);
     file_node_t file = {0};
     file.time_created = datetime_packed();
     file.time_changed = datetime_packed();
     file.parent = parent;
-    file.flags = FILE_DATA;
-    file.child_head = 0;
-    file.child_next = 0;
-    file.first_block = data_sector;
-    file.size = 0;
+    file.flags = FILE_DATA | FILE_INLINE;
     strcpy(file.name, name);
 
-    if (parent_node.child_head) {
-        uint32_t current = parent_node.child_head;
-        file_node_t current_node;
-        file_node(current, &current_node);
+    uint32_t number = file_node_alloc(parent_node.child_tail ? parent_node.child_tail : parent, &file);
+    if (number == 0) return 0;
 
-        while(current_node.child_next) {
-            current = current_node.child_next;
-            file_node(current, &current_node);
-        }
-
-        current_node.child_next = node_sector;
-        file_node_write(current, &current_node);
-    } else {
-        parent_node.child_head = node_sector;
-        file_node_write(parent, &parent_node);
+    if (!file_child_add(parent, &parent_node, number, &file)) {
+        file_node_free(number);
+        return 0;
     }
-    file_node_write(node_sector, &file);
-
-    file_data_t data = {0};
-    data.next = 0;
-    file_data_write(data_sector, &data);
 
+    file_commit();
     return 1;
 }
 
@@ -474,76 +2435,107 @@ int file_delete(uint32_t parent, const char *name) {
     file_node_t parent_node;
     file_node(parent, &parent_node);
 
-    uint32_t prev = 0;
-    uint32_t current = parent_node.child_head;
-    file_node_t prev_node;
+    uint32_t current = file_get(parent, name);
+    if (!current)
+        return 0;
+
     file_node_t current_node;
+    file_node(current, &current_node);
 
-    while (current) {
-        file_node(current, &current_node);
-        if (!strcmp(current_node.name, name)) {
-            if (!(current_node.flags & FILE_DATA))
-                return 0;
+    file_child_remove(parent, &parent_node, current, &current_node);
+    file_node_release(current, &current_node);
 
-            uint32_t current_data = current_node.first_block;
-            while(current_data) {
-                file_data_t data_block;
-                file_data(current_data, &data_block);
+    file_commit();
+    return 1;
+}
 
-                uint32_t next = data_block.next;
-                file_sector_free(current_data);
+// with replace a file takes the place of one already under the name, released only once the move has gone through
+int file_move(uint32_t sector, uint32_t parent, const char *name, int replace) {
+    file_node_t node;
+    file_node(sector, &node);
 
-                current_data = next;
-            }
+    file_node_t parent_node;
+    file_node(parent, &parent_node);
 
-            file_sector_free(current);
+    if (!node.flags || sector == FILE_NODE_ROOT || !(parent_node.flags & FILE_FOLDER) || strlen(name) >= sizeof(node.name))
+        return 0;
 
-            if (prev) {
-                file_node(prev, &prev_node);
-                prev_node.child_next = current_node.child_next;
-                file_node_write(prev, &prev_node);
-            } else {
-                parent_node.child_head = current_node.child_next;
-                file_node_write(parent, &parent_node);
-            }
+    uint32_t taken = (node.flags & FILE_FOLDER) ? folder_get(parent, name) : file_get(parent, name);
+    if (taken == sector)
+        return 1;
+    if (taken && (!replace || (node.flags & FILE_FOLDER)))
+        return 0;
 
-            return 1;
+    // a folder can't be moved into itself or anything under it
+    if (node.flags & FILE_FOLDER) {
+        for (uint32_t up = parent; up != FILE_NODE_ROOT;) {
+            if (up == sector)
+                return 0;
+
+            file_node_t above;
+            file_node(up, &above);
+            up = above.parent;
         }
+    }
 
-        prev = current;
-        current = current_node.child_next;
+    // the replaced file is unlinked first, it may be a neighbour whose links the move rewrites
+    file_node_t taken_node;
+    if (taken) {
+        file_node(taken, &taken_node);
+        file_child_remove(parent, &parent_node, taken, &taken_node);
+        file_node(sector, &node);
     }
 
-    return 0;
-}
+    // only links change, the data and anything under a folder stay where they are
+    uint32_t from = node.parent;
+    char old_name[sizeof(node.name)];
+    strcpy(old_name, node.name);
 
-uint32_t folder_get(uint32_t parent, const char *name) {
-    file_node_t parent_node;
+    file_node_t from_node;
+    file_node(from, &from_node);
+    file_child_remove(from, &from_node, sector, &node);
+
+    // the target may be the old parent or a sibling, unlinking rewrote those
     file_node(parent, &parent_node);
 
-    uint32_t current = parent_node.child_head;
-    file_node_t current_node;
+    node.parent = parent;
+    strcpy(node.name, name);
+    node.time_changed = datetime_packed();
 
-    while (current) {
-        file_node(current, &current_node);
-        if (!strcmp(current_node.name, name) && (current_node.flags & FILE_FOLDER))
-            return current;
+    if (!file_child_add(parent, &parent_node, sector, &node)) {
+        file_node(from, &from_node);
+        node.parent = from;
+        strcpy(node.name, old_name);
+        file_child_add(from, &from_node, sector, &node);
+
+        if (taken) {
+            file_node(parent, &parent_node);
+            file_child_add(parent, &parent_node, taken, &taken_node);
+        }
 
-        current = current_node.child_next;
+        file_commit();
+        return 0;
     }
 
-    return 0;
+    if (taken)
+        file_node_release(taken, &taken_node);
+
+    file_commit();
+    return 1;
+}
+
+uint32_t folder_get(uint32_t parent, const char *name) {
+    return file_index_find(parent, name, FILE_FOLDER);
 }
 
 int file_path_isfolder(const char *path) {
-    file_node_t node;
     uint32_t sector = file_get_node(path);
-    file_node(sector, &node);
-
-    if (sector && node.flags & FILE_FOLDER)
-        return 1;
+    if (!sector)
+        return 0;
 
-    return 0;
+    file_node_t node;
+    file_node(sector, &node);
+    return (node.flags & FILE_FOLDER) != 0;
 
 }
 
@@ -558,147 +2550,482 @@ int folder_create(uint32_t parent, const char *name) {
     if (folder_exists(parent, name) || !(parent_node.flags & FILE_FOLDER))
         return 0;
 
-    uint32_t node_sector = file_sector_alloc();
-    if (node_sector == 0) return 0;
-
-    file_superblock_t sb; file_read_sb(&sb);
     file_node_t folder = {0};
     folder.time_created = datetime_packed();
     folder.time_changed = datetime_packed();
     folder.parent = parent;
     folder.flags = FILE_FOLDER;
-    folder.child_head = 0;
-    folder.child_next = 0;
-    folder.size = 0;
-    folder.first_block = 0;
     strcpy(folder.name, name);
 
-    if (parent_node.child_head) {
-        uint32_t current = parent_node.child_head;
-        file_node_t current_node;
-        file_node(current, &current_node);
+    uint32_t number = file_node_alloc(parent_node.child_tail ? parent_node.child_tail : parent, &folder);
+    if (number == 0) return 0;
 
-        while(current_node.child_next) {
-            current = current_node.child_next;
-            file_node(current, &current_node);
-        }
-
-        current_node.child_next = node_sector;
-        file_node_write(current, &current_node);
-    } else {
-        parent_node.child_head = node_sector;
-        file_node_write(parent, &parent_node);
+    if (!file_child_add(parent, &parent_node, number, &folder)) {
+        file_node_free(number);
+        return 0;
     }
-    file_node_write(node_sector, &folder);
 
+    file_commit();
     return 1;
 }
 
 int folder_delete(uint32_t parent, const char *name) {
+    return folder_delete_progress(parent, name, NULL);
+}
+
+int folder_delete_progress(uint32_t parent, const char *name, void (*progress)(uint32_t removed)) {
     file_node_t parent_node;
     file_node(parent, &parent_node);
 
-    uint32_t prev = 0;
-    uint32_t current = parent_node.child_head;
+    uint32_t current = folder_get(parent, name);
+    if (!current || !file_bitmap_get())
+        return 0;
+
     file_node_t current_node;
-    file_node_t prev_node;
+    file_node(current, &current_node);
 
-    while (current) {
-        file_node(current, &current_node);
-        if (!strcmp(current_node.name, name)) {
-            if (!(current_node.flags & FILE_FOLDER))
-                return 0;
+    // unlinked in one go, the superblock holds on to it until the last of it is freed
+    file_batch_begin();
+    file_child_remove(parent, &parent_node, current, &current_node);
+    file_sb.orphan = current;
+    file_sb_touch();
 
-            if (current_node.child_head) {
-                uint32_t current_file = current_node.child_head;
-                file_node_t current_file_node;
+    file_tree_release(current, progress);
+    file_batch_end();
+    return 1;
+}
 
-                while (current_file) {
-                    file_node(current_file, &current_file_node);
+// frees a detached tree in one walk, taking each folder's children off the head of its list.
+// whenever a commit lands what's left is still a tree, so a crash leaves the orphan to finish
+static void file_tree_release(uint32_t top, void (*progress)(uint32_t removed)) {
+    uint32_t removed = 0;
+    uint32_t folder = top;
 
-                    if (current_file_node.flags & FILE_DATA)
-                        file_delete(current, current_file_node.name);
-                    else
-                        folder_delete(current, current_file_node.name);
-                    current_file = current_file_node.child_next;
-                }
-            }
+    while (1) {
+        file_node_t node;
+        file_node(folder, &node);
+
+        if (node.child_head) {
+            uint32_t child = node.child_head;
+            file_node_t child_node;
+            file_node(child, &child_node);
 
+            if (child_node.flags & FILE_FOLDER) {
+                folder = child;
+                continue;
+            }
 
-            if (prev) {
-                file_node(prev, &prev_node);
-                prev_node.child_next = current_node.child_next;
-                file_node_write(prev, &prev_node);
+            // nothing looks the children up by name anymore, the index goes with the folder
+            node.child_head = child_node.child_next;
+            file_node_write(folder, &node);
+            file_node_release(child, &child_node);
+        } else {
+            uint32_t up = node.parent;
+            if (folder != top) {
+                file_node_t up_node;
+                file_node(up, &up_node);
+                up_node.child_head = node.child_next;
+                file_node_write(up, &up_node);
             } else {
-                parent_node.child_head = current_node.child_next;
-                file_node_write(parent, &parent_node);
+                file_sb.orphan = 0;
+                file_sb_touch();
             }
 
-            file_sector_free(current);
-            return 1;
+            file_node_release(folder, &node);
+            if (folder == top)
+                break;
+            folder = up;
         }
 
-        prev = current;
-        current = current_node.child_next;
+        if (progress && ++removed % FILE_DELETE_PROGRESS == 0)
+            progress(removed);
+
+        // commits fall between items, never partway through one
+        file_commit();
+    }
+}
+
+// a folder delete cut short by a crash is finished before anything else touches the disk
+static void file_orphan_finish() {
+    if (!file_bitmap_get() || !file_sb.orphan)
+        return;
+
+    log("[ INFO ] FILE: Finishing an interrupted folder delete\n");
+    file_batch_begin();
+    file_tree_release(file_sb.orphan, NULL);
+    file_batch_end();
+}
+
+// preorder step through the tree under top, 0 once all of it has been seen
+static uint32_t file_tree_next(uint32_t top, uint32_t at) {
+    file_node_t node;
+    file_node(at, &node);
+    if ((node.flags & FILE_FOLDER) && node.child_head)
+        return node.child_head;
+
+    while (at != top) {
+        if (node.child_next)
+            return node.child_next;
+
+        at = node.parent;
+        file_node(at, &node);
     }
 
     return 0;
 }
 
-void file_sector_free(uint32_t sector) {
-    file_superblock_t sb;
-    file_read_sb(&sb);
+static int file_map_shared(file_map_t *map) {
+    if (!file_sb.shared)
+        return 0;
 
-    uint8_t buffer[512] = {0};
-    memcpy(buffer, &sb.free_list, sizeof(uint32_t));
-    ata_write_sector(file_port, sector, buffer);
+    file_refs_t refs = {0};
+    for (uint32_t i = 0; i < map->count; i++) {
+        for (uint32_t n = 0; n < map->extents[i].count; n++) {
+            if (*file_refs_at(&refs, map->extents[i].start + n))
+                return 1;
+        }
+    }
 
-    sb.free_list = sector;
-    sb.used--;
-    file_write_sb(&sb);
+    return 0;
 }
 
-uint32_t file_sector_alloc() {
-    file_superblock_t sb;
-    file_read_sb(&sb);
+// gives a node a slot beside its parent or the sibling before it, returning the number it ends up with
+static uint32_t file_node_compact(uint32_t number) {
+    if (number == FILE_NODE_ROOT)
+        return number;
 
-    if (sb.used >= sb.sectors) {
-        term_write("Error: Disk full!\n");
+    file_node_t node;
+    file_node(number, &node);
+
+    uint32_t sector = FILE_NODE_SECTOR(number);
+    if (sector == FILE_NODE_SECTOR(node.parent) || (node.child_prev && sector == FILE_NODE_SECTOR(node.child_prev)))
+        return number;
+    if ((node.flags & FILE_FOLDER) && node.children > FILE_DEFRAG_CHILDREN)
+        return number;
+    if (file_node_spans((uint8_t *) &node)) // inline bytes past the slot need the slots after it
+        return number;
+
+    // the whole slot moves, extents or inline bytes included
+    uint8_t buffer[512];
+    uint8_t slot[FILE_NODE_SIZE];
+    file_disk_read(sector, 1, buffer);
+    memcpy(slot, file_node_slot(buffer, number), FILE_NODE_SIZE);
+
+    uint32_t moved = file_node_claim(FILE_NODE_SECTOR(node.parent), slot, FILE_NODE_SIZE);
+    if (!moved && node.child_prev)
+        moved = file_node_claim(FILE_NODE_SECTOR(node.child_prev), slot, FILE_NODE_SIZE);
+    if (!moved)
+        return number;
+    file_node_free(number);
+
+    file_node_t parent_node;
+    file_node(node.parent, &parent_node);
+    if (parent_node.child_head == number)
+        parent_node.child_head = moved;
+    if (parent_node.child_tail == number)
+        parent_node.child_tail = moved;
+    file_node_write(node.parent, &parent_node);
+    file_index_retarget(node.parent, &parent_node, node.name, number, moved);
+    file_dentry_drop(node.parent, node.name);
+
+    file_node_t link;
+    if (node.child_prev) {
+        file_node(node.child_prev, &link);
+        link.child_next = moved;
+        file_node_write(node.child_prev, &link);
+    }
+    if (node.child_next) {
+        file_node(node.child_next, &link);
+        link.child_prev = moved;
+        file_node_write(node.child_next, &link);
+    }
+
+    // a folder's children point back at it
+    if (node.flags & FILE_FOLDER) {
+        for (uint32_t child = node.child_head; child; child = link.child_next) {
+            file_node(child, &link);
+            link.parent = moved;
+            file_node_write(child, &link);
+        }
+        file_dentry_forget(number);
+    }
+
+    if (file_current == number)
+        file_current = moved;
+    return moved;
+}
+
+// copies a node's blocks into one run beside it, blocks shared with a clone stay where they are
+static int file_defrag_blocks(uint32_t number) {
+    file_node_t node;
+    file_node(number, &node);
+    if (node.flags & FILE_INLINE)
+        return 1;
+
+    file_map_t map;
+    file_map_load(number, &node, &map);
+    if (map.count <= 1 || file_map_shared(&map)) {
+        file_map_free(&map);
+        return 1;
+    }
+
+    // with no free run long enough for all of it, it's left as it is
+    uint32_t got;
+    uint32_t start = file_run_alloc(FILE_NODE_SECTOR(number) + 1, map.blocks, &got);
+    if (got < map.blocks) {
+        file_run_free(start, got);
+        file_map_free(&map);
+        return start != 0;
+    }
+
+    file_data_t *buffer = heap_alloc(sizeof(file_data_t) * FILE_DEFRAG_RUN);
+    int status = buffer != NULL;
+    uint32_t to = start;
+    for (uint32_t i = 0; i < map.count && status; i++) {
+        for (uint32_t done = 0; done < map.extents[i].count && status;) {
+            uint32_t count = map.extents[i].count - done;
+            if (count > FILE_DEFRAG_RUN)
+                count = FILE_DEFRAG_RUN;
+
+            status = file_data_run(map.extents[i].start + done, count, buffer)
+                && file_data_run_write(to, count, buffer);
+            done += count;
+            to += count;
+        }
+    }
+    heap_free(buffer);
+
+    // the old blocks only go once the node points at the new run, a failed copy leaves the file as it was
+    file_map_t run = {0};
+    status = status && file_map_append(&run, start, map.blocks) && file_map_store(number, &node, &run);
+    if (status)
+        file_map_release(&map);
+    else
+        file_run_free(start, map.blocks);
+
+    file_map_free(&map);
+    file_map_free(&run);
+    return status;
+}
+
+// walks the tree once, each node is moved beside its parent before its blocks are gathered up.
+// nodes and blocks move under open handles, so it only runs while none are open
+int file_defrag(uint32_t top, void (*progress)(uint32_t done)) {
+    file_node_t node;
+    file_node(top, &node);
+    if (!node.flags || !file_bitmap_get() || file_handles)
         return 0;
+
+    int status = 1;
+    uint32_t done = 0;
+    file_batch_begin();
+    for (uint32_t at = top; at; at = file_tree_next(top, at)) {
+        uint32_t moved = file_node_compact(at);
+        if (at == top)
+            top = moved;
+        at = moved;
+
+        if (!file_defrag_blocks(at)) {
+            status = 0;
+            break;
+        }
+
+        if (progress && ++done % FILE_DEFRAG_PROGRESS == 0)
+            progress(done);
+
+        // commits fall between items, never partway through one
+        file_commit();
     }
+    file_batch_end();
 
-    uint8_t buffer[512];
-    uint32_t sector;
+    return status;
+}
+
+void file_fragstat(uint32_t top, file_frag_t *frag, void (*each)(uint32_t sector, uint32_t blocks, uint32_t extents)) {
+    memset(frag, 0, sizeof(file_frag_t));
 
-    if (sb.free_list != 0) {
-        sector = sb.free_list;
-        ata_read_sector(file_port, sector, buffer);
+    file_node_t node;
+    file_node(top, &node);
+    if (!node.flags)
+        return;
+
+    for (uint32_t at = top; at; at = file_tree_next(top, at)) {
+        file_node(at, &node);
+        if ((node.flags & FILE_INLINE) || node.extent_count == 0)
+            continue;
+
+        file_map_t map;
+        file_map_load(at, &node, &map);
+        if (map.count) {
+            frag->items++;
+            frag->blocks += map.blocks;
+            frag->extents += map.count;
+            if (map.count > 1)
+                frag->fragmented++;
+            if (each)
+                each(at, map.blocks, map.count);
+        }
+        file_map_free(&map);
+    }
+}
 
-        uint32_t free;
-        memcpy(&free, buffer, sizeof(uint32_t));
+// marks a run free in the bitmap, leaving alone what isn't data space
+static void file_run_release(uint32_t sector, uint32_t count) {
+    uint32_t first = file_sb.refcount + file_sb.refcount_sectors;
+    for (uint32_t i = sector; i < sector + count; i++) {
+        if (i < first || i >= file_sb.sectors || !file_bitmap_test(i))
+            continue;
 
-        sb.free_list = free;
-    } else {
-        sector = sb.free;
-        sb.free++;
+        file_bitmap_mark(i, 1, 0);
+        file_sb.used--;
     }
 
-    sb.used++;
-    file_write_sb(&sb);
+    file_sb_touch();
+}
+
+// the run stays taken until the commit that frees it, nothing written before then can land on it
+static void file_run_drop(uint32_t sector, uint32_t count) {
+    if (count == 0)
+        return;
+
+    if (file_committing || !file_map_append(&file_frees, sector, count)) {
+        file_run_release(sector, count);
+        return;
+    }
+
+    file_txn_touch();
+}
+
+void file_run_free(uint32_t sector, uint32_t count) {
+    if (!file_bitmap_get())
+        return;
+
+    if (!file_sb.shared) {
+        file_run_drop(sector, count);
+        return;
+    }
+
+    // a shared block only loses an owner, the rest of the run is freed around it
+    file_refs_t refs = {0};
+    uint32_t shared = file_sb.shared;
+    uint32_t run = sector;
+    for (uint32_t i = sector; i < sector + count && i < file_sb.sectors; i++) {
+        uint8_t *ref = file_refs_at(&refs, i);
+        if (!*ref)
+            continue;
+
+        if (--*ref == 0)
+            file_sb.shared--;
+        refs.dirty = 1;
+
+        file_run_drop(run, i - run);
+        run = i + 1;
+    }
+    file_refs_done(&refs);
+
+    if (run < sector + count)
+        file_run_drop(run, sector + count - run);
+    if (file_sb.shared != shared)
+        file_sb_touch();
+}
+
+// first fit from near, wrapping around once, settling for the longest run when none is long enough
+static uint32_t file_run_find(uint32_t near, uint32_t count, uint32_t *best_count) {
+    uint32_t first = file_sb.refcount + file_sb.refcount_sectors;
+    uint32_t best = 0;
+    uint32_t run = 0;
+    uint32_t run_count = 0;
+    uint32_t sector = near;
+    *best_count = 0;
+
+    for (uint32_t scanned = 0; scanned < file_sb.sectors - first; scanned++, sector++) {
+        if (sector == file_sb.sectors) {
+            sector = first;
+            run_count = 0;
+        }
+
+        // whole bytes in use are skipped at once
+        if (sector % 8 == 0 && sector + 8 <= file_sb.sectors && file_bitmap[sector / 8] == 0xFF) {
+            run_count = 0;
+            scanned += 7;
+            sector += 7;
+            continue;
+        }
+
+        if (file_bitmap_test(sector)) {
+            run_count = 0;
+            continue;
+        }
+
+        if (run_count++ == 0)
+            run = sector;
+        if (run_count > *best_count) {
+            best = run;
+            *best_count = run_count;
+        }
+        if (run_count == count)
+            break;
+    }
+
+    return best;
+}
+
+uint32_t file_run_alloc(uint32_t near, uint32_t count, uint32_t *got) {
+    *got = 0;
+    if (count == 0 || !file_bitmap_get())
+        return 0;
+
+    uint32_t first = file_sb.refcount + file_sb.refcount_sectors;
+    if (near < first || near >= file_sb.sectors)
+        near = file_sb.hint;
+    if (near < first || near >= file_sb.sectors)
+        near = first;
+
+    uint32_t best_count;
+    uint32_t best = file_run_find(near, count, &best_count);
 
-    memset(buffer, 0, sizeof(buffer));
-    ata_write_sector(file_port, sector, buffer);
+    // space freed by the open transaction only comes back once it commits, which can't happen
+    // partway through an operation. one with metadata already written fails with the disk full
+    if (best_count == 0 && file_frees.count && !file_committing && !file_op_open) {
+        file_journal_commit();
+        best = file_run_find(near, count, &best_count);
+    }
+
+    if (best_count == 0) {
+        term_write("Error: Disk full!\n");
+        return 0;
+    }
+
+    file_bitmap_mark(best, best_count, 1);
+    file_sb.used += best_count;
+    file_sb.hint = best + best_count;
+    file_sb_touch();
+
+    *got = best_count;
+    return best;
+}
+
+void file_sector_free(uint32_t sector) {
+    file_run_free(sector, 1);
+}
+
+uint32_t file_sector_alloc() {
+    uint32_t got;
+    uint32_t sector = file_run_alloc(0, 1, &got);
+    if (sector == 0)
+        return 0;
+
+    uint8_t buffer[512] = {0};
+    file_disk_write(sector, 1, buffer);
     return sector;
 }
 
 int file_drive_spec(drive_t *drive) {
-    uint8_t ata_id[512];
-    if (!ata_identify(file_port, ata_id))
+    if (file_drive_status != FILE_DRIVE_OK)
         return 0;
 
-    uint16_t *w = (uint16_t*) ata_id;
-    ata_get_string(w, 10, 19, drive->serial, sizeof(drive->serial));
-    ata_get_string(w, 23, 26, drive->rev, sizeof(drive->rev));
-    ata_get_string(w, 27, 46, drive->model, sizeof(drive->model));
+    strcpy(drive->serial, file_device.serial);
+    strcpy(drive->rev, file_device.rev);
+    strcpy(drive->model, file_device.model);
     return 1;
 }
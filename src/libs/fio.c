@@ -2,43 +2,196 @@
 #include "heap.h"
 #include "string.h"
 
-static uint32_t fio_get_block(fio_t *fio) {
-    uint32_t target_sector = fio->seek / FIO_FS_BLOCKSIZE;
+static int fio_readahead(fio_t *fio, uint32_t target) {
+    if (fio->ahead_count && target >= fio->ahead_start && target < fio->ahead_start + fio->ahead_count) {
+        uint32_t i = target - fio->ahead_start;
+        memcpy(fio->block, &fio->ahead[i], sizeof(file_data_t));
 
-    uint32_t sector;
-    uint32_t current;
-    if (fio->last_block != 0 && fio->last_sector <= target_sector) {
-        sector = fio->last_sector;
-        current = fio->last_block;
-    } else {
-        sector = 0;
-        current = fio->node->first_block;
+        fio->last_sector = target;
+        fio->last_block = fio->ahead_sector + i;
+        return 1;
     }
 
-    while (sector < target_sector) {
-        file_data(current, fio->block);
-        if (fio->block->next == 0)
-            break;
+    // only worth prefetching when stepping to the block after the one we hold
+    if (!fio->last_block || target != fio->last_sector + 1) {
+        fio->ahead_window = 1;
+        return 0;
+    }
 
-        current = fio->block->next;
-        sector++;
+    uint32_t run;
+    uint32_t sector = file_map_lookup(&fio->map, target, &run);
+    uint32_t blocks = (fio->node->size + FIO_FS_BLOCKSIZE - 1) / FIO_FS_BLOCKSIZE;
+    if (sector == 0 || target >= blocks)
+        return 0;
+
+    // a prefetch never crosses the end of the extent, those blocks are elsewhere on disk
+    uint32_t want = fio->ahead_window;
+    if (want > run)
+        want = run;
+    if (want > blocks - target)
+        want = blocks - target;
+
+    // without the buffer or a good read, the block is fetched on its own instead
+    if (!fio->ahead)
+        fio->ahead = heap_alloc(sizeof(file_data_t) * FIO_READAHEAD);
+    if (!fio->ahead || !file_data_run(sector, want, fio->ahead)) {
+        fio->ahead_count = 0;
+        fio->ahead_window = 1;
+        return 0;
     }
-    if (fio->block_cache != current) {
-        file_data(current, fio->block);
-        fio->block_cache = current;
+
+    fio->ahead_start = target;
+    fio->ahead_sector = sector;
+    fio->ahead_count = want;
+
+    if (want == fio->ahead_window && fio->ahead_window < FIO_READAHEAD)
+        fio->ahead_window *= 2;
+
+    return fio_readahead(fio, target);
+}
+
+// give the file fresh zeroed blocks up to and including the target
+static uint32_t fio_grow(fio_t *fio, uint32_t target) {
+    while (fio->map.blocks <= target) {
+        uint32_t near = FILE_NODE_SECTOR(fio->file) + 1;
+        if (fio->map.count) {
+            file_extent_t *last = &fio->map.extents[fio->map.count - 1];
+            near = last->start + last->count;
+        }
+
+        uint32_t got;
+        uint32_t sector = file_run_alloc(near, 1, &got);
+        if (sector == 0)
+            return 0;
+        if (!file_map_append(&fio->map, sector, 1)) {
+            file_run_free(sector, 1);
+            return 0;
+        }
+
+        file_data_t data = {0};
+        file_data_write(sector, &data);
+        fio->map_dirty = 1;
     }
 
-    fio->last_sector = sector;
-    fio->last_block = current;
+    return file_map_lookup(&fio->map, target, NULL);
+}
+
+// moves an inline file's bytes out to a block of their own once it outgrows the node
+static int fio_spill(fio_t *fio) {
+    if (fio->last_block != FILE_NODE_SECTOR(fio->file))
+        file_inline_read(fio->file, fio->block);
+
+    uint32_t sector = fio_grow(fio, 0);
+    if (sector == 0)
+        return 0;
+
+    file_data_write(sector, fio->block);
+    fio->node->flags &= ~FILE_INLINE;
 
-    return current;
+    fio->last_sector = 0;
+    fio->last_block = sector;
+    return 1;
+}
+
+static uint32_t fio_unpack(fio_t *fio, uint32_t target) {
+    uint32_t chunk = target / FILE_CHUNK_BLOCKS;
+    if (!fio->chunk)
+        fio->chunk = heap_alloc(FILE_CHUNK_SIZE);
+    if (!fio->chunk)
+        return 0;
+
+    if (fio->chunk_sector == 0 || fio->chunk_index != chunk) {
+        fio->chunk_sector = file_chunk_read(&fio->map, fio->node->size, chunk, fio->chunk);
+        fio->chunk_index = chunk;
+        if (fio->chunk_sector == 0)
+            return 0;
+    }
+
+    memcpy(fio->block, fio->chunk + (target % FILE_CHUNK_BLOCKS) * FIO_FS_BLOCKSIZE, sizeof(file_data_t));
+    fio->last_sector = target;
+    fio->last_block = fio->chunk_sector;
+    return fio->last_block;
+}
+
+static uint32_t fio_get_block(fio_t *fio) {
+    uint32_t target = fio->seek / FIO_FS_BLOCKSIZE;
+
+    // inline bytes are held as block 0, living in the node's sector
+    if (fio->node->flags & FILE_INLINE) {
+        fio->inline_room = file_inline_room(fio->file);
+        if (fio->seek < fio->inline_room) {
+            if (fio->last_block != FILE_NODE_SECTOR(fio->file)) {
+                file_inline_read(fio->file, fio->block);
+                fio->last_sector = 0;
+                fio->last_block = FILE_NODE_SECTOR(fio->file);
+            }
+
+            return fio->last_block;
+        }
+
+        if (fio->mode == FIO_READ || !fio_spill(fio))
+            return 0;
+    }
+
+    if (fio->last_block && fio->last_sector == target)
+        return fio->last_block;
+
+    // compressed files are only opened for reading, the block is cut out of its inflated chunk
+    if (fio->node->flags & FILE_COMPRESSED)
+        return fio_unpack(fio, target);
+
+    // the block buffer is written through in write modes, a prefetched copy would go stale
+    if (fio->mode == FIO_READ && fio_readahead(fio, target))
+        return fio->last_block;
+
+    uint32_t sector = file_map_lookup(&fio->map, target, NULL);
+    if (sector) {
+        if (!file_data_run(sector, 1, fio->block))
+            return 0;
+
+        // a block shared with a clone is written at a copy of the file's own
+        if (fio->mode != FIO_READ) {
+            uint32_t moved = 0;
+            if (!file_map_unshare(&fio->map, target, 1, &moved))
+                return 0;
+            if (moved) {
+                sector = file_map_lookup(&fio->map, target, NULL);
+                fio->map_dirty = 1;
+            }
+        }
+    } else {
+        if (fio->mode == FIO_READ)
+            return 0;
+
+        sector = fio_grow(fio, target);
+        if (sector == 0)
+            return 0;
+        memset(fio->block, 0, sizeof(file_data_t));
+    }
+
+    fio->last_sector = target;
+    fio->last_block = sector;
+
+    return sector;
+}
+
+// writes the node back, along with the extent list when blocks were added
+static void fio_store(fio_t *fio) {
+    if (fio->map_dirty) {
+        file_map_store(fio->file, fio->node, &fio->map);
+        fio->map_dirty = 0;
+    } else
+        file_node_write(fio->file, fio->node);
 }
 
 fio_t *fio_open(const char *path, uint8_t mode) {
     if (!path)
         return NULL;
 
-    uint32_t node = file_get_node(path);
+    return fio_open_node(file_get_node(path), mode);
+}
+
+fio_t *fio_open_node(uint32_t node, uint8_t mode) {
     if (!node)
         return NULL;
 
@@ -50,20 +203,40 @@ fio_t *fio_open(const char *path, uint8_t mode) {
         return NULL;
     }
 
+    // writes go to plain blocks, a compressed file is expanded first
+    if ((file->flags & FILE_COMPRESSED) && mode != FIO_READ) {
+        if (!file_expand(node)) {
+            heap_free(file);
+            return NULL;
+        }
+        file_node(node, file);
+    }
+
     fio_t *fio = heap_alloc(sizeof(fio_t));
     fio->file = node;
     fio->mode = mode;
     fio->last_sector = 0;
     fio->last_block = 0;
-    fio->block_cache = 0;
     fio->node = file;
+    file_map_load(node, file, &fio->map);
+    fio->map_dirty = 0;
+    fio->inline_room = FILE_INLINE_SLOT;
     fio->block = heap_alloc(sizeof(file_data_t));
+    fio->ahead = NULL;
+    fio->ahead_start = 0;
+    fio->ahead_sector = 0;
+    fio->ahead_count = 0;
+    fio->ahead_window = 1;
+    fio->chunk = NULL;
+    fio->chunk_index = 0;
+    fio->chunk_sector = 0;
 
     if (mode == FIO_APPEND)
         fio->seek = file->size;
     else
         fio->seek = 0;
 
+    file_handles++;
     return fio;
 }
 
@@ -71,7 +244,8 @@ int fio_getc(fio_t *fio) {
     if (fio->seek >= fio->node->size)
         return FIO_EOF;
 
-    fio_get_block(fio); // update block
+    if (!fio_get_block(fio)) // update block
+        return FIO_EOF;
 
     uint32_t char_at = fio->seek % FIO_FS_BLOCKSIZE;
     char c = fio->block->data[char_at];
@@ -93,76 +267,135 @@ int fio_eof(fio_t *fio) {
     return fio->seek >= fio->node->size;
 }
 
-static int fio_putc2(fio_t *fio, char c, int update) {
-    if (fio->mode == FIO_WRITE || fio->mode == FIO_APPEND) {
-        uint32_t block_sector = fio_get_block(fio);
-
-        uint32_t char_at = fio->seek % FIO_FS_BLOCKSIZE;
-        if (char_at == FIO_FS_BLOCKSIZE - 1) {
-            uint32_t new_block = file_sector_alloc();
-            fio->block->next = new_block;
-
-            file_data_t data = {0};
-            data.next = 0;
-            data.data[0] = '\0';
-            file_data_write(new_block, &data);
-        }
-        fio->block->data[char_at] = c;
-        fio->seek++;
-
-        if (fio->seek > fio->node->size)
-            fio->node->size = fio->seek;
-        if (update)
-            file_node_write(fio->file, fio->node);
-
-        file_data_write(block_sector, fio->block);
-        return 1;
-    } else
+int fio_putc(fio_t *fio, char c) {
+    if (fio->mode != FIO_WRITE && fio->mode != FIO_APPEND)
         return 0;
+
+    return fio_write(fio, &c, 1);
 }
 
-int fio_putc(fio_t *fio, char c) {
-    return fio_putc2(fio, c, 1);
+// bytes from the seek to the end of the block held, capped by what an inline file can hold
+static uint32_t fio_span(fio_t *fio, size_t length) {
+    uint32_t at = fio->seek % FIO_FS_BLOCKSIZE;
+    uint32_t end = (fio->node->flags & FILE_INLINE) ? fio->inline_room : FIO_FS_BLOCKSIZE;
+
+    uint32_t span = end - at;
+    if (span > length)
+        span = length;
+    return span;
 }
 
 int fio_write(fio_t *fio, const char *str, size_t length) {
     if (fio->mode == FIO_WRITE || fio->mode == FIO_APPEND) {
-        for (size_t i = 0; i < length; i++) {
-            if (!fio_putc2(fio, str[i], 0)) {
-                file_node_write(fio->file, fio->node);
+        // a block at a time, each written back once however many bytes land in it
+        size_t done = 0;
+        while (done < length) {
+            uint32_t block_sector = fio_get_block(fio);
+            if (block_sector == 0) {
+                fio_store(fio);
                 return 0;
             }
+
+            uint32_t span = fio_span(fio, length - done);
+            memcpy(&fio->block->data[fio->seek % FIO_FS_BLOCKSIZE], str + done, span);
+            fio->seek += span;
+            done += span;
+
+            if (fio->seek > fio->node->size)
+                fio->node->size = fio->seek;
+
+            if (fio->node->flags & FILE_INLINE) {
+                if (!file_inline_write(fio->file, fio->node, fio->block, fio->node->size)) {
+                    fio_store(fio);
+                    return 0;
+                }
+            } else
+                file_data_write(block_sector, fio->block);
         }
-        file_node_write(fio->file, fio->node);
+        fio_store(fio);
     }
 
     return 1;
 }
 
+// copies up to length bytes from the seek onward, returning how many there were
+static size_t fio_take(fio_t *fio, char *dest, size_t length) {
+    size_t done = 0;
+    while (done < length && fio->seek < fio->node->size) {
+        if (!fio_get_block(fio))
+            break;
+
+        uint32_t span = fio_span(fio, length - done);
+        if (span > fio->node->size - fio->seek)
+            span = fio->node->size - fio->seek;
+
+        memcpy(dest + done, &fio->block->data[fio->seek % FIO_FS_BLOCKSIZE], span);
+        fio->seek += span;
+        done += span;
+    }
+
+    return done;
+}
+
 int fio_read(fio_t *fio, char *dest, size_t length) {
     if (length == 0 || fio->mode != FIO_READ)
         return 0;
 
-    char c;
-    size_t i = 0;
-
     if (fio->seek >= fio->node->size)
         return 0;
 
-    size_t seek = fio->seek;
-    while (i < length - 1 && i < fio->node->size - seek) {
-        c = fio_getc(fio);
-        dest[i++] = c;
+    fio_take(fio, dest, length - 1);
+    return 1;
+}
+
+int fio_copy(uint32_t source, uint32_t dest) {
+    file_node_t node;
+    file_node(dest, &node);
+    if (!(node.flags & FILE_DATA))
+        return 0;
+    if (source == dest)
+        return 1;
+
+    fio_t *from = fio_open_node(source, FIO_READ);
+    if (!from)
+        return 0;
+
+    // start the destination empty so a longer old file leaves no tail
+    fio_t *to = file_write(dest, "", 0) ? fio_open_node(dest, FIO_WRITE) : NULL;
+    char *ring = to ? heap_alloc(FIO_COPY_BLOCKS * FIO_FS_BLOCKSIZE) : NULL;
+    if (!ring) {
+        fio_close(to);
+        fio_close(from);
+        return 0;
     }
 
-    return 1;
+    int status = 1;
+    while (status && !fio_eof(from)) {
+        size_t got = fio_take(from, ring, FIO_COPY_BLOCKS * FIO_FS_BLOCKSIZE);
+        if (got == 0 || !fio_write(to, ring, got))
+            status = 0;
+    }
+
+    heap_free(ring);
+    fio_close(from);
+    fio_close(to);
+    return status;
 }
 
 int fio_close(fio_t *fio) {
     if (!fio) return 0;
 
+    if (fio->mode == FIO_WRITE || fio->mode == FIO_APPEND)
+        file_commit();
+
+    file_map_free(&fio->map);
     heap_free(fio->node);
     heap_free(fio->block);
+    if (fio->ahead)
+        heap_free(fio->ahead);
+    if (fio->chunk)
+        heap_free(fio->chunk);
     heap_free(fio);
+    file_handles--;
     return 1;
 }
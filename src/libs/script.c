@@ -99,6 +99,7 @@ static script_node_t *call_ata_slot(script_node_t *node);
 static script_node_t *call_ata_serial(script_node_t *node);
 static script_node_t *call_ata_rev(script_node_t *node);
 static script_node_t *call_ata_model(script_node_t *node);
+static script_node_t *call_io_stats(script_node_t *node);
 static script_node_t *call_cpu_name(script_node_t *node);
 static script_node_t *call_cpu_vendor(script_node_t *node);
 static script_node_t *call_cpu_family(script_node_t *node);
@@ -170,6 +171,7 @@ static const script_builtin_entry_t builtins[] = {
     { "ata_serial", call_ata_serial },
     { "ata_rev", call_ata_rev },
     { "ata_model", call_ata_model },
+    { "io_stats", call_io_stats },
     { "cpu_name", call_cpu_name },
     { "cpu_vendor", call_cpu_vendor },
     { "cpu_family", call_cpu_family },
@@ -2083,6 +2085,22 @@ static script_node_t *call_ata_model(script_node_t *node) {
     return value;
 }
 
+static script_node_t *call_io_stats(script_node_t *node) {
+    script_node_t *list = call_list_init(node);
+    blkdev_stats_t *stats = &file_device.stats;
+
+    // reads, writes, read sectors, written sectors, flushes, errors, retries, timeouts
+    uint32_t values[] = {
+        stats->reads, stats->writes, stats->read_sectors, stats->write_sectors,
+        stats->flushes, stats->errors, stats->retries, stats->timeouts
+    };
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        list_push(list->literal.list, (void*)node_int((int)values[i]));
+
+    return list;
+}
+
 static script_node_t *call_exit(script_node_t *node) {
     size_t argc = node->call.argc;
     script_node_t **argv = node->call.argv;
@@ -23,16 +23,21 @@ void pci_write_config(uint32_t value, uint8_t bus, uint8_t dev, uint8_t func, ui
 }
 
 int pci_get_device(pci_device_t *device, uint8_t bus, uint8_t dev) {
-	uint32_t id = pci_read_config(bus, dev, 0, PCI_REG_ID);
+	return pci_get_function(device, bus, dev, 0);
+}
+
+int pci_get_function(pci_device_t *device, uint8_t bus, uint8_t dev, uint8_t func) {
+	uint32_t id = pci_read_config(bus, dev, func, PCI_REG_ID);
 	if (PCI_VENDOR(id) == 0xFFFF)
 		return 0;
 
-	uint32_t code = pci_read_config(bus, dev, 0, PCI_REG_CODE);
-	uint32_t header = pci_read_config(bus, dev, 0, 0xC); // only for getting header type
+	uint32_t code = pci_read_config(bus, dev, func, PCI_REG_CODE);
+	uint32_t header = pci_read_config(bus, dev, func, 0xC); // only for getting header type
 
 	if (device) {
 		device->bus = bus;
 		device->dev = dev;
+		device->func = func;
 
 		device->device_id = PCI_DEVICE(id);
 		device->vendor_id = PCI_VENDOR(id);
@@ -47,6 +52,46 @@ int pci_get_device(pci_device_t *device, uint8_t bus, uint8_t dev) {
 	return 1;
 }
 
+static int pci_match_class(pci_device_t *found, uint16_t a, uint16_t b) {
+	return found->class_code == a && found->subclass == b;
+}
+
+static int pci_match_id(pci_device_t *found, uint16_t a, uint16_t b) {
+	return found->vendor_id == a && found->device_id == b;
+}
+
+static int pci_scan(pci_device_t *device, int (*match)(pci_device_t*, uint16_t, uint16_t), uint16_t a, uint16_t b) {
+	for (int bus = 0; bus < PCI_MAX_BUS; bus++) {
+		for (int dev = 0; dev < PCI_MAX_DEV; dev++) {
+			pci_device_t found = {0};
+			if (!pci_get_device(&found, bus, dev))
+				continue;
+
+			int funcs = (found.header_type & PCI_HEADER_MULTIFUNC) ? PCI_MAX_FUNC : 1;
+			for (int func = 0; func < funcs; func++) {
+				if (!pci_get_function(&found, bus, dev, func))
+					continue;
+
+				if (match(&found, a, b)) {
+					if (device)
+						*device = found;
+					return 1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+int pci_find_class(pci_device_t *device, uint8_t class_code, uint8_t subclass) {
+	return pci_scan(device, pci_match_class, class_code, subclass);
+}
+
+int pci_find_id(pci_device_t *device, uint16_t vendor_id, uint16_t device_id) {
+	return pci_scan(device, pci_match_id, vendor_id, device_id);
+}
+
 uint32_t pci_device_read(pci_device_t *device, uint8_t func, uint8_t offset) {
 	return pci_read_config(device->bus, device->dev, func, offset);
 }
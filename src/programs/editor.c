@@ -60,15 +60,9 @@ static context_t get_context(void) {
 }
 
 static size_t get_block_size() {
-    if (edit_node != 0) {
-        file_node_t file;
-        file_node(edit_node, &file);
-
-        file_data_t block;
-        file_data(file.first_block, &block);
-
-        return sizeof(block.data);
-    } else return 1;
+    if (edit_node != 0)
+        return FILE_BLOCK_SIZE;
+    else return 1;
 }
 
 static int find_line_start(int pos) {
@@ -213,9 +207,8 @@ void edit_init(uint32_t file_sector) {
     edit_saveas = 0;
 
     edit_node = file_sector;
-    if (file_sector != 0)
-        edit_buffer = file_read(file_sector);
-    else {
+    edit_buffer = file_sector != 0 ? file_read(file_sector) : NULL;
+    if (!edit_buffer) {
         edit_buffer = heap_alloc(1);
         memset(edit_buffer, 0, 1);
     }